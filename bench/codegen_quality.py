@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""Generated-code quality benchmark: JIT'd Kaleidoscope vs. native C.
+
+Every kernel in bench/kernels exists twice, as <name>.k (defining
+kernel(n)) and as <name>.c (defining double kernel(double n) with the same
+algorithm). Kaleidoscope has no mutable variables, so loops are written as
+recursion in both; the comparison is of code generation, not of algorithms.
+
+For each kernel the C version is built with the system compiler at -O2 and
+timed by harness.c. The Kaleidoscope version is run through ./ast at each
+-O level, timing only the execute phase of the final kernel(n) call through
+-telemetry-json (compilation is excluded). Both results are checked against
+each other. One JSON line is printed per kernel:
+
+  {"kernel": "fib", "n": 30, "result": 832040.0, "c_us": ...,
+   "O0_us": ..., "O0_ratio": ..., ..., "O3_us": ..., "O3_ratio": ...}
+
+A ratio is JIT time / C time, so 1.0 means parity and higher is slower.
+
+Usage: bench/codegen_quality.py [--ast ./ast] [--cc cc] [--repeat 3]
+                                [--levels 0,1,2,3] [--out results.jsonl]
+"""
+
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+KERNELS = os.path.join(HERE, "kernels")
+
+# Kernel name -> n. Halving kernels need a power of two.
+SIZES = [
+    ("fib", 30),
+    ("mandelbrot", 256),
+    ("integrate", 1 << 21),
+    ("loopnest", 1 << 11),
+    ("reduction", 1 << 21),
+    ("mathloop", 1 << 19),
+]
+
+
+def build_native(cc, name, tmp):
+    exe = os.path.join(tmp, name)
+    subprocess.check_call([cc, "-O2", os.path.join(KERNELS, "harness.c"),
+                           os.path.join(KERNELS, name + ".c"), "-lm",
+                           "-o", exe])
+    return exe
+
+
+def run_native(exe, n, repeat):
+    out = subprocess.check_output([exe, str(n), str(repeat)]).split()
+    return float(out[0]), float(out[1])
+
+
+def run_jit(ast, level, source, n, repeat, tmp):
+    """Best execute time of kernel(n) at -O<level>, and its result."""
+    prog = os.path.join(tmp, "prog.k")
+    telemetry = os.path.join(tmp, "telemetry.json")
+    with open(source) as f, open(prog, "w") as p:
+        p.write(f.read())
+        p.write("\n" + "kernel(%r);\n" % n * repeat)
+    with open(prog) as stdin:
+        proc = subprocess.run([ast, "-O%d" % level,
+                               "-telemetry-json=" + telemetry],
+                              stdin=stdin, stdout=subprocess.DEVNULL,
+                              stderr=subprocess.PIPE, universal_newlines=True)
+    if proc.returncode != 0:
+        sys.exit("%s -O%d failed on %s" % (ast, level, source))
+    results = re.findall(r"Evaluated to (\S+)", proc.stderr)
+    with open(telemetry) as f:
+        items = json.load(f)["items"]
+    times = [it["phases_us"]["execute"] for it in items
+             if it["kind"] == "expression"]
+    return float(results[-1]), min(times)
+
+
+def close(a, b):
+    return abs(a - b) <= 1e-6 * max(1.0, abs(a), abs(b))
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    p.add_argument("--ast", default="./ast")
+    p.add_argument("--cc", default="cc")
+    p.add_argument("--repeat", type=int, default=3)
+    p.add_argument("--levels", default="0,1,2,3")
+    p.add_argument("--out", help="also append the JSON lines to this file")
+    args = p.parse_args()
+    levels = [int(l) for l in args.levels.split(",")]
+
+    out = open(args.out, "a") if args.out else None
+    with tempfile.TemporaryDirectory(prefix="ks-quality-") as tmp:
+        for name, n in SIZES:
+            exe = build_native(args.cc, name, tmp)
+            c_result, c_us = run_native(exe, n, args.repeat)
+            row = {"kernel": name, "n": n, "result": c_result,
+                   "c_us": round(c_us, 1)}
+            for level in levels:
+                result, us = run_jit(args.ast, level,
+                                     os.path.join(KERNELS, name + ".k"), n,
+                                     args.repeat, tmp)
+                if not close(result, c_result):
+                    sys.exit("%s: -O%d computed %r, C computed %r"
+                             % (name, level, result, c_result))
+                row["O%d_us" % level] = round(us, 1)
+                row["O%d_ratio" % level] = round(us / c_us, 2) if c_us else None
+            line = json.dumps(row)
+            print(line)
+            if out:
+                out.write(line + "\n")
+    if out:
+        out.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+"""End-to-end compile latency benchmark for the Kaleidoscope JIT.
+
+Generates a set of workloads, runs ./ast over each with -telemetry-json and
+prints one JSON object per workload (JSON lines), so results can be diffed
+or fed into a dashboard across commits:
+
+  {"workload": "many_tiny_defs", "items": 2001, "lex_us": ..., "parse_us": ...,
+   "codegen_us": ..., "optimize_us": ..., "materialize_us": ...,
+   "first_call_us": ..., "wall_ms": ..., "peak_rss_kb": ...}
+
+Phase times come from the driver's own telemetry (see
+include/CompileTelemetry.h). codegen includes IR verification; materialize
+is add-module + emit (telemetry's link phase also counts time spent waiting
+on other modules, so it is not summed); first_call is the execute phase of
+every top-level expression, i.e. running code that is already materialized.
+The JIT compiles lazily, but the lookup before each expression runs emits
+and links everything the expression reaches, so none of that lands in
+first_call. ast runs with -quiet, so wall time does not include printing
+each item's IR. Each workload runs --repeat times and the fastest run (by
+wall time) is kept.
+
+Usage: bench/compile_latency.py [--ast ./ast] [--repeat 3] [--scale 1]
+                                [--out results.jsonl] [-- extra ast flags]
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def many_tiny_defs(n):
+    lines = ["def tiny%d(x) x + %d;" % (i, i) for i in range(n)]
+    # Definitions are compiled lazily; call them all so every one is emitted.
+    for base in range(0, n, 100):
+        lines.append(" + ".join("tiny%d(1)" % i
+                                for i in range(base, min(n, base + 100))) + ";")
+    return lines
+
+
+def few_huge_defs(n):
+    lines = []
+    for d in range(4):
+        terms = " + ".join("x*%d - y" % (i % 7 + 1) for i in range(n))
+        lines.append("def huge%d(x y) %s;" % (d, terms))
+    lines.append(" + ".join("huge%d(1, 2)" % d for d in range(4)) + ";")
+    return lines
+
+
+def deep_nesting(n):
+    expr = "x"
+    for i in range(n):
+        expr = "(%s + %d)" % (expr, i % 10)
+    ifs = "x"
+    for i in range(n // 4):
+        ifs = "if x < %d then %s else %d" % (i, ifs, i)
+    return ["def deepadd(x) %s;" % expr, "def deepif(x) %s;" % ifs,
+            "deepadd(1);", "deepif(1);"]
+
+
+def repl_session(n):
+    lines = ["def inc(x) x + 1;"]
+    lines += ["inc(%d) * %d - %d;" % (i, i % 5, i % 3) for i in range(n)]
+    return lines
+
+
+def extern_heavy(n):
+    lines = ["extern sin(x);", "extern cos(x);", "extern sqrt(x);",
+             "extern exp(x);", "extern putchard(x);", "extern printd(x);"]
+    for i in range(n):
+        lines.append("def ext%d(x) sin(x) * cos(x) + sqrt(x + %d) - exp(x * 0.01);"
+                     % (i, i))
+    for base in range(0, n, 100):
+        lines.append(" + ".join("ext%d(1)" % i
+                                for i in range(base, min(n, base + 100))) + ";")
+    return lines
+
+
+WORKLOADS = [
+    ("many_tiny_defs", many_tiny_defs, 2000),
+    ("few_huge_defs", few_huge_defs, 2000),
+    ("deep_nesting", deep_nesting, 400),
+    ("repl_session", repl_session, 2000),
+    ("extern_heavy", extern_heavy, 500),
+]
+
+
+def run_once(ast, flags, source, telemetry):
+    """Run ast on source; return (wall ms, peak RSS KiB, telemetry dict)."""
+    with open(source) as stdin, open(os.devnull, "w") as null:
+        start = time.monotonic()
+        proc = subprocess.Popen([ast, "-quiet", "-telemetry-json=" + telemetry]
+                                + flags,
+                                stdin=stdin, stdout=null, stderr=null)
+        _, status, usage = os.wait4(proc.pid, 0)
+        wall = (time.monotonic() - start) * 1000
+    if status != 0:
+        sys.exit("%s failed on %s (status %d)" % (ast, source, status))
+    with open(telemetry) as f:
+        return wall, usage.ru_maxrss, json.load(f)
+
+
+def summarize(name, wall, rss, data):
+    totals = data["totals"]["phases_us"]
+    first_call = sum(it["phases_us"]["execute"]
+                     for it in data["items"] if it["kind"] == "expression")
+    return {
+        "workload": name,
+        "items": data["totals"]["items"],
+        "ir_bytes": data["totals"]["ir_bytes"],
+        "code_bytes": data["totals"]["code_bytes"],
+        "lex_us": round(totals["lex"], 1),
+        "parse_us": round(totals["parse"], 1),
+        "codegen_us": round(totals["codegen"] + totals["verify"], 1),
+        "optimize_us": round(totals["optimize"], 1),
+        "materialize_us": round(totals["add-module"] + totals["emit"], 1),
+        "first_call_us": round(first_call, 1),
+        "wall_ms": round(wall, 1),
+        "peak_rss_kb": rss,
+    }
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    p.add_argument("--ast", default="./ast")
+    p.add_argument("--repeat", type=int, default=3)
+    p.add_argument("--scale", type=float, default=1.0,
+                   help="multiply every workload's size")
+    p.add_argument("--out", help="also append the JSON lines to this file")
+    p.add_argument("flags", nargs="*", help="extra flags for ast, after --")
+    args = p.parse_args()
+
+    out = open(args.out, "a") if args.out else None
+    with tempfile.TemporaryDirectory(prefix="ks-bench-") as tmp:
+        telemetry = os.path.join(tmp, "telemetry.json")
+        for name, gen, size in WORKLOADS:
+            source = os.path.join(tmp, name + ".k")
+            with open(source, "w") as f:
+                f.write("\n".join(gen(max(1, int(size * args.scale)))) + "\n")
+            best = None
+            for _ in range(args.repeat):
+                run = run_once(args.ast, args.flags, source, telemetry)
+                if best is None or run[0] < best[0]:
+                    best = run
+            line = json.dumps(summarize(name, *best))
+            print(line)
+            if out:
+                out.write(line + "\n")
+    if out:
+        out.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,10 @@
+/* Naive doubly recursive Fibonacci: call overhead and branches. */
+static double fib(double x)
+{
+	return x < 3 ? 1 : fib(x - 1) + fib(x - 2);
+}
+
+double kernel(double n)
+{
+	return fib(n);
+}
@@ -0,0 +1,26 @@
+/* Times kernel(n) for the native baselines of bench/codegen_quality.py.
+ * Prints "<result> <microseconds>" for the fastest of <repeat> runs. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+double kernel(double n);
+
+int main(int argc, char **argv)
+{
+	double n = argc > 1 ? atof(argv[1]) : 10;
+	int repeat = argc > 2 ? atoi(argv[2]) : 1;
+	double result = 0, best = -1;
+	for(int i = 0; i < repeat; ++i)
+	{
+		struct timespec a, b;
+		clock_gettime(CLOCK_MONOTONIC, &a);
+		result = kernel(n);
+		clock_gettime(CLOCK_MONOTONIC, &b);
+		double us = (b.tv_sec - a.tv_sec) * 1e6 + (b.tv_nsec - a.tv_nsec) / 1e3;
+		if(best < 0 || us < best)
+			best = us;
+	}
+	printf("%f %f\n", result, best);
+	return 0;
+}
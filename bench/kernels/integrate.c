@@ -0,0 +1,18 @@
+/* Midpoint-rule integral of 4/(1+x^2) over [0,1] (= pi) with n (a power of
+ * two) steps, summed by halving so the recursion stays log2(n) deep. */
+static double integrand(double x)
+{
+	return 4 / (1 + x * x);
+}
+
+static double integ(double base, double size, double h)
+{
+	if(size < 2)
+		return integrand((base + 0.5) * h);
+	return integ(base, size / 2, h) + integ(base + size / 2, size / 2, h);
+}
+
+double kernel(double n)
+{
+	return integ(0, n, 1 / n) / n;
+}
@@ -0,0 +1,20 @@
+/* Sum of i*j over an n x n iteration space (n a power of two); the outer
+ * and inner "loops" are halving recursions. */
+static double inner(double i, double base, double size)
+{
+	if(size < 2)
+		return i * base * 0.5;
+	return inner(i, base, size / 2) + inner(i, base + size / 2, size / 2);
+}
+
+static double outer(double base, double size, double n)
+{
+	if(size < 2)
+		return inner(base, 0, n);
+	return outer(base, size / 2, n) + outer(base + size / 2, size / 2, n);
+}
+
+double kernel(double n)
+{
+	return outer(0, n, n);
+}
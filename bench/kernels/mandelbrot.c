@@ -0,0 +1,24 @@
+/* Total escape-time iterations over an n x n grid of [-2,1] x [-1,1]. */
+static double mandelIter(double cr, double ci, double zr, double zi, double it)
+{
+	if(!(it < 256))
+		return it;
+	if(!(zr * zr + zi * zi < 4))
+		return it;
+	return mandelIter(cr, ci, zr * zr - zi * zi + cr, 2 * zr * zi + ci, it + 1);
+}
+
+static double mandelRow(double y, double x, double n, double acc)
+{
+	return x < n ? mandelRow(y, x + 1, n, acc + mandelIter(x * 3 / n - 2, y * 2 / n - 1, 0, 0, 0)) : acc;
+}
+
+static double mandelRows(double y, double n, double acc)
+{
+	return y < n ? mandelRows(y + 1, n, mandelRow(y, 0, n, acc)) : acc;
+}
+
+double kernel(double n)
+{
+	return mandelRows(0, n, 0);
+}
@@ -0,0 +1,19 @@
+/* libm-heavy reduction: sin, cos, sqrt and exp per element (n a power of two). */
+#include <math.h>
+
+static double elem(double i)
+{
+	return sin(i * 0.001) * cos(i * 0.002) + sqrt(i) - exp(0 - i * 0.000001);
+}
+
+static double msum(double base, double size)
+{
+	if(size < 2)
+		return elem(base);
+	return msum(base, size / 2) + msum(base + size / 2, size / 2);
+}
+
+double kernel(double n)
+{
+	return msum(0, n);
+}
@@ -0,0 +1,17 @@
+/* Polynomial reduction over 0..n-1 (n a power of two) by pairwise summation. */
+static double term(double i)
+{
+	return i * i * 0.5 - 3 * i + 1;
+}
+
+static double reduce(double base, double size)
+{
+	if(size < 2)
+		return term(base);
+	return reduce(base, size / 2) + reduce(base + size / 2, size / 2);
+}
+
+double kernel(double n)
+{
+	return reduce(0, n);
+}
@@ -0,0 +1,88 @@
+//===- tm_reuse.cpp - Per-module cost of TargetMachine creation ----------===//
+//
+// Compiles many small Kaleidoscope-shaped modules (one double(double, double)
+// function each) with ConcurrentIRCompiler, which builds a TargetMachine per
+// module, and with ThreadLocalTMCompiler, which reuses one per thread, and
+// reports the average compile latency of each.
+//
+// Usage: tm_reuse [modules]    (default 2000)
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include "../include/ThreadLocalTMCompiler.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+static ExitOnError ExitOnErr;
+
+/// Build "def fN(a b) a*a + 2*a*b + b*b" as its own module.
+static std::unique_ptr<Module> makeModule(LLVMContext &Ctx, unsigned N,
+                                          const DataLayout &DL) {
+  auto M = std::make_unique<Module>("bench" + std::to_string(N), Ctx);
+  M->setDataLayout(DL);
+  auto *D = Type::getDoubleTy(Ctx);
+  auto *F = Function::Create(FunctionType::get(D, {D, D}, false),
+                             Function::ExternalLinkage,
+                             "f" + std::to_string(N), M.get());
+  IRBuilder<> B(BasicBlock::Create(Ctx, "entry", F));
+  Value *A = F->getArg(0), *C = F->getArg(1);
+  Value *AA = B.CreateFMul(A, A);
+  Value *AB = B.CreateFMul(B.CreateFMul(ConstantFP::get(D, 2.0), A), C);
+  Value *CC = B.CreateFMul(C, C);
+  B.CreateRet(B.CreateFAdd(B.CreateFAdd(AA, AB), CC));
+  return M;
+}
+
+/// Compile Count modules with Compile and return the mean microseconds per
+/// module.
+static double run(IRCompileLayer::IRCompiler &Compile, unsigned Count,
+                  const DataLayout &DL) {
+  LLVMContext Ctx;
+  auto Start = std::chrono::steady_clock::now();
+  for (unsigned I = 0; I != Count; ++I) {
+    auto M = makeModule(Ctx, I, DL);
+    ExitOnErr(Compile(*M));
+  }
+  auto End = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::micro>(End - Start).count() /
+         Count;
+}
+
+int main(int argc, char **argv) {
+  unsigned Count = argc > 1 ? std::atoi(argv[1]) : 2000;
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+
+  auto JTMB = ExitOnErr(JITTargetMachineBuilder::detectHost());
+  auto DL = ExitOnErr(JTMB.getDefaultDataLayoutForTarget());
+
+  ConcurrentIRCompiler PerModule(JTMB);
+  ThreadLocalTMCompiler PerThread(JTMB);
+
+  // Warm both up so one-time costs (pass registration, etc.) aren't counted.
+  run(PerModule, 10, DL);
+  run(PerThread, 10, DL);
+
+  double PerModuleUs = run(PerModule, Count, DL);
+  double PerThreadUs = run(PerThread, Count, DL);
+
+  printf("{\"modules\": %u, \"concurrent_ir_compiler_us\": %.2f, "
+         "\"thread_local_tm_compiler_us\": %.2f, \"saving_us\": %.2f}\n",
+         Count, PerModuleUs, PerThreadUs, PerModuleUs - PerThreadUs);
+  return 0;
+}
@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+"""Checks for ./ast -result-cache.
+
+Each case runs a short program through ./ast with -result-cache and
+-telemetry-json, and compares, per top-level expression, the value it
+evaluated to and whether it ran. An expression answered from the cache is
+neither compiled nor executed, so its telemetry shows no codegen and no
+execute time.
+
+Usage: checks/result_cache.py [--ast ./ast] [-- extra ast flags]
+Exits non-zero if any case fails.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+# (name, program, [(value, ran), ...] for each top-level expression)
+CASES = [
+    ("hit",
+     ["def sq(x) x * x;", "sq(4);", "sq(4);", "sq(5);"],
+     [(16, True), (16, False), (25, True)]),
+    # Redefining f evicts g(3), and g, compiled against the old f, now
+    # calls the new one.
+    ("eviction after redefinition",
+     ["def f(x) x * 2;", "def g(x) f(x) + 1;", "g(3);", "g(3);",
+      "def f(x) x * 3;", "g(3);", "g(3);"],
+     [(7, True), (7, False), (10, True), (10, False)]),
+    # k only calls h, but h prints, so neither is pure and k(2) runs each
+    # time; pure expressions around it are still cached.
+    ("impure barrier",
+     ["extern printd(x);", "def h(x) printd(x) * 0 + x;",
+      "def k(x) h(x) + 1;", "k(2) * 2;", "k(2) * 2;", "2 + 2;", "2 + 2;"],
+     [(6, True), (6, True), (4, True), (4, False)]),
+    ("impure never cached",
+     ["extern printd(x);", "printd(1);", "printd(1);", "printd(1);"],
+     [(0, True), (0, True), (0, True)]),
+]
+
+
+def run(ast, extra, lines):
+    with tempfile.TemporaryDirectory() as tmp:
+        tel = os.path.join(tmp, "telemetry.json")
+        proc = subprocess.run(
+            [ast, "-quiet", "-result-cache", "-telemetry-json=" + tel] + extra,
+            input="\n".join(lines) + "\n", capture_output=True, text=True)
+        with open(tel) as f:
+            items = json.load(f)["items"]
+    values = [float(l.split()[-1]) for l in proc.stderr.splitlines()
+              if l.startswith("Evaluated to")]
+    ran = [it["phases_us"]["codegen"] > 0 or it["phases_us"]["execute"] > 0
+           for it in items if it["kind"] == "expression"]
+    return proc.returncode, list(zip(values, ran)), proc.stderr
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--ast", default="./ast")
+    ap.add_argument("extra", nargs="*")
+    args = ap.parse_args()
+
+    failed = 0
+    for name, lines, expected in CASES:
+        rc, got, stderr = run(args.ast, args.extra, lines)
+        want = [(float(v), r) for v, r in expected]
+        ok = rc == 0 and got == want
+        print("%s: %s" % ("ok" if ok else "FAIL", name))
+        if not ok:
+            failed += 1
+            print("  want %s\n  got  %s (exit %d)" % (want, got, rc))
+            sys.stdout.write(stderr)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,67 @@
+// Embeds several Kaleidoscope engines in one process, one per thread. Each
+// engine defines the same names with different bodies, which cannot clash
+// because every engine has its own JIT.
+//
+//   make embed && ./examples/embed [threads]
+
+#include "../include/KaleidoscopeEngine.h"
+
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+static ExitOnError ExitOnErr;
+
+static void runEngine(unsigned Id, double &Result) {
+  auto E = ExitOnErr(KaleidoscopeEngine::Create());
+  ExitOnErr(E->compile("def fib(x) if x < 3 then 1 else fib(x-1) + fib(x-2);\n"
+                       "def scale(x) x * " + std::to_string(Id + 1) + ";\n"));
+
+  auto *Fib = ExitOnErr(E->lookup<double(double)>("fib"));
+  auto *Scale = ExitOnErr(E->lookup<double(double)>("scale"));
+  double Direct = Scale(Fib(20));
+  double Evaluated = ExitOnErr(E->evaluate("scale(fib(20))"));
+  if (Direct != Evaluated) {
+    errs() << "engine " << Id << ": " << Direct << " != " << Evaluated << "\n";
+    exit(1);
+  }
+
+  // The same function with its arity only known at run time.
+  auto Generic = ExitOnErr(E->lookupGeneric("scale"));
+  std::vector<double> Args(Generic.getArity(), Fib(20));
+  if (Generic(Args) != Direct ||
+      ExitOnErr(E->call("scale", {Fib(20)})) != Direct) {
+    errs() << "engine " << Id << ": generic call disagrees\n";
+    exit(1);
+  }
+
+  // Errors come back as values; the engine stays usable.
+  if (auto Err = E->compile("def broken(x) y;"))
+    consumeError(std::move(Err));
+  else
+    exit(1);
+  Result = Evaluated;
+}
+
+int main(int argc, char **argv) {
+  ExitOnErr.setBanner("embed: ");
+  unsigned N = argc > 1 ? atoi(argv[1]) : 4;
+
+  std::vector<double> Results(N);
+  std::vector<std::thread> Threads;
+  for (unsigned I = 0; I != N; ++I)
+    Threads.emplace_back(runEngine, I, std::ref(Results[I]));
+  for (auto &T : Threads)
+    T.join();
+
+  for (unsigned I = 0; I != N; ++I)
+    printf("engine %u: scale(fib(20)) = %.0f\n", I, Results[I]);
+  return 0;
+}
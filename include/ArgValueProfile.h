@@ -0,0 +1,102 @@
+//===- ArgValueProfile.h - Argument value stability for JIT'd code -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Tracks, for every argument of every profiled function, the last value it
+// was sampled with and for how many samples in a row that value has been
+// seen. JIT'd code counts its calls in the function's Site and, on every
+// SamplePeriod'th, updates the argument Slots inline; the driver polls
+// getStableArgs() between top-level items to find arguments worth
+// specializing on.
+//
+// JIT'd code may run on several threads at once (-batch, or a host calling
+// through lookup()), so every field is only accessed with relaxed atomics.
+// Racing samples can cut a run short or attribute it to the wrong value;
+// that only costs a specialization, never correctness, since a
+// specialization is only entered with the values it was made for.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_ARGVALUEPROFILE_H
+#define LLVM_EXECUTIONENGINE_ORC_ARGVALUEPROFILE_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace llvm {
+namespace orc {
+
+class ArgValueProfile {
+public:
+  /// Calls between samples; a power of two.
+  static constexpr uint64_t SamplePeriod = 8;
+
+  /// One argument's last sampled value and how many samples in a row had
+  /// it; Run is 0 until the first sample.
+  struct Slot {
+    std::atomic<double> Value;
+    std::atomic<uint64_t> Run;
+  };
+
+  /// One function's calls and argument slots.
+  struct Site {
+    std::atomic<uint64_t> Calls;
+    Slot *Slots;
+  };
+
+  /// Allocate a zeroed site for the NumArgs arguments of Name. It stays put
+  /// for the rest of the session.
+  Site *addFunction(StringRef Name, unsigned NumArgs) {
+    std::lock_guard<std::mutex> Lock(M);
+    auto &E = Functions[Name];
+    E.Slots.reset(new Slot[NumArgs]());
+    E.NumArgs = NumArgs;
+    E.S.reset(new Site());
+    E.S->Slots = E.Slots.get();
+    return E.S.get();
+  }
+
+  /// Arguments of Name that have taken the same value for about the last
+  /// MinRun calls, by argument index.
+  std::map<unsigned, double> getStableArgs(StringRef Name, uint64_t MinRun) {
+    std::lock_guard<std::mutex> Lock(M);
+    std::map<unsigned, double> Stable;
+    auto I = Functions.find(Name);
+    if (I == Functions.end())
+      return Stable;
+    uint64_t MinSamples = std::max<uint64_t>(
+        (MinRun + SamplePeriod - 1) / SamplePeriod, 1);
+    for (unsigned A = 0; A != I->second.NumArgs; ++A) {
+      Slot &S = I->second.Slots[A];
+      if (S.Run.load(std::memory_order_relaxed) >= MinSamples)
+        Stable[A] = S.Value.load(std::memory_order_relaxed);
+    }
+    return Stable;
+  }
+
+private:
+  struct Entry {
+    std::unique_ptr<Site> S;
+    std::unique_ptr<Slot[]> Slots;
+    unsigned NumArgs = 0;
+  };
+
+  std::mutex M;
+  StringMap<Entry> Functions;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_ARGVALUEPROFILE_H
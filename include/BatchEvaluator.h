@@ -0,0 +1,109 @@
+//===- BatchEvaluator.h - Run compiled expressions on many cores -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Runs a batch of independent expressions, compiled up front by
+// KaleidoscopeEngine::compileBatch(), on a set of worker threads. The batch
+// is cut into contiguous shards, one per worker, so concatenating the
+// workers' output in shard order gives the output in input order with no
+// per-item synchronization. Each worker formats its results into a buffer of
+// its own and is pinned to a core of the process's affinity mask, keeping
+// its code and data in one core's caches.
+//
+// The expressions must be independent: nothing orders the side effects of
+// expressions in different shards.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_BATCHEVALUATOR_H
+#define LLVM_EXECUTIONENGINE_ORC_BATCHEVALUATOR_H
+
+#include "KaleidoscopeEngine.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+namespace llvm {
+namespace orc {
+
+class BatchEvaluator {
+public:
+  using ExpressionFn = KaleidoscopeEngine::ExpressionFn;
+
+  /// Run on Threads workers (0 for one per core we may run on), pinned to
+  /// a core each if Pin is set.
+  explicit BatchEvaluator(unsigned Threads, bool Pin = true) : Pin(Pin) {
+    cpu_set_t Allowed;
+    CPU_ZERO(&Allowed);
+    if (sched_getaffinity(0, sizeof(Allowed), &Allowed) == 0)
+      for (int CPU = 0; CPU != CPU_SETSIZE; ++CPU)
+        if (CPU_ISSET(CPU, &Allowed))
+          CPUs.push_back(CPU);
+    NumThreads = Threads ? Threads : std::max<size_t>(1, CPUs.size());
+  }
+
+  unsigned getNumThreads() const { return NumThreads; }
+
+  /// Run every expression and write one line per expression to OS, in input
+  /// order: its value, or "error" for expressions that failed to compile.
+  void run(ArrayRef<ExpressionFn> Exprs, raw_ostream &OS) {
+    unsigned N = std::max<size_t>(1, std::min<size_t>(NumThreads, Exprs.size()));
+    std::vector<std::string> Out(N);
+    std::vector<std::thread> Workers;
+    for (unsigned I = 0; I != N; ++I) {
+      size_t Begin = Exprs.size() * I / N, End = Exprs.size() * (I + 1) / N;
+      Workers.emplace_back([this, I, &Out, Shard = Exprs.slice(Begin, End - Begin)] {
+        pin(I);
+        runShard(Shard, Out[I]);
+      });
+    }
+    for (auto &W : Workers)
+      W.join();
+    for (auto &S : Out)
+      OS << S;
+  }
+
+private:
+  void pin(unsigned Worker) {
+    if (!Pin || CPUs.empty())
+      return;
+    cpu_set_t Set;
+    CPU_ZERO(&Set);
+    CPU_SET(CPUs[Worker % CPUs.size()], &Set);
+    pthread_setaffinity_np(pthread_self(), sizeof(Set), &Set);
+  }
+
+  static void runShard(ArrayRef<ExpressionFn> Shard, std::string &Buf) {
+    raw_string_ostream OS(Buf);
+    for (ExpressionFn Fn : Shard) {
+      if (Fn)
+        OS << format("%f\n", Fn());
+      else
+        OS << "error\n";
+    }
+    OS.flush();
+  }
+
+  bool Pin;
+  unsigned NumThreads;
+  /// Cores in the process's affinity mask, in order.
+  std::vector<int> CPUs;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_BATCHEVALUATOR_H
@@ -0,0 +1,330 @@
+//===- CompileTelemetry.h - Per-item compile pipeline timings ---*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Records where the time goes between reading a top-level item and running
+// it. Every definition, extern and expression becomes an Item; each pipeline
+// stage it passes through adds a timed event:
+//
+//   lex, parse, codegen, verify, optimize   - driver thread, nested scopes
+//   add-module, lookup, execute             - driver thread
+//   emit, link                              - whichever thread materializes
+//
+// Driver phase totals are exclusive: time spent in a nested scope (say,
+// verify inside codegen) is only counted for the inner phase. The one
+// exception is lookup, which includes any emit and link it triggers on the
+// same thread; those are also reported under the item that owns the module.
+// Link time runs from the end of emission until the object is finalized, so
+// it includes waiting for the module's dependencies. Trace events keep the
+// inclusive durations so nesting shows up in chrome://tracing / Perfetto.
+//
+// JIT-side events find their item through the module identifier, which the
+// driver sets with getModuleIdentifier() before handing a module over.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_COMPILETELEMETRY_H
+#define LLVM_EXECUTIONENGINE_ORC_COMPILETELEMETRY_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace llvm {
+namespace orc {
+
+class CompileTelemetry {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  enum Phase {
+    Lex,
+    Parse,
+    Codegen,
+    Verify,
+    Optimize,
+    AddModule,
+    Emit,
+    Link,
+    Lookup,
+    Execute,
+    NumPhases
+  };
+
+  static const char *getPhaseName(Phase P) {
+    static const char *Names[NumPhases] = {
+        "lex",        "parse", "codegen", "verify", "optimize",
+        "add-module", "emit",  "link",    "lookup", "execute"};
+    return Names[P];
+  }
+
+  /// Times one phase of the current item on this thread. Construct with a
+  /// null telemetry to make it a no-op.
+  class Scope {
+  public:
+    Scope(CompileTelemetry *T, Phase P)
+        : T(T), P(P), Item(T ? T->getCurrentItem() : 0),
+          Parent(T ? innermost() : nullptr) {
+      if (!T)
+        return;
+      innermost() = this;
+      Start = Clock::now();
+    }
+
+    ~Scope() {
+      if (!T)
+        return;
+      auto End = Clock::now();
+      innermost() = Parent;
+      double Inclusive = toUs(End - Start);
+      if (Parent)
+        Parent->ChildUs += Inclusive;
+      T->record(Item, P, Start, End, Inclusive - ChildUs);
+    }
+
+    /// Charge Us of the enclosing scope's time to a phase that is not worth
+    /// a scope of its own (lexing is timed per token).
+    static void addChildTime(double Us) {
+      if (auto *S = innermost())
+        S->ChildUs += Us;
+    }
+
+  private:
+    static Scope *&innermost() {
+      static thread_local Scope *Innermost = nullptr;
+      return Innermost;
+    }
+
+    CompileTelemetry *T;
+    Phase P;
+    unsigned Item;
+    Scope *Parent;
+    Clock::time_point Start;
+    double ChildUs = 0;
+  };
+
+  CompileTelemetry() : Epoch(Clock::now()) {}
+
+  /// Start a new item and make it current for driver-side scopes.
+  unsigned beginItem(StringRef Kind) {
+    std::lock_guard<std::mutex> Lock(M);
+    Items.push_back(Item());
+    Items.back().Kind = Kind.str();
+    CurrentItem = Items.size() - 1;
+    return CurrentItem;
+  }
+
+  unsigned getCurrentItem() {
+    std::lock_guard<std::mutex> Lock(M);
+    return CurrentItem;
+  }
+
+  void setItemName(unsigned Id, StringRef Name) {
+    std::lock_guard<std::mutex> Lock(M);
+    Items[Id].Name = Name.str();
+  }
+
+  void addIRBytes(unsigned Id, uint64_t Bytes) {
+    std::lock_guard<std::mutex> Lock(M);
+    Items[Id].IRBytes += Bytes;
+  }
+
+  /// The module identifier that lets JIT-side events find item Id.
+  static std::string getModuleIdentifier(unsigned Id) {
+    return "item." + std::to_string(Id);
+  }
+
+  /// Account Us of lexing to the current item, without a trace event.
+  void addLexTime(double Us) {
+    Scope::addChildTime(Us);
+    std::lock_guard<std::mutex> Lock(M);
+    if (CurrentItem < Items.size())
+      Items[CurrentItem].PhaseUs[Lex] += Us;
+  }
+
+  /// Record phase P of item Id. SelfUs defaults to the full duration.
+  void record(unsigned Id, Phase P, Clock::time_point Start,
+              Clock::time_point End, double SelfUs = -1) {
+    double Dur = toUs(End - Start);
+    std::lock_guard<std::mutex> Lock(M);
+    if (Id >= Items.size())
+      return;
+    Items[Id].PhaseUs[P] += SelfUs < 0 ? Dur : SelfUs;
+    Events.push_back({Id, P, toUs(Start - Epoch), Dur, getThreadIndex()});
+  }
+
+  /// JIT-side hooks, keyed by module identifier (or an object buffer name
+  /// derived from it). Identifiers the driver did not produce are ignored.
+  void notifyEmitStart(StringRef ModuleId) {
+    std::lock_guard<std::mutex> Lock(M);
+    EmitStart[ModuleId] = Clock::now();
+  }
+
+  void notifyEmitEnd(StringRef ModuleId) { endPhase(ModuleId, Emit); }
+
+  void notifyCodeBytes(StringRef ObjectName, uint64_t Bytes) {
+    int Id = parseItem(ObjectName);
+    if (Id < 0)
+      return;
+    std::lock_guard<std::mutex> Lock(M);
+    if (unsigned(Id) < Items.size())
+      Items[Id].CodeBytes += Bytes;
+  }
+
+  void notifyLinked(StringRef ObjectName) { endPhase(ObjectName, Link); }
+
+  /// One JSON object per item plus session totals.
+  void writeSummary(raw_ostream &OS) {
+    std::lock_guard<std::mutex> Lock(M);
+    json::OStream J(OS, 2);
+    double Totals[NumPhases] = {};
+    uint64_t TotalIR = 0, TotalCode = 0;
+    J.object([&] {
+      J.attributeArray("items", [&] {
+        for (unsigned I = 0; I != Items.size(); ++I) {
+          auto &It = Items[I];
+          TotalIR += It.IRBytes;
+          TotalCode += It.CodeBytes;
+          J.object([&] {
+            J.attribute("id", I);
+            J.attribute("kind", It.Kind);
+            J.attribute("name", It.Name);
+            J.attribute("ir_bytes", int64_t(It.IRBytes));
+            J.attribute("code_bytes", int64_t(It.CodeBytes));
+            J.attributeObject("phases_us", [&] {
+              for (unsigned P = 0; P != NumPhases; ++P) {
+                Totals[P] += It.PhaseUs[P];
+                J.attribute(getPhaseName(Phase(P)), It.PhaseUs[P]);
+              }
+            });
+          });
+        }
+      });
+      J.attributeObject("totals", [&] {
+        J.attribute("items", int64_t(Items.size()));
+        J.attribute("ir_bytes", int64_t(TotalIR));
+        J.attribute("code_bytes", int64_t(TotalCode));
+        J.attributeObject("phases_us", [&] {
+          for (unsigned P = 0; P != NumPhases; ++P)
+            J.attribute(getPhaseName(Phase(P)), Totals[P]);
+        });
+      });
+    });
+    OS << '\n';
+  }
+
+  /// Chrome trace-event format: one complete ("X") event per recorded phase.
+  void writeChromeTrace(raw_ostream &OS) {
+    std::lock_guard<std::mutex> Lock(M);
+    json::OStream J(OS);
+    J.object([&] {
+      J.attributeArray("traceEvents", [&] {
+        for (auto &E : Events) {
+          auto &It = Items[E.Item];
+          J.object([&] {
+            J.attribute("name", getPhaseName(E.P));
+            J.attribute("cat", It.Kind);
+            J.attribute("ph", "X");
+            J.attribute("ts", E.StartUs);
+            J.attribute("dur", E.DurUs);
+            J.attribute("pid", 1);
+            J.attribute("tid", int64_t(E.Tid));
+            J.attributeObject("args", [&] {
+              J.attribute("item", E.Item);
+              J.attribute("name", It.Name);
+            });
+          });
+        }
+      });
+      J.attribute("displayTimeUnit", "ms");
+    });
+    OS << '\n';
+  }
+
+private:
+  struct Item {
+    std::string Kind, Name;
+    uint64_t IRBytes = 0, CodeBytes = 0;
+    double PhaseUs[NumPhases] = {};
+  };
+
+  struct Event {
+    unsigned Item;
+    Phase P;
+    double StartUs, DurUs;
+    unsigned Tid;
+  };
+
+  static double toUs(Clock::duration D) {
+    return std::chrono::duration<double, std::micro>(D).count();
+  }
+
+  /// Recover the item from "item.<N>" or "item.<N>-jitted-objectbuffer".
+  static int parseItem(StringRef Name) {
+    if (!Name.consume_front("item."))
+      return -1;
+    unsigned Id;
+    if (Name.consumeInteger(10, Id))
+      return -1;
+    return Id;
+  }
+
+  /// Close the phase that started when the previous phase for this module
+  /// (emit-start for Emit, emit-end for Link) was noted.
+  void endPhase(StringRef Name, Phase P) {
+    auto End = Clock::now();
+    int Id = parseItem(Name);
+    if (Id < 0)
+      return;
+    std::string Key = getModuleIdentifier(Id);
+    Clock::time_point Start;
+    {
+      std::lock_guard<std::mutex> Lock(M);
+      auto I = EmitStart.find(Key);
+      if (I == EmitStart.end())
+        return;
+      Start = I->second;
+      if (P == Emit)
+        I->second = End;
+      else
+        EmitStart.erase(I);
+    }
+    record(Id, P, Start, End);
+  }
+
+  /// Small dense thread ids for the trace viewer.
+  unsigned getThreadIndex() {
+    auto Id = std::hash<std::thread::id>()(std::this_thread::get_id());
+    for (unsigned I = 0; I != Threads.size(); ++I)
+      if (Threads[I] == Id)
+        return I;
+    Threads.push_back(Id);
+    return Threads.size() - 1;
+  }
+
+  Clock::time_point Epoch;
+  std::mutex M;
+  std::vector<Item> Items;
+  std::vector<Event> Events;
+  StringMap<Clock::time_point> EmitStart;
+  std::vector<size_t> Threads;
+  unsigned CurrentItem = 0;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_COMPILETELEMETRY_H
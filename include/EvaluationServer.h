@@ -0,0 +1,320 @@
+//===- EvaluationServer.h - Kaleidoscope over a Unix socket -----*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Serves evaluation requests on a Unix domain socket. Every connection is a
+// session with its own KaleidoscopeEngine, compiling into its own JITDylib of
+// the prelude engine's JIT: sessions see the prelude's functions and their
+// own, never each other's, and none of them pays for starting a JIT.
+//
+// A request is one line of Kaleidoscope source. Its reply is one line of
+// JSON, sent once every item in the request has been compiled and run:
+//
+//   {"ok":true,"results":[3,120],"error":null,"queue_us":12,"run_us":840}
+//
+// results holds the values of the request's top-level expressions, error
+// the diagnostics of the items that failed (the others still ran). queue_us
+// is the time from reading the request to a worker picking it up, run_us
+// the time spent compiling and running it.
+//
+// Sessions are not isolated from each other or from the server: their code
+// runs on the server's threads, in its address space. The driver keeps them
+// from the search of the process's symbols and from libraries it was not
+// told to allow, but a request that recurses without end still takes the
+// whole server down, and one that loops forever ties up a worker for good.
+// Only serve clients trusted with that. A request line longer than
+// MaxRequestBytes closes its session.
+//
+// Requests are served by a pool of worker threads. The requests of one
+// session run in order, one at a time; different sessions run concurrently.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_EVALUATIONSERVER_H
+#define LLVM_EXECUTIONENGINE_ORC_EVALUATIONSERVER_H
+
+#include "KaleidoscopeEngine.h"
+
+#include "llvm/Support/Error.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace llvm {
+namespace orc {
+
+class EvaluationServer {
+public:
+  /// Serve sessions compiled with SessionOpts on top of Prelude, with
+  /// Threads workers (0 for one per hardware thread).
+  EvaluationServer(KaleidoscopeEngine &Prelude,
+                   KaleidoscopeEngine::Options SessionOpts, unsigned Threads)
+      : SessionOpts(std::move(SessionOpts)),
+        Pool(Threads ? llvm::hardware_concurrency(Threads)
+                     : llvm::hardware_concurrency()) {
+    this->SessionOpts.Prelude = &Prelude;
+    this->SessionOpts.Echo = false;
+  }
+
+  ~EvaluationServer() {
+    if (ListenFD >= 0)
+      close(ListenFD);
+    for (int FD : WakeFDs)
+      if (FD >= 0)
+        close(FD);
+    if (!Path.empty())
+      unlink(Path.c_str());
+  }
+
+  /// Listen on the socket at SocketPath, replacing a stale one. Only users
+  /// Mode lets write to the socket can connect.
+  Error listen(StringRef SocketPath, mode_t Mode = 0600) {
+    sockaddr_un Addr;
+    memset(&Addr, 0, sizeof(Addr));
+    Addr.sun_family = AF_UNIX;
+    if (SocketPath.size() >= sizeof(Addr.sun_path))
+      return createStringError(inconvertibleErrorCode(),
+                               "socket path too long: %s",
+                               SocketPath.str().c_str());
+    memcpy(Addr.sun_path, SocketPath.data(), SocketPath.size());
+
+    if (pipe(WakeFDs) != 0)
+      return errorCodeToError(std::error_code(errno, std::generic_category()));
+    fcntl(WakeFDs[1], F_SETFL, O_NONBLOCK);
+
+    ListenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ListenFD < 0)
+      return errorCodeToError(std::error_code(errno, std::generic_category()));
+    unlink(Addr.sun_path);
+    // Nobody can connect before listen(), so the mode is set in time.
+    if (bind(ListenFD, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) != 0 ||
+        chmod(Addr.sun_path, Mode) != 0 || ::listen(ListenFD, SOMAXCONN) != 0)
+      return createFileError(SocketPath, errorCodeToError(std::error_code(
+                                             errno, std::generic_category())));
+    Path = SocketPath.str();
+    return Error::success();
+  }
+
+  /// Accept connections and read requests until stop(), then wait for the
+  /// requests already read to be answered.
+  void run() {
+    std::vector<pollfd> FDs;
+    std::vector<char> Buf(64 * 1024);
+    while (true) {
+      FDs.clear();
+      FDs.push_back({WakeFDs[0], POLLIN, 0});
+      FDs.push_back({ListenFD, POLLIN, 0});
+      for (auto &KV : Sessions)
+        FDs.push_back({KV.first, POLLIN, 0});
+
+      if (poll(FDs.data(), FDs.size(), -1) < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      if (FDs[0].revents)
+        break;
+
+      if (FDs[1].revents & POLLIN) {
+        int FD = accept4(ListenFD, nullptr, nullptr, SOCK_CLOEXEC);
+        if (FD >= 0)
+          openSession(FD);
+      }
+
+      for (size_t I = 2; I != FDs.size(); ++I) {
+        if (!FDs[I].revents)
+          continue;
+        int FD = FDs[I].fd;
+        ssize_t N = read(FD, Buf.data(), Buf.size());
+        if (N < 0 && errno == EINTR)
+          continue;
+        if (N <= 0 || !receive(*Sessions[FD], StringRef(Buf.data(), N)))
+          closeSession(FD);
+      }
+    }
+
+    // Workers drop their sessions once the requests read so far are done.
+    Sessions.clear();
+    Pool.wait();
+  }
+
+  /// The longest request line a session may send.
+  static constexpr size_t MaxRequestBytes = 1 << 20;
+
+  /// Make run() return. Safe to call from a signal handler.
+  void stop() {
+    char C = 0;
+    (void)!write(WakeFDs[1], &C, 1);
+  }
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Request {
+    std::string Source;
+    Clock::time_point Received;
+  };
+
+  struct Session {
+    int FD;
+    std::unique_ptr<KaleidoscopeEngine> Engine;
+    /// Bytes read after the last complete request.
+    std::string InBuf;
+
+    std::mutex M;
+    std::deque<Request> Pending;
+    /// A worker is draining Pending.
+    bool Busy = false;
+    /// The client has gone; drop whatever is left.
+    bool Closed = false;
+
+    explicit Session(int FD) : FD(FD) {}
+    ~Session() { close(FD); }
+  };
+
+  void openSession(int FD) {
+    auto S = std::make_shared<Session>(FD);
+    auto Engine = KaleidoscopeEngine::Create(SessionOpts);
+    if (!Engine) {
+      reply(*S, Clock::now(), Clock::now(), nullptr,
+            toString(Engine.takeError()));
+      return;
+    }
+    S->Engine = std::move(*Engine);
+    Sessions[FD] = std::move(S);
+  }
+
+  void closeSession(int FD) {
+    auto I = Sessions.find(FD);
+    {
+      std::lock_guard<std::mutex> Lock(I->second->M);
+      I->second->Closed = true;
+    }
+    // A worker still holding the session finishes its request first.
+    Sessions.erase(I);
+  }
+
+  /// Queue the complete lines of Data and make sure a worker drains them.
+  /// Returns false if S has sent more than MaxRequestBytes without ending
+  /// the line.
+  bool receive(Session &S, StringRef Data) {
+    S.InBuf.append(Data.begin(), Data.end());
+    auto Now = Clock::now();
+    bool Schedule = false;
+    {
+      std::lock_guard<std::mutex> Lock(S.M);
+      size_t Start = 0, End;
+      while ((End = S.InBuf.find('\n', Start)) != std::string::npos) {
+        StringRef Line = StringRef(S.InBuf).slice(Start, End).trim();
+        if (!Line.empty())
+          S.Pending.push_back({Line.str(), Now});
+        Start = End + 1;
+      }
+      S.InBuf.erase(0, Start);
+      if (S.InBuf.size() > MaxRequestBytes)
+        return false;
+      if (!S.Pending.empty() && !S.Busy)
+        Schedule = S.Busy = true;
+    }
+    if (Schedule) {
+      std::shared_ptr<Session> Keep = Sessions[S.FD];
+      Pool.async([this, Keep] { drain(*Keep); });
+    }
+    return true;
+  }
+
+  /// Run S's queued requests in order until none are left.
+  void drain(Session &S) {
+    while (true) {
+      Request R;
+      {
+        std::lock_guard<std::mutex> Lock(S.M);
+        if (S.Closed || S.Pending.empty()) {
+          S.Busy = false;
+          return;
+        }
+        R = std::move(S.Pending.front());
+        S.Pending.pop_front();
+      }
+      auto Start = Clock::now();
+      std::vector<double> Results;
+      std::string Diags;
+      if (auto Err = S.Engine->compile(R.Source, &Results))
+        Diags = toString(std::move(Err));
+      reply(S, R.Received, Start, &Results, Diags);
+    }
+  }
+
+  static void reply(Session &S, Clock::time_point Received,
+                    Clock::time_point Start, const std::vector<double> *Results,
+                    const std::string &Diags) {
+    auto Micros = [](Clock::duration D) {
+      return std::chrono::duration_cast<std::chrono::microseconds>(D).count();
+    };
+    std::string Line;
+    raw_string_ostream OS(Line);
+    {
+      json::OStream J(OS);
+      J.object([&] {
+        J.attribute("ok", Diags.empty());
+        J.attributeArray("results", [&] {
+          if (Results)
+            for (double V : *Results)
+              J.value(V);
+        });
+        if (Diags.empty())
+          J.attribute("error", nullptr);
+        else
+          J.attribute("error", Diags);
+        J.attribute("queue_us", Micros(Start - Received));
+        J.attribute("run_us", Micros(Clock::now() - Start));
+      });
+    }
+    OS << '\n';
+    OS.flush();
+
+    for (size_t Sent = 0; Sent != Line.size();) {
+      ssize_t N = send(S.FD, Line.data() + Sent, Line.size() - Sent,
+                       MSG_NOSIGNAL);
+      if (N < 0 && errno == EINTR)
+        continue;
+      if (N <= 0)
+        return;
+      Sent += N;
+    }
+  }
+
+  KaleidoscopeEngine::Options SessionOpts;
+  ThreadPool Pool;
+  int ListenFD = -1;
+  int WakeFDs[2] = {-1, -1};
+  std::string Path;
+  /// Open sessions by socket; only touched by run()'s thread.
+  std::map<int, std::shared_ptr<Session>> Sessions;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_EVALUATIONSERVER_H
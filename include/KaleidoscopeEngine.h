@@ -0,0 +1,268 @@
+//===- KaleidoscopeEngine.h - An embeddable Kaleidoscope compiler -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// A Kaleidoscope compiler and JIT as a library. An engine owns everything a
+// session needs -- its LLVM contexts, the prototypes and definitions compiled
+// so far and its own KaleidoscopeJIT -- so a process may run many engines,
+// each on its own thread. A single engine must not be used from two threads
+// at once.
+//
+//   auto E = cantFail(KaleidoscopeEngine::Create());
+//   cantFail(E->compile("def sq(x) x * x;"));
+//   auto *Sq = cantFail(E->lookup<double(double)>("sq"));
+//   double Nine = Sq(3), Sixteen = cantFail(E->evaluate("sq(4)"));
+//
+// Entry points are resolved once per function and cached, so looking one up
+// again is a map lookup and calling it never compiles anything. Hosts that
+// only learn a function's arity at run time use lookupGeneric() instead,
+// which compiles a small trampoline taking the arguments as an array:
+//
+//   auto Sum = cantFail(E->lookupGeneric(Name));
+//   for (auto &Row : Rows)      // Row.size() == Sum.getArity()
+//     Total += Sum(Row);
+//
+// The implementation lives in lexer.cpp; build it with -DKALEIDOSCOPE_NO_MAIN
+// to leave out the REPL driver.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEENGINE_H
+#define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEENGINE_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/Support/Error.h"
+
+#include <cassert>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace llvm {
+
+class ObjectCache;
+class raw_ostream;
+
+namespace orc {
+
+class CompileTelemetry;
+class KaleidoscopeJIT;
+class PassStatistics;
+class ProfileCounters;
+class ProfileData;
+enum class HugePageKind;
+
+class KaleidoscopeEngine {
+public:
+  struct Options {
+    /// 1 runs per-function cleanup passes; 2 and 3 run LLVM's module pipeline.
+    unsigned OptLevel = 0;
+    /// Emit DWARF line tables, naming SourceName as the file.
+    bool DebugInfo = false;
+    std::string SourceName = "<stdin>";
+    /// Keep frame pointers so profilers can unwind through JIT'd code.
+    bool FramePointers = false;
+    /// Count executions into Profile; annotate code with ProfileIn's counts.
+    ProfileCounters *Profile = nullptr;
+    const ProfileData *ProfileIn = nullptr;
+    /// Specialize functions on arguments that keep the same value for
+    /// SpecializeThreshold calls in a row.
+    bool Specialize = false;
+    unsigned SpecializeThreshold = 100;
+    /// Compile likely callees of top-level expressions in the background.
+    bool Speculate = false;
+    double SpeculationThreshold = 0.5;
+    HugePageKind HugePages = HugePageKind(0);
+    /// Background compile threads; 0 compiles on the requesting thread.
+    unsigned CompileThreads = 0;
+    /// Run background compiles at background priority, so threads running
+    /// JIT'd code get the CPU first.
+    bool BackgroundCompiles = false;
+    /// Where to report timings and pass statistics. PassStats may be shared
+    /// between engines; Telemetry tracks a single current item, so give each
+    /// engine its own.
+    CompileTelemetry *Telemetry = nullptr;
+    PassStatistics *PassStats = nullptr;
+    /// Optimization remarks (implies DebugInfo); see -remarks-* in the driver.
+    std::string RemarksFile;
+    std::string RemarksFormat = "yaml";
+    std::string RemarksFilter;
+    /// Print prompts, IR and results like the REPL does.
+    bool Echo = false;
+    /// With Echo, print each item's IR too.
+    bool EchoIR = true;
+    /// In runPipelined(), run top-level expressions that only call pure
+    /// functions concurrently. Expressions that may have side effects
+    /// (putchard, printd, unknown externs) still run in program order, after
+    /// everything before them.
+    bool ParallelExpressions = false;
+    /// Remember the values of pure top-level expressions and answer repeats
+    /// without compiling or running them. Redefining a function the
+    /// expression reaches invalidates its entry. Ignored with Profile or
+    /// Specialize.
+    bool CacheResults = false;
+    /// Compile into a new JITDylib of Prelude's JIT, linked against
+    /// Prelude's code, instead of into a JIT of our own. Prelude's functions
+    /// are callable by name but cannot be redefined, as imported ones cannot;
+    /// it must outlive this engine and not change while this engine is
+    /// created. HugePages and CompileThreads are Prelude's.
+    KaleidoscopeEngine *Prelude = nullptr;
+    /// Directories import "name" searches for name.klib, after the current
+    /// directory.
+    std::vector<std::string> LibraryPath;
+    /// Functions plain externs resolve to, by name, besides the C math
+    /// library's; e.g. Builtins["printd"] = pointerToJITTargetAddress(&printd).
+    /// extern "lib.so" name(...) binds name to lib.so's definition instead.
+    std::map<std::string, JITTargetAddress> Builtins;
+    /// Search every library loaded into the process for externs that are
+    /// neither. Builtins are Prelude's; a session searches the process only
+    /// if both it and Prelude set ProcessSymbols.
+    bool ProcessSymbols = true;
+    /// Only let extern "lib" name the libraries in AllowedLibraries, and
+    /// import only find libraries by name in LibraryPath, not by file path.
+    /// Narrows what an engine's source can reach; it does not isolate it.
+    bool RestrictLibraries = false;
+    std::vector<std::string> AllowedLibraries;
+    /// Bitcode whose functions are linked into every module calling them,
+    /// before optimization, so OptLevel 2 and up can inline them. Calls it
+    /// does not define still go to Builtins. Must outlive the engine.
+    StringRef RuntimeBitcode;
+    /// Reuse objects CodeCache holds for identical modules instead of
+    /// compiling them, and add the ones compiled; a SharedObjectCache shares
+    /// them with other processes. Modules of definitions and libraries are
+    /// marked cacheable, never those of expressions or of instrumented
+    /// (Profile, Specialize) code. Prelude's for sessions.
+    ObjectCache *CodeCache = nullptr;
+  };
+
+  /// Implementation state, defined in lexer.cpp.
+  class Impl;
+
+  static Expected<std::unique_ptr<KaleidoscopeEngine>> Create(Options Opts);
+  static Expected<std::unique_ptr<KaleidoscopeEngine>> Create() {
+    return Create(Options());
+  }
+
+  ~KaleidoscopeEngine();
+
+  /// Compile every definition and extern in Source and run its top-level
+  /// expressions, appending their values to Results if given. Items that
+  /// fail are skipped; their errors are returned together once the rest has
+  /// been compiled.
+  Error compile(StringRef Source, std::vector<double> *Results = nullptr);
+
+  /// A compiled top-level expression.
+  using ExpressionFn = double (*)();
+
+  /// Compile Source like compile(), but compile its top-level expressions
+  /// without running them, appending them to Exprs in input order.
+  /// Expressions that fail to compile are appended as null so positions
+  /// still line up with the input. The expressions stay valid for the
+  /// engine's lifetime and may be called from any thread, as long as the
+  /// engine itself is not compiling at the same time. Nothing is specialized
+  /// for them: Source is compiled without Specialize's instrumentation.
+  Error compileBatch(StringRef Source, std::vector<ExpressionFn> &Exprs);
+
+  /// Compile the definitions and externs in Source into a library and write
+  /// it to OS as bitcode, for import "name" to load from name.klib without
+  /// parsing Source again. Libraries Source imports are loaded when the
+  /// library is. Source may not contain top-level expressions. The
+  /// definitions are callable from this engine afterwards, too. Libraries
+  /// are compiled without Profile counters or Specialize instrumentation,
+  /// which refer to this process's memory.
+  Error compileLibrary(StringRef Source, raw_ostream &OS);
+
+  /// Compile and run a single expression.
+  Expected<double> evaluate(StringRef Expr);
+
+  /// The address of Name as a callable of type Fn, which must be
+  /// double(double, ...) with as many arguments as Name takes.
+  template <typename Fn> Expected<Fn *> lookup(StringRef Name) {
+    static_assert(Signature<Fn>::Valid,
+                  "Kaleidoscope functions take and return doubles");
+    auto Addr = lookupAddress(Name, Signature<Fn>::Arity);
+    if (!Addr)
+      return Addr.takeError();
+    return reinterpret_cast<Fn *>(static_cast<uintptr_t>(*Addr));
+  }
+
+  /// A compiled function called with its arguments in an array.
+  class GenericFunction {
+  public:
+    using ApplyFn = double (*)(const double *);
+
+    GenericFunction(ApplyFn Apply, unsigned Arity)
+        : Apply(Apply), Arity(Arity) {}
+
+    unsigned getArity() const { return Arity; }
+
+    double operator()(ArrayRef<double> Args) const {
+      assert(Args.size() == Arity && "wrong number of arguments");
+      return Apply(Args.data());
+    }
+
+  private:
+    ApplyFn Apply;
+    unsigned Arity;
+  };
+
+  /// Name as a GenericFunction. Its trampoline is compiled on the first
+  /// request and reused afterwards.
+  Expected<GenericFunction> lookupGeneric(StringRef Name);
+
+  /// Call Name once by name, checking the number of arguments. Hot loops
+  /// should hold on to lookup() or lookupGeneric() instead.
+  Expected<double> call(StringRef Name, ArrayRef<double> Args);
+
+  /// Read-eval-print on stdin until EOF, calling OnPrompt before each item.
+  void runInteractive(function_ref<void()> OnPrompt = nullptr);
+
+  /// Like runInteractive(), but parsing, compiling and running overlap:
+  /// while one item runs, the items after it are already being parsed and
+  /// compiled. Top-level expressions run one at a time in program
+  /// order, unless ParallelExpressions lets pure ones run concurrently;
+  /// their results are still reported in order. Compiles run at background
+  /// priority when BackgroundCompiles is set. There are no prompts, and
+  /// telemetry does not see lexing, parsing or execution.
+  void runPipelined();
+
+  KaleidoscopeJIT &getJIT();
+
+private:
+  template <typename... Args> struct AllDoubles : std::true_type {};
+  template <typename A, typename... Args>
+  struct AllDoubles<A, Args...>
+      : std::integral_constant<bool, std::is_same<A, double>::value &&
+                                         AllDoubles<Args...>::value> {};
+
+  template <typename Fn> struct Signature {
+    static constexpr bool Valid = false;
+    static constexpr unsigned Arity = 0;
+  };
+  template <typename R, typename... Args> struct Signature<R(Args...)> {
+    static constexpr bool Valid =
+        std::is_same<R, double>::value && AllDoubles<Args...>::value;
+    static constexpr unsigned Arity = sizeof...(Args);
+  };
+
+  explicit KaleidoscopeEngine(std::unique_ptr<Impl> I);
+
+  Expected<JITTargetAddress> lookupAddress(StringRef Name, unsigned Arity);
+
+  std::unique_ptr<Impl> I;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEENGINE_H
@@ -0,0 +1,191 @@
+//===- PassStatistics.h - Session-wide pass timing and counts ---*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Aggregates, per pass name and across every module of a session, the wall
+// time spent in the pass, how often it ran, and how much it grew or shrank
+// the IR (in instructions). Hook it into a module's pass pipeline with
+// registerCallbacks(); pipelines built without a PassInstrumentationCallbacks
+// pay nothing.
+//
+// Times and instruction deltas are exclusive: a nested pass manager or
+// adaptor is charged only for the time not spent, and the change not made,
+// in the passes it runs. A pass that invalidated its IR unit (a function
+// pass that deleted its function, say) is charged time but no delta; the
+// change is left to the pass running it.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_PASSSTATISTICS_H
+#define LLVM_EXECUTIONENGINE_ORC_PASSSTATISTICS_H
+
+#include "llvm/ADT/Any.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Analysis/LazyCallGraph.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace llvm {
+namespace orc {
+
+class PassStatistics {
+public:
+  struct Entry {
+    double Us = 0;
+    uint64_t Runs = 0;
+    int64_t InstDelta = 0;
+  };
+
+  void registerCallbacks(PassInstrumentationCallbacks &PIC) {
+    PIC.registerBeforeNonSkippedPassCallback(
+        [this](StringRef PassID, Any IR) { beforePass(IR); });
+    PIC.registerAfterPassCallback(
+        [this](StringRef PassID, Any IR, const PreservedAnalyses &) {
+          afterPass(PassID, countInstructions(IR));
+        });
+    PIC.registerAfterPassInvalidatedCallback(
+        [this](StringRef PassID, const PreservedAnalyses &) {
+          afterPass(PassID, None);
+        });
+  }
+
+  /// A table sorted by descending time.
+  void print(raw_ostream &OS) {
+    auto Rows = getSorted();
+    double Total = 0;
+    for (auto &R : Rows)
+      Total += R.second.Us;
+
+    OS << "===-------------------------------------------------------------===\n"
+       << "                  Pass statistics (whole session)\n"
+       << "===-------------------------------------------------------------===\n"
+       << "   time (us)      %       runs    insts  pass\n";
+    for (auto &R : Rows)
+      OS << format("%12.1f %5.1f%% %10llu %+8lld  ", R.second.Us,
+                   Total ? 100 * R.second.Us / Total : 0.0,
+                   (unsigned long long)R.second.Runs,
+                   (long long)R.second.InstDelta)
+         << R.first << '\n';
+    OS << format("%12.1f %5.1f%%", Total, 100.0) << "              total\n";
+  }
+
+  void writeJSON(raw_ostream &OS) {
+    auto Rows = getSorted();
+    json::OStream J(OS, 2);
+    J.array([&] {
+      for (auto &R : Rows)
+        J.object([&] {
+          J.attribute("pass", R.first);
+          J.attribute("time_us", R.second.Us);
+          J.attribute("runs", int64_t(R.second.Runs));
+          J.attribute("inst_delta", R.second.InstDelta);
+        });
+    });
+    OS << '\n';
+  }
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Frame {
+    Clock::time_point Start;
+    int64_t Insts;
+    double ChildUs;
+    int64_t ChildInsts;
+  };
+
+  // Passes nest (adaptors, pass managers) and may run on several compile
+  // threads at once, so each thread keeps its own stack.
+  static std::vector<Frame> &getStack() {
+    static thread_local std::vector<Frame> Stack;
+    return Stack;
+  }
+
+  void beforePass(Any IR) {
+    getStack().push_back({Clock::now(), countInstructions(IR), 0, 0});
+  }
+
+  /// InstsAfter is None if the pass invalidated its IR unit.
+  void afterPass(StringRef PassID, Optional<int64_t> InstsAfter) {
+    auto &Stack = getStack();
+    if (Stack.empty())
+      return;
+    Frame F = Stack.back();
+    Stack.pop_back();
+    double Us =
+        std::chrono::duration<double, std::micro>(Clock::now() - F.Start)
+            .count();
+    int64_t Delta = InstsAfter ? *InstsAfter - F.Insts : 0;
+    if (!Stack.empty()) {
+      Stack.back().ChildUs += Us;
+      Stack.back().ChildInsts += Delta;
+    }
+
+    std::lock_guard<std::mutex> Lock(M);
+    auto &E = Stats[PassID];
+    E.Us += Us - F.ChildUs;
+    ++E.Runs;
+    if (InstsAfter)
+      E.InstDelta += Delta - F.ChildInsts;
+  }
+
+  static int64_t countInstructions(const Function &F) {
+    return F.getInstructionCount();
+  }
+
+  static int64_t countInstructions(Any IR) {
+    if (any_isa<const Function *>(IR))
+      return countInstructions(*any_cast<const Function *>(IR));
+    if (any_isa<const Module *>(IR))
+      return any_cast<const Module *>(IR)->getInstructionCount();
+    if (any_isa<const LazyCallGraph::SCC *>(IR)) {
+      int64_t N = 0;
+      for (auto &Node : *any_cast<const LazyCallGraph::SCC *>(IR))
+        N += countInstructions(Node.getFunction());
+      return N;
+    }
+    if (any_isa<const Loop *>(IR)) {
+      int64_t N = 0;
+      for (auto *BB : any_cast<const Loop *>(IR)->blocks())
+        N += BB->size();
+      return N;
+    }
+    return 0;
+  }
+
+  std::vector<std::pair<std::string, Entry>> getSorted() {
+    std::lock_guard<std::mutex> Lock(M);
+    std::vector<std::pair<std::string, Entry>> Rows;
+    for (auto &KV : Stats)
+      Rows.push_back({KV.getKey().str(), KV.getValue()});
+    std::sort(Rows.begin(), Rows.end(), [](const auto &A, const auto &B) {
+      return A.second.Us > B.second.Us;
+    });
+    return Rows;
+  }
+
+  std::mutex M;
+  StringMap<Entry> Stats;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_PASSSTATISTICS_H
@@ -0,0 +1,94 @@
+//===- PerfMapListener.h - Publish JIT'd symbols to perf --------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// A JITEventListener that appends every function in each loaded object to
+// /tmp/perf-<pid>.map, the text format `perf report` reads to name samples
+// in anonymous executable memory:
+//
+//   <start-hex> <size-hex> <name>
+//
+// Unlike jitdump this needs no `perf inject` step, but it carries names only:
+// no code bytes and no line tables. Entries are never removed, because perf
+// resolves samples after the process has exited.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_PERFMAPLISTENER_H
+#define LLVM_EXECUTIONENGINE_ORC_PERFMAPLISTENER_H
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace llvm {
+namespace orc {
+
+class PerfMapListener : public JITEventListener {
+public:
+  /// Open /tmp/perf-<pid>.map for appending.
+  static Expected<std::unique_ptr<PerfMapListener>> Create() {
+    std::string Path =
+        "/tmp/perf-" + std::to_string(sys::Process::getProcessId()) + ".map";
+    std::error_code EC;
+    auto OS = std::make_unique<raw_fd_ostream>(Path, EC, sys::fs::OF_Append);
+    if (EC)
+      return createFileError(Path, EC);
+    return std::unique_ptr<PerfMapListener>(new PerfMapListener(std::move(OS)));
+  }
+
+  void notifyObjectLoaded(ObjectKey K, const object::ObjectFile &Obj,
+                          const RuntimeDyld::LoadedObjectInfo &L) override {
+    std::lock_guard<std::mutex> Lock(M);
+    for (auto &P : object::computeSymbolSizes(Obj)) {
+      const object::SymbolRef &Sym = P.first;
+      auto Type = Sym.getType();
+      if (!Type || *Type != object::SymbolRef::ST_Function || !P.second) {
+        consumeError(Type.takeError());
+        continue;
+      }
+
+      auto Name = Sym.getName();
+      auto Addr = Sym.getAddress();
+      auto Sec = Sym.getSection();
+      if (!Name || !Addr || !Sec || *Sec == Obj.section_end()) {
+        consumeError(Name.takeError());
+        consumeError(Addr.takeError());
+        consumeError(Sec.takeError());
+        continue;
+      }
+
+      // Symbol addresses are section relative in a relocatable object; move
+      // them to where RuntimeDyld put the section.
+      uint64_t Start =
+          L.getSectionLoadAddress(**Sec) + *Addr - (*Sec)->getAddress();
+      *OS << format_hex_no_prefix(Start, 1) << ' '
+          << format_hex_no_prefix(P.second, 1) << ' ' << *Name << '\n';
+    }
+    OS->flush();
+  }
+
+private:
+  explicit PerfMapListener(std::unique_ptr<raw_fd_ostream> OS)
+      : OS(std::move(OS)) {}
+
+  std::mutex M;
+  std::unique_ptr<raw_fd_ostream> OS;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_PERFMAPLISTENER_H
@@ -0,0 +1,220 @@
+//===- ProfileCounters.h - Execution counters for JIT'd code ----*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// A registry of instrumentation sites and the counters behind them. Codegen
+// registers a site, gets the address of its counter, and bakes that address
+// into a relaxed atomic increment; JIT'd code never calls back into the
+// driver. Counters live in fixed-size chunks so their addresses stay valid as
+// more sites are added.
+//
+// A site is identified across runs by its function and its ordinal among that
+// function's sites, in codegen order. Top-level expressions are all reported
+// under one name, so for them the line is part of the identity too. write()
+// saves the counts in a line-oriented text form that ProfileData reads back:
+//
+//   <function> <line> <ordinal> <kind> <count>
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_PROFILECOUNTERS_H
+#define LLVM_EXECUTIONENGINE_ORC_PROFILECOUNTERS_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/ProfileSummary.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace llvm {
+namespace orc {
+
+/// The name sites of top-level expressions are registered under.
+inline StringRef getExpressionProfileName() { return "<expr>"; }
+
+class ProfileCounters {
+public:
+  enum SiteKind { FunctionEntry, IfThen, IfElse, LoopEntry, LoopBackedge };
+
+  static const char *getKindName(SiteKind K) {
+    static const char *Names[] = {"entry", "if.then", "if.else", "loop.entry",
+                                  "loop.backedge"};
+    return Names[K];
+  }
+
+  static bool parseKind(StringRef Name, SiteKind &K) {
+    for (unsigned I = 0; I <= LoopBackedge; ++I)
+      if (Name == getKindName(SiteKind(I))) {
+        K = SiteKind(I);
+        return true;
+      }
+    return false;
+  }
+
+  struct Site {
+    std::string Function;
+    SiteKind Kind;
+    unsigned Line;
+    unsigned Ordinal;
+  };
+
+  using Counter = std::atomic<uint64_t>;
+
+  /// Register a site and return its counter, zeroed.
+  Counter *addSite(StringRef Function, SiteKind Kind, unsigned Line,
+                   unsigned Ordinal) {
+    std::lock_guard<std::mutex> Lock(M);
+    unsigned Idx = Sites.size();
+    if (Idx % ChunkSize == 0)
+      Chunks.emplace_back(new Counter[ChunkSize]());
+    Sites.push_back({Function.str(), Kind, Line, Ordinal});
+    return &getCounter(Idx);
+  }
+
+  /// Save every site's count for a later run's ProfileData.
+  void write(raw_ostream &OS) {
+    std::lock_guard<std::mutex> Lock(M);
+    OS << "# kaleidoscope profile v1\n";
+    for (unsigned I = 0; I != Sites.size(); ++I) {
+      auto &S = Sites[I];
+      OS << S.Function << ' ' << S.Line << ' ' << S.Ordinal << ' '
+         << getKindName(S.Kind) << ' '
+         << getCounter(I).load(std::memory_order_relaxed) << '\n';
+    }
+  }
+
+  size_t getNumSites() {
+    std::lock_guard<std::mutex> Lock(M);
+    return Sites.size();
+  }
+
+  /// Every site, most frequently executed first. A loop's back-edge row also
+  /// shows the mean trip count, so register a loop's entry and back-edge
+  /// sites back to back.
+  void print(raw_ostream &OS) {
+    std::lock_guard<std::mutex> Lock(M);
+    std::vector<unsigned> Order(Sites.size());
+    std::vector<uint64_t> Counts(Sites.size());
+    for (unsigned I = 0; I != Sites.size(); ++I) {
+      Order[I] = I;
+      Counts[I] = getCounter(I).load(std::memory_order_relaxed);
+    }
+    std::stable_sort(Order.begin(), Order.end(), [&](unsigned A, unsigned B) {
+      return Counts[A] > Counts[B];
+    });
+
+    OS << "===-------------------------------------------------------------===\n"
+       << "                     Execution profile\n"
+       << "===-------------------------------------------------------------===\n"
+       << "       count  site\n";
+    for (unsigned I : Order) {
+      auto &S = Sites[I];
+      OS << format("%12llu  ", (unsigned long long)Counts[I]) << S.Function
+         << ':' << S.Line << ' ' << getKindName(S.Kind);
+      if (S.Kind == LoopBackedge && I > 0 && Sites[I - 1].Kind == LoopEntry &&
+          Counts[I - 1])
+        OS << format("  (%.1f trips/entry)",
+                     1.0 + double(Counts[I]) / Counts[I - 1]);
+      OS << '\n';
+    }
+  }
+
+private:
+  static constexpr unsigned ChunkSize = 1024;
+
+  Counter &getCounter(unsigned Idx) {
+    return Chunks[Idx / ChunkSize][Idx % ChunkSize];
+  }
+
+  std::mutex M;
+  std::vector<Site> Sites;
+  std::vector<std::unique_ptr<Counter[]>> Chunks;
+};
+
+/// Counts saved by ProfileCounters::write() in an earlier run.
+class ProfileData {
+public:
+  static Expected<std::unique_ptr<ProfileData>> Create(StringRef Path) {
+    auto Buf = MemoryBuffer::getFile(Path);
+    if (!Buf)
+      return createFileError(Path, Buf.getError());
+
+    std::unique_ptr<ProfileData> PD(new ProfileData());
+    // Per function, its site counts in codegen order (entry first).
+    StringMap<std::vector<uint64_t>> FunctionCounts;
+    for (line_iterator L(**Buf, /*SkipBlanks*/ true, '#'); !L.is_at_end(); ++L) {
+      SmallVector<StringRef, 5> F;
+      L->split(F, ' ', -1, false);
+      unsigned Line, Ordinal;
+      ProfileCounters::SiteKind Kind;
+      uint64_t Count;
+      if (F.size() != 5 || F[1].getAsInteger(10, Line) ||
+          F[2].getAsInteger(10, Ordinal) ||
+          !ProfileCounters::parseKind(F[3], Kind) ||
+          F[4].getAsInteger(10, Count))
+        return createStringError(inconvertibleErrorCode(),
+                                 "%s:%d: malformed profile line",
+                                 Path.str().c_str(), L.line_number());
+      PD->Counts[getKey(F[0], Line, Ordinal)] = Count;
+      FunctionCounts[F[0]].push_back(Count);
+    }
+
+    InstrProfSummaryBuilder B(ProfileSummaryBuilder::DefaultCutoffs);
+    for (auto &KV : FunctionCounts)
+      B.addRecord(InstrProfRecord(KV.second));
+    PD->Summary = B.getSummary();
+    return PD;
+  }
+
+  /// The earlier run's count for a site, if it had that site.
+  bool lookup(StringRef Function, unsigned Line, unsigned Ordinal,
+              uint64_t &Count) const {
+    auto I = Counts.find(getKey(Function, Line, Ordinal));
+    if (I == Counts.end())
+      return false;
+    Count = I->second;
+    return true;
+  }
+
+  /// The whole program's ProfileSummary, which every module needs so that
+  /// ProfileSummaryInfo can tell hot code from cold.
+  Metadata *getSummary(LLVMContext &Ctx) const { return Summary->getMD(Ctx); }
+
+private:
+  using Key = std::tuple<std::string, unsigned, unsigned>;
+
+  static Key getKey(StringRef Function, unsigned Line, unsigned Ordinal) {
+    if (Function != getExpressionProfileName())
+      Line = 0;
+    return Key(Function.str(), Line, Ordinal);
+  }
+
+  std::map<Key, uint64_t> Counts;
+  std::unique_ptr<ProfileSummary> Summary;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_PROFILECOUNTERS_H
@@ -0,0 +1,283 @@
+//===- SharedObjectCache.h - Object cache shared between processes -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// An ObjectCache keeping compiled objects in POSIX shared memory, so every
+// process on a host that uses the same name finds the objects any of them
+// compiled. A module's object is stored under a hash of its bitcode, target
+// and LLVM version; identical modules -- a prelude that a fleet of workers all
+// compile, or the same expression typed into two of them -- are compiled
+// once per host.
+//
+// Objects are relocatable, so an entry is valid in every process. A process
+// maps an entry read-only and hands it to the linker without copying it; the
+// linker still lays out and relocates the code in the process's own memory.
+//
+// Only modules marked with markCacheable() are stored: code that lives as
+// long as its process, not one-off expressions or code holding addresses
+// of this process.
+//
+// Entries live in /dev/shm as <name>-<uid>-<hash>, readable only by their
+// owner; entries that another user created or opened up are ignored. A
+// store that would take the cache over its size limit first removes the
+// least recently used entries; removeAll() empties it. An entry is published
+// by setting its size once its object has been written, so readers never
+// see part of an object; a writer that dies midway leaves an entry that is
+// never read, and the module is compiled as if it were not cached.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_SHAREDOBJECTCACHE_H
+#define LLVM_EXECUTIONENGINE_ORC_SHAREDOBJECTCACHE_H
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace llvm {
+namespace orc {
+
+class SharedObjectCache : public ObjectCache {
+public:
+  /// Share objects with this user's processes using the same Name, keeping
+  /// at most MaxBytes of them.
+  explicit SharedObjectCache(StringRef Name, uint64_t MaxBytes = 64 << 20)
+      : Prefix(("/" + Name + "-" + Twine(geteuid()) + "-").str()),
+        MaxBytes(MaxBytes) {}
+
+  /// Let modules M's engine is about to compile be stored.
+  static void markCacheable(Module &M) { M.addModuleFlag(Module::Warning, CacheableFlag, 1); }
+
+  std::unique_ptr<MemoryBuffer> getObject(const Module *M) override {
+    pendingKey(M).clear();
+    if (!M->getModuleFlag(CacheableFlag))
+      return nullptr;
+    std::string Key = getKey(*M);
+    int FD = shm_open(Key.c_str(), O_RDONLY, 0);
+    if (FD < 0)
+      return miss(M, Key);
+    struct stat St;
+    if (fstat(FD, &St) != 0 || !isOurs(St) || St.st_size < off_t(sizeof(Header))) {
+      close(FD);
+      return miss(M, Key);
+    }
+    // Recently used entries are the last to be evicted.
+    futimens(FD, nullptr);
+    void *Addr = mmap(nullptr, St.st_size, PROT_READ, MAP_SHARED, FD, 0);
+    close(FD);
+    if (Addr == MAP_FAILED)
+      return miss(M, Key);
+    auto *H = static_cast<const Header *>(Addr);
+    uint64_t Size = H->Size.load(std::memory_order_acquire);
+    if (H->Magic != Magic || !Size || Size > St.st_size - sizeof(Header)) {
+      munmap(Addr, St.st_size);
+      return miss(M, Key);
+    }
+    ++Hits;
+    return std::make_unique<MappedObject>(Addr, St.st_size, Size, Key);
+  }
+
+  void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override {
+    if (!M->getModuleFlag(CacheableFlag))
+      return;
+    // getObject() just missed on this thread; don't hash the module again.
+    std::string &Pending = pendingKey(M);
+    std::string Key = Pending.empty() ? getKey(*M) : std::move(Pending);
+    Pending.clear();
+
+    size_t Length = sizeof(Header) + Obj.getBufferSize();
+    if (Length > MaxBytes)
+      return;
+    evict(Length);
+
+    // Whoever creates the entry writes it; everyone else keeps their copy.
+    int FD = shm_open(Key.c_str(), O_CREAT | O_EXCL | O_RDWR, Mode);
+    if (FD < 0)
+      return;
+    // shm_open() applies the umask; make sure of the mode readers expect.
+    fchmod(FD, Mode);
+    if (ftruncate(FD, Length) != 0) {
+      close(FD);
+      shm_unlink(Key.c_str());
+      return;
+    }
+    void *Addr = mmap(nullptr, Length, PROT_READ | PROT_WRITE, MAP_SHARED, FD, 0);
+    close(FD);
+    if (Addr == MAP_FAILED) {
+      shm_unlink(Key.c_str());
+      return;
+    }
+    auto *H = static_cast<Header *>(Addr);
+    H->Magic = Magic;
+    memcpy(reinterpret_cast<char *>(H) + sizeof(Header), Obj.getBufferStart(),
+           Obj.getBufferSize());
+    H->Size.store(Obj.getBufferSize(), std::memory_order_release);
+    munmap(Addr, Length);
+    ++Stores;
+  }
+
+  /// Remove every entry of this cache, including those other processes are
+  /// using; they keep what they have mapped.
+  void removeAll() {
+    for (auto &E : listEntries())
+      shm_unlink(E.Name.c_str());
+  }
+
+  /// Modules found in the cache, compiled because they were not, and
+  /// stored by this process.
+  uint64_t getHits() const { return Hits; }
+  uint64_t getMisses() const { return Misses; }
+  uint64_t getStores() const { return Stores; }
+
+private:
+  static constexpr uint64_t Magic = 0x4b4f424a43414348; // "KOBJCACH"
+  static constexpr const char *CacheableFlag = "kaleidoscope.cacheable";
+  static constexpr mode_t Mode = 0600;
+  /// Where the system keeps shared memory objects.
+  static constexpr const char *ShmDir = "/dev/shm";
+
+  struct Entry {
+    std::string Name;
+    uint64_t Size;
+    time_t LastUsed;
+  };
+
+  /// Precedes the object in every entry; 64 bytes keep the object aligned
+  /// for the object file readers.
+  struct alignas(64) Header {
+    uint64_t Magic;
+    /// The object's size, or 0 until it has been written.
+    std::atomic<uint64_t> Size;
+  };
+
+  /// An entry mapped into this process; unmapped when the linker is done
+  /// with it.
+  class MappedObject : public MemoryBuffer {
+  public:
+    MappedObject(void *Addr, size_t Length, uint64_t Size, StringRef Name)
+        : Addr(Addr), Length(Length), Name(Name.str()) {
+      const char *Start = static_cast<const char *>(Addr) + sizeof(Header);
+      init(Start, Start + Size, /*RequiresNullTerminator=*/false);
+    }
+    ~MappedObject() override { munmap(Addr, Length); }
+
+    StringRef getBufferIdentifier() const override { return Name; }
+    BufferKind getBufferKind() const override { return MemoryBuffer_MMap; }
+
+  private:
+    void *Addr;
+    size_t Length;
+    std::string Name;
+  };
+
+  /// The entry name for M: a hash of everything its object depends on.
+  std::string getKey(const Module &M) const {
+    SmallString<0> Bitcode;
+    {
+      raw_svector_ostream OS(Bitcode);
+      WriteBitcodeToFile(M, OS);
+    }
+    SHA1 Hash;
+    Hash.update(LLVM_VERSION_STRING);
+    Hash.update(M.getTargetTriple());
+    Hash.update(M.getDataLayoutStr());
+    Hash.update(Bitcode);
+    return Prefix + toHex(Hash.final(), /*LowerCase=*/true);
+  }
+
+  /// The key getObject() computed for M on this thread, if it missed; the
+  /// compiler stores M's object on the same thread right after.
+  static std::string &pendingKey(const Module *M) {
+    static thread_local const Module *For = nullptr;
+    static thread_local std::string Key;
+    if (For != M) {
+      For = M;
+      Key.clear();
+    }
+    return Key;
+  }
+
+  /// Entries someone else made, or made readable to others, may hold any
+  /// code at all.
+  static bool isOurs(const struct stat &St) {
+    return St.st_uid == geteuid() && (St.st_mode & 0777) == Mode;
+  }
+
+  /// This cache's entries, by shm_open() name.
+  std::vector<Entry> listEntries() const {
+    std::vector<Entry> Entries;
+    StringRef File = StringRef(Prefix).drop_front();
+    std::error_code EC;
+    for (sys::fs::directory_iterator I(ShmDir, EC), E; I != E && !EC;
+         I.increment(EC)) {
+      StringRef Name = sys::path::filename(I->path());
+      if (!Name.startswith(File))
+        continue;
+      struct stat St;
+      if (stat(I->path().c_str(), &St) != 0 || !isOurs(St))
+        continue;
+      Entries.push_back({("/" + Name).str(), uint64_t(St.st_size), St.st_mtime});
+    }
+    return Entries;
+  }
+
+  /// Remove the least recently used entries until Incoming more bytes fit.
+  void evict(uint64_t Incoming) {
+    auto Entries = listEntries();
+    uint64_t Total = Incoming;
+    for (auto &E : Entries)
+      Total += E.Size;
+    if (Total <= MaxBytes)
+      return;
+    std::sort(Entries.begin(), Entries.end(), [](const Entry &A, const Entry &B) {
+      return A.LastUsed < B.LastUsed;
+    });
+    for (auto &E : Entries) {
+      if (Total <= MaxBytes)
+        break;
+      if (shm_unlink(E.Name.c_str()) == 0)
+        Total -= E.Size;
+    }
+  }
+
+  std::unique_ptr<MemoryBuffer> miss(const Module *M, std::string &Key) {
+    ++Misses;
+    pendingKey(M) = std::move(Key);
+    return nullptr;
+  }
+
+  std::string Prefix;
+  uint64_t MaxBytes;
+  std::atomic<uint64_t> Hits{0}, Misses{0}, Stores{0};
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_SHAREDOBJECTCACHE_H
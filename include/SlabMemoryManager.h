@@ -0,0 +1,501 @@
+//===- SlabMemoryManager.h - Pooled memory for JIT'd objects ----*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// A RuntimeDyld memory manager that carves sections out of large slabs shared
+// by every object in the JIT, instead of mapping fresh pages per object the
+// way SectionMemoryManager does.
+//
+// Sections are segregated into three pools by final permission, so the code
+// of many small modules ends up densely packed in one region:
+//
+//   code   - written through an RW view, run through an RX view.
+//   rodata - written through an RW view, read through an R view.
+//   rwdata - a single RW mapping.
+//
+// The views map the same memory twice, so finalizing an object changes no
+// permissions: RuntimeDyld is told to relocate each section for its view,
+// and the object's code is live as soon as it has been written. Nothing is
+// ever mprotect()ed, so objects share pages -- huge pages included -- and the
+// slabs stay one mapping each. Where two views cannot be had (no memfd, or
+// executable shared mappings are forbidden) code and rodata fall back to
+// page-granular ranges flipped RW -> RX / R once per object.
+//
+// When the owning ResourceTracker is removed, RTDyldObjectLinkingLayer
+// destroys the per-object manager, which hands its ranges back to the pools
+// for reuse by later objects.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_SLABMEMORYMANAGER_H
+#define LLVM_EXECUTIONENGINE_ORC_SLABMEMORYMANAGER_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace llvm {
+namespace orc {
+
+/// How the slabs backing JIT memory are mapped.
+enum class HugePageKind {
+  None,        ///< Ordinary pages.
+  Transparent, ///< 2MiB-aligned slabs advised with MADV_HUGEPAGE.
+  Explicit     ///< MAP_HUGETLB slabs; falls back to Transparent if the
+               ///< hugetlbfs pool is empty.
+};
+
+/// A thread-safe first-fit allocator over a growing list of slabs. Ranges are
+/// kept in address order so that live allocations stay packed at the low end
+/// of the first slab.
+///
+/// Slabs of an allocator with ViewFlags (sys::Memory::ProtectionFlags) are
+/// mapped a second time with those permissions; allocate() hands out the
+/// writable address and getViewOffset() where the same bytes appear in the
+/// view.
+class SlabAllocator {
+public:
+  SlabAllocator(HugePageKind HugePages, size_t SlabSize, unsigned ViewFlags = 0)
+      : HugePages(HugePages), SlabSize(SlabSize), ViewFlags(ViewFlags),
+        Views(ViewFlags && canMapViews()),
+        // Only ranges that are flipped on their own need whole pages.
+        Granule(ViewFlags && !Views ? sys::Process::getPageSizeEstimate()
+                                    : MinGranule) {}
+
+  SlabAllocator(const SlabAllocator &) = delete;
+  SlabAllocator &operator=(const SlabAllocator &) = delete;
+
+  ~SlabAllocator() {
+    for (auto &S : Slabs)
+      unmapSlab(S);
+  }
+
+  /// Allocate Size bytes aligned to Align. Size is rounded up to the granule,
+  /// so page-granular pools never hand out a partial page.
+  sys::MemoryBlock allocate(size_t Size, size_t Align) {
+    Size = alignTo(std::max<size_t>(Size, 1), Granule);
+    Align = std::max(Align, Granule);
+
+    std::lock_guard<std::mutex> Lock(M);
+    auto B = allocateFromFreeList(Size, Align);
+    if (B.base())
+      return B;
+    if (!addSlab(alignTo(Size + Align, SlabSize)))
+      return sys::MemoryBlock();
+    return allocateFromFreeList(Size, Align);
+  }
+
+  /// Return a range handed out by allocate() to the free list, merging it
+  /// with its neighbours.
+  void release(sys::MemoryBlock B) {
+    uintptr_t Start = reinterpret_cast<uintptr_t>(B.base());
+    size_t Size = B.allocatedSize();
+    if (!Start || !Size)
+      return;
+
+    std::lock_guard<std::mutex> Lock(M);
+    InUse -= Size;
+    auto Next = FreeRanges.lower_bound(Start);
+    if (Next != FreeRanges.end() && Start + Size == Next->first) {
+      Size += Next->second;
+      Next = FreeRanges.erase(Next);
+    }
+    if (Next != FreeRanges.begin()) {
+      auto Prev = std::prev(Next);
+      if (Prev->first + Prev->second == Start) {
+        Prev->second += Size;
+        return;
+      }
+    }
+    FreeRanges.emplace(Start, Size);
+  }
+
+  size_t getGranule() const { return Granule; }
+
+  /// Whether slabs have a view, so ranges never need their permissions
+  /// changed.
+  bool hasViews() const { return Views; }
+
+  /// How far the view of the range at Addr is from Addr.
+  intptr_t getViewOffset(const void *Addr) {
+    uintptr_t A = reinterpret_cast<uintptr_t>(Addr);
+    std::lock_guard<std::mutex> Lock(M);
+    for (auto &S : Slabs) {
+      uintptr_t Base = reinterpret_cast<uintptr_t>(S.Base);
+      if (S.View && A >= Base && A < Base + S.Size)
+        return reinterpret_cast<intptr_t>(S.View) - intptr_t(Base);
+    }
+    return 0;
+  }
+
+  size_t getBytesInUse() {
+    std::lock_guard<std::mutex> Lock(M);
+    return InUse;
+  }
+
+  size_t getBytesMapped() {
+    std::lock_guard<std::mutex> Lock(M);
+    size_t Total = 0;
+    for (auto &S : Slabs)
+      Total += S.Size;
+    return Total;
+  }
+
+private:
+  struct Slab {
+    void *Base;
+    size_t Size;
+    bool Mmapped; // true if obtained by mmap() rather than sys::Memory.
+    void *View;   // the second mapping of Base, if any.
+  };
+
+  static constexpr size_t MinGranule = 16;
+  static constexpr size_t HugePageSize = 2 * 1024 * 1024;
+
+#ifdef __linux__
+  static int getProt(unsigned Flags) {
+    return (Flags & sys::Memory::MF_READ ? PROT_READ : 0) |
+           (Flags & sys::Memory::MF_WRITE ? PROT_WRITE : 0) |
+           (Flags & sys::Memory::MF_EXEC ? PROT_EXEC : 0);
+  }
+
+  /// Map Size bytes of a new memfd twice, writable at W and with Prot at V.
+  static bool mapViews(size_t Size, int Prot, bool HugeTLB, void *&W,
+                       void *&V) {
+    int FD = memfd_create("kaleidoscope-jit",
+                          MFD_CLOEXEC | (HugeTLB ? MFD_HUGETLB : 0));
+    if (FD < 0)
+      return false;
+    W = V = MAP_FAILED;
+    if (ftruncate(FD, Size) == 0) {
+      W = mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_SHARED, FD, 0);
+      if (W != MAP_FAILED)
+        V = mmap(nullptr, Size, Prot, MAP_SHARED, FD, 0);
+    }
+    close(FD);
+    if (V != MAP_FAILED)
+      return true;
+    if (W != MAP_FAILED)
+      munmap(W, Size);
+    return false;
+  }
+#endif
+
+  /// Whether this process may map memory twice with one view executable.
+  static bool canMapViews() {
+#ifdef __linux__
+    static const bool Can = [] {
+      size_t Size = sys::Process::getPageSizeEstimate();
+      void *W, *V;
+      if (!mapViews(Size, PROT_READ | PROT_EXEC, false, W, V))
+        return false;
+      munmap(W, Size);
+      munmap(V, Size);
+      return true;
+    }();
+    return Can;
+#else
+    return false;
+#endif
+  }
+
+  sys::MemoryBlock allocateFromFreeList(size_t Size, size_t Align) {
+    for (auto I = FreeRanges.begin(), E = FreeRanges.end(); I != E; ++I) {
+      uintptr_t Start = I->first, End = I->first + I->second;
+      uintptr_t AlignedStart = alignTo(Start, Align);
+      if (AlignedStart + Size > End)
+        continue;
+
+      FreeRanges.erase(I);
+      if (AlignedStart != Start)
+        FreeRanges.emplace(Start, AlignedStart - Start);
+      if (AlignedStart + Size != End)
+        FreeRanges.emplace(AlignedStart + Size, End - AlignedStart - Size);
+      InUse += Size;
+      return sys::MemoryBlock(reinterpret_cast<void *>(AlignedStart), Size);
+    }
+    return sys::MemoryBlock();
+  }
+
+  bool addSlab(size_t Size) {
+    Slab S{nullptr, Size, false, nullptr};
+#ifdef __linux__
+    if (Views) {
+      void *W, *V;
+      bool HugeTLB = HugePages == HugePageKind::Explicit &&
+                     mapViews(Size, getProt(ViewFlags), true, W, V);
+      if (!HugeTLB && !mapViews(Size, getProt(ViewFlags), false, W, V))
+        return false;
+      if (!HugeTLB && HugePages != HugePageKind::None) {
+        madvise(W, Size, MADV_HUGEPAGE);
+        madvise(V, Size, MADV_HUGEPAGE);
+      }
+      Slabs.push_back({W, Size, true, V});
+      FreeRanges.emplace(reinterpret_cast<uintptr_t>(W), Size);
+      return true;
+    }
+    // mprotect() on a MAP_HUGETLB mapping only works a whole huge page at a
+    // time, so slabs whose ranges are flipped one by one use THP instead.
+    if (HugePages == HugePageKind::Explicit && !ViewFlags) {
+      void *P = mmap(nullptr, Size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (P != MAP_FAILED)
+        S = {P, Size, true, nullptr};
+    }
+    if (!S.Base && HugePages != HugePageKind::None) {
+      // Over-map so the slab can start on a huge page boundary, then trim.
+      size_t Padded = Size + HugePageSize;
+      void *P = mmap(nullptr, Padded, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (P != MAP_FAILED) {
+        uintptr_t Raw = reinterpret_cast<uintptr_t>(P);
+        uintptr_t Aligned = alignTo(Raw, HugePageSize);
+        if (Aligned != Raw)
+          munmap(P, Aligned - Raw);
+        if (Raw + Padded != Aligned + Size)
+          munmap(reinterpret_cast<void *>(Aligned + Size),
+                 Raw + Padded - Aligned - Size);
+        S = {reinterpret_cast<void *>(Aligned), Size, true, nullptr};
+        madvise(S.Base, Size, MADV_HUGEPAGE);
+      }
+    }
+#endif
+    if (!S.Base) {
+      std::error_code EC;
+      auto MB = sys::Memory::allocateMappedMemory(
+          Size, nullptr, sys::Memory::MF_READ | sys::Memory::MF_WRITE, EC);
+      if (EC)
+        return false;
+      S = {MB.base(), MB.allocatedSize(), false, nullptr};
+    }
+
+    Slabs.push_back(S);
+    FreeRanges.emplace(reinterpret_cast<uintptr_t>(S.Base), S.Size);
+    return true;
+  }
+
+  static void unmapSlab(Slab &S) {
+#ifdef __linux__
+    if (S.View)
+      munmap(S.View, S.Size);
+    if (S.Mmapped) {
+      munmap(S.Base, S.Size);
+      return;
+    }
+#endif
+    sys::MemoryBlock MB(S.Base, S.Size);
+    sys::Memory::releaseMappedMemory(MB);
+  }
+
+  HugePageKind HugePages;
+  size_t SlabSize;
+  unsigned ViewFlags;
+  bool Views;
+  size_t Granule;
+
+  std::mutex M;
+  std::map<uintptr_t, size_t> FreeRanges; // start -> size, address ordered.
+  std::vector<Slab> Slabs;
+  size_t InUse = 0;
+};
+
+/// The three permission-segregated pools shared by every SlabMemoryManager of
+/// one JIT instance.
+class SlabMemoryPool {
+public:
+  explicit SlabMemoryPool(HugePageKind HugePages = HugePageKind::None)
+      : Code(HugePages, getSlabSize(HugePages),
+             sys::Memory::MF_READ | sys::Memory::MF_EXEC),
+        ROData(HugePages, getSlabSize(HugePages), sys::Memory::MF_READ),
+        RWData(HugePages, getSlabSize(HugePages)) {}
+
+  SlabAllocator Code;
+  SlabAllocator ROData;
+  SlabAllocator RWData;
+
+private:
+  static size_t getSlabSize(HugePageKind HugePages) {
+    return HugePages == HugePageKind::None ? 1024 * 1024 : 4 * 1024 * 1024;
+  }
+};
+
+/// Per-object front end over a SlabMemoryPool. RuntimeDyld tells us the total
+/// section sizes up front, so each permission class normally costs exactly one
+/// pool allocation per object, and no mprotect when the pool has views.
+class SlabMemoryManager : public RTDyldMemoryManager {
+public:
+  explicit SlabMemoryManager(SlabMemoryPool &Pool) : Pool(Pool) {}
+
+  SlabMemoryManager(const SlabMemoryManager &) = delete;
+  SlabMemoryManager &operator=(const SlabMemoryManager &) = delete;
+
+  ~SlabMemoryManager() override {
+    if (!Pool.Code.hasViews())
+      for (auto &B : CodeBlocks.Blocks)
+        resetPermissions(B);
+    if (!Pool.ROData.hasViews())
+      for (auto &B : ROBlocks.Blocks)
+        resetPermissions(B);
+    CodeBlocks.releaseTo(Pool.Code);
+    ROBlocks.releaseTo(Pool.ROData);
+    RWBlocks.releaseTo(Pool.RWData);
+  }
+
+  bool needsToReserveAllocationSpace() override { return true; }
+
+  void reserveAllocationSpace(uintptr_t CodeSize, uint32_t CodeAlign,
+                              uintptr_t RODataSize, uint32_t RODataAlign,
+                              uintptr_t RWDataSize,
+                              uint32_t RWDataAlign) override {
+    CodeBlocks.reserve(Pool.Code, CodeSize, CodeAlign);
+    ROBlocks.reserve(Pool.ROData, RODataSize, RODataAlign);
+    RWBlocks.reserve(Pool.RWData, RWDataSize, RWDataAlign);
+  }
+
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID,
+                               StringRef SectionName) override {
+    return CodeBlocks.allocate(Pool.Code, Size, Alignment);
+  }
+
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, StringRef SectionName,
+                               bool IsReadOnly) override {
+    if (IsReadOnly)
+      return ROBlocks.allocate(Pool.ROData, Size, Alignment);
+    return RWBlocks.allocate(Pool.RWData, Size, Alignment);
+  }
+
+  using RTDyldMemoryManager::notifyObjectLoaded;
+
+  /// Relocate sections for the views they run from.
+  void notifyObjectLoaded(RuntimeDyld &RTDyld,
+                          const object::ObjectFile &Obj) override {
+    for (auto *L : {&CodeBlocks, &ROBlocks})
+      for (auto &S : L->Sections)
+        RTDyld.mapSectionAddress(S.first, S.second);
+    CodeBlocks.Sections.clear();
+    ROBlocks.Sections.clear();
+  }
+
+  /// Unwinders read .eh_frame where the code it describes is relative to:
+  /// in the view.
+  void registerEHFrames(uint8_t *Addr, uint64_t LoadAddr,
+                        size_t Size) override {
+    RTDyldMemoryManager::registerEHFrames(
+        reinterpret_cast<uint8_t *>(static_cast<uintptr_t>(LoadAddr)),
+        LoadAddr, Size);
+  }
+
+  bool finalizeMemory(std::string *ErrMsg = nullptr) override {
+    if (Pool.Code.hasViews()) {
+      for (auto &B : CodeBlocks.Blocks)
+        sys::Memory::InvalidateInstructionCache(
+            static_cast<char *>(B.base()) + Pool.Code.getViewOffset(B.base()),
+            B.allocatedSize());
+      return false;
+    }
+    for (auto &B : CodeBlocks.Blocks) {
+      if (auto EC = sys::Memory::protectMappedMemory(
+              B, sys::Memory::MF_READ | sys::Memory::MF_EXEC)) {
+        if (ErrMsg)
+          *ErrMsg = EC.message();
+        return true;
+      }
+      sys::Memory::InvalidateInstructionCache(B.base(), B.allocatedSize());
+    }
+    for (auto &B : ROBlocks.Blocks) {
+      if (Pool.ROData.hasViews())
+        break;
+      if (auto EC =
+              sys::Memory::protectMappedMemory(B, sys::Memory::MF_READ)) {
+        if (ErrMsg)
+          *ErrMsg = EC.message();
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  /// The pool ranges owned by this object for one permission class, plus a
+  /// bump pointer into the most recent one.
+  struct BlockList {
+    SmallVector<sys::MemoryBlock, 1> Blocks;
+    uintptr_t Cur = 0, End = 0;
+    /// How far the most recent range's view is from it.
+    intptr_t ViewOffset = 0;
+    /// Sections allocated in a view, and where they appear in it, until
+    /// RuntimeDyld has been told.
+    SmallVector<std::pair<const void *, uint64_t>, 4> Sections;
+
+    void reserve(SlabAllocator &A, uintptr_t Size, uint32_t Align) {
+      if (!Size)
+        return;
+      addBlock(A, Size, Align);
+    }
+
+    uint8_t *allocate(SlabAllocator &A, uintptr_t Size, unsigned Align) {
+      Align = std::max(Align, 1u);
+      uintptr_t Start = alignTo(Cur, Align);
+      // RuntimeDyld may allocate beyond the reservation (e.g. the GOT), so
+      // fall back to a fresh pool range rather than failing.
+      if (!Cur || Start + Size > End) {
+        if (!addBlock(A, Size, Align))
+          return nullptr;
+        Start = alignTo(Cur, Align);
+      }
+      Cur = Start + Size;
+      if (ViewOffset)
+        Sections.push_back({reinterpret_cast<const void *>(Start),
+                            uint64_t(Start + ViewOffset)});
+      return reinterpret_cast<uint8_t *>(Start);
+    }
+
+    bool addBlock(SlabAllocator &A, uintptr_t Size, uint32_t Align) {
+      auto B = A.allocate(Size, Align);
+      if (!B.base())
+        return false;
+      Blocks.push_back(B);
+      Cur = reinterpret_cast<uintptr_t>(B.base());
+      End = Cur + B.allocatedSize();
+      ViewOffset = A.hasViews() ? A.getViewOffset(B.base()) : 0;
+      return true;
+    }
+
+    void releaseTo(SlabAllocator &A) {
+      for (auto &B : Blocks)
+        A.release(B);
+      Blocks.clear();
+    }
+  };
+
+  static void resetPermissions(sys::MemoryBlock &B) {
+    sys::Memory::protectMappedMemory(
+        B, sys::Memory::MF_READ | sys::Memory::MF_WRITE);
+  }
+
+  SlabMemoryPool &Pool;
+  BlockList CodeBlocks, ROBlocks, RWBlocks;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_SLABMEMORYMANAGER_H
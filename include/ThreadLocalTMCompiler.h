@@ -0,0 +1,137 @@
+//===- ThreadLocalTMCompiler.h - IR compiler reusing TargetMachines -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// A drop-in replacement for ConcurrentIRCompiler. ConcurrentIRCompiler builds
+// a fresh TargetMachine for every module; with one module per definition and
+// per expression that setup dominates small compiles. This compiler instead
+// creates one TargetMachine per compiling thread, lazily, and reuses it.
+//
+// A TargetMachine is not safe to share between threads that compile at the
+// same time, but it can be reused by sequential compiles on one thread, so
+// keeping one per thread preserves ConcurrentIRCompiler's guarantees. A
+// thread's TargetMachine is destroyed when the thread exits, so compilers
+// fed by short-lived threads don't accumulate them.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_THREADLOCALTMCOMPILER_H
+#define LLVM_EXECUTIONENGINE_ORC_THREADLOCALTMCOMPILER_H
+
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include "CompileTelemetry.h"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace llvm {
+namespace orc {
+
+class ThreadLocalTMCompiler : public IRCompileLayer::IRCompiler {
+public:
+  ThreadLocalTMCompiler(JITTargetMachineBuilder JTMB,
+                        ObjectCache *ObjCache = nullptr)
+      : IRCompiler(irManglingOptionsFromTargetOptions(JTMB.getOptions())),
+        JTMB(std::move(JTMB)), ObjCache(ObjCache),
+        TMs(std::make_shared<TargetMachines>()) {}
+
+  void setObjectCache(ObjectCache *ObjCache) { this->ObjCache = ObjCache; }
+
+  /// Report each module's object emission time to T.
+  void setTelemetry(CompileTelemetry *T) { Telemetry = T; }
+
+  Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+    if (Telemetry)
+      Telemetry->notifyEmitStart(M.getModuleIdentifier());
+    auto TM = getTargetMachine();
+    if (!TM)
+      return TM.takeError();
+    SimpleCompiler C(**TM, ObjCache);
+    auto Obj = C(M);
+    if (Telemetry)
+      Telemetry->notifyEmitEnd(M.getModuleIdentifier());
+    return Obj;
+  }
+
+  /// Number of TargetMachines alive, i.e. the number of live threads that
+  /// have compiled through this instance.
+  size_t getNumTargetMachines() {
+    std::lock_guard<std::mutex> Lock(TMs->M);
+    return TMs->ByThread.size();
+  }
+
+private:
+  /// The TargetMachines of one compiler, by thread. Shared with the threads
+  /// that hold one, which may outlive the compiler.
+  struct TargetMachines {
+    std::mutex M;
+    std::map<std::thread::id, std::unique_ptr<TargetMachine>> ByThread;
+  };
+
+  /// Per thread: the compilers holding a TargetMachine for it, which drop
+  /// it when the thread exits.
+  struct ThreadExit {
+    std::vector<std::weak_ptr<TargetMachines>> Owners;
+
+    ~ThreadExit() {
+      auto Id = std::this_thread::get_id();
+      for (auto &W : Owners)
+        if (auto TMs = W.lock()) {
+          std::lock_guard<std::mutex> Lock(TMs->M);
+          TMs->ByThread.erase(Id);
+        }
+    }
+  };
+
+  Expected<TargetMachine *> getTargetMachine() {
+    auto Id = std::this_thread::get_id();
+    {
+      std::lock_guard<std::mutex> Lock(TMs->M);
+      auto I = TMs->ByThread.find(Id);
+      if (I != TMs->ByThread.end())
+        return I->second.get();
+    }
+
+    // Build outside the lock: TargetMachine creation is the slow part, and
+    // only this thread can insert under Id.
+    auto TM = JTMB.createTargetMachine();
+    if (!TM)
+      return TM.takeError();
+
+    static thread_local ThreadExit OnExit;
+    OnExit.Owners.erase(
+        std::remove_if(OnExit.Owners.begin(), OnExit.Owners.end(),
+                       [](const std::weak_ptr<TargetMachines> &W) {
+                         return W.expired();
+                       }),
+        OnExit.Owners.end());
+    OnExit.Owners.push_back(TMs);
+    std::lock_guard<std::mutex> Lock(TMs->M);
+    auto &Slot = TMs->ByThread[Id];
+    Slot = std::move(*TM);
+    return Slot.get();
+  }
+
+  JITTargetMachineBuilder JTMB;
+  ObjectCache *ObjCache = nullptr;
+  CompileTelemetry *Telemetry = nullptr;
+
+  std::shared_ptr<TargetMachines> TMs;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_THREADLOCALTMCOMPILER_H
@@ -0,0 +1,60 @@
+//===- ThreadPoolTaskDispatcher.h - Fixed-size ORC task pool ----*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Runs ExecutionSession tasks (materialization, lookup continuations) on a
+// fixed set of worker threads. DynamicThreadPoolTaskDispatcher starts a new
+// thread per task, which would also defeat ThreadLocalTMCompiler: every
+// compile would land on a fresh thread and build a fresh TargetMachine.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_THREADPOOLTASKDISPATCHER_H
+#define LLVM_EXECUTIONENGINE_ORC_THREADPOOLTASKDISPATCHER_H
+
+#include "llvm/ExecutionEngine/Orc/TaskDispatch.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+
+#include <memory>
+
+namespace llvm {
+namespace orc {
+
+class ThreadPoolTaskDispatcher : public TaskDispatcher {
+public:
+  /// With Background set, the pool's threads lower their own priority the
+  /// first time they run a task.
+  explicit ThreadPoolTaskDispatcher(unsigned NumThreads,
+                                    bool Background = false)
+      : Pool(hardware_concurrency(NumThreads)), Background(Background) {}
+
+  void dispatch(std::unique_ptr<Task> T) override {
+    // ThreadPool wants a copyable callable.
+    std::shared_ptr<Task> Shared(std::move(T));
+    bool Lower = Background;
+    Pool.async([Shared, Lower]() {
+      static thread_local bool Lowered = false;
+      if (Lower && !Lowered) {
+        set_thread_priority(ThreadPriority::Background);
+        Lowered = true;
+      }
+      Shared->run();
+    });
+  }
+
+  void shutdown() override { Pool.wait(); }
+
+private:
+  ThreadPool Pool;
+  bool Background;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_THREADPOOLTASKDISPATCHER_H
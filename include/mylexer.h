@@ -13,20 +13,31 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 //#include "/home/zx/Desktop/llvm_code_all/llvm-project/llvm/include/llvm/ExecutionEngine/Orc/Shared/ExecutorSymbolDef.h"
-#include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "SlabMemoryManager.h"
+#include "ThreadLocalTMCompiler.h"
+#include "ThreadPoolTaskDispatcher.h"
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 namespace llvm {
 namespace orc {
@@ -35,27 +46,80 @@ class KaleidoscopeJIT {
 private:
   std::unique_ptr<ExecutionSession> ES;
 
+  JITTargetMachineBuilder JTMB;
   DataLayout DL;
   MangleAndInterner Mangle;
 
+  SlabMemoryPool MemPool;
   RTDyldObjectLinkingLayer ObjectLayer;
   IRCompileLayer CompileLayer;
 
   JITDylib &MainJD;
+  // Builtins, defined up front; MainJD and every linked dylib search it after
+  // themselves. ProcessJD, if searchProcessSymbols() created it, comes last.
+  JITDylib &RuntimeJD;
+  JITDylib *ProcessJD = nullptr;
+
+  // Shared libraries named by extern "lib" declarations. Each gets a dylib of
+  // absolute symbols, defined as externs ask for them, so resolving one is a
+  // map hit rather than a search of every library in the process.
+  struct ForeignLibrary {
+    sys::DynamicLibrary Lib;
+    JITDylib *JD;
+    StringSet<> Defined;
+  };
+  std::mutex ForeignMutex;
+  StringMap<ForeignLibrary> ForeignLibraries;
+
+  // Interned names of entry slots; FreeEntrySlots lists those not in flight.
+  std::mutex EntrySlotMutex;
+  std::vector<SymbolStringPtr> EntrySlotNames;
+  std::vector<unsigned> FreeEntrySlots;
+
+  // Stubs made by redirect(), keyed by the dylib and name they define. Each
+  // remembers the body it jumps to, and whether anything has linked against
+  // it yet; until then it can be repointed without touching any code.
+  struct Redirection {
+    SymbolStringPtr Body;
+    std::string StubName;
+    bool Materialized;
+  };
+  std::unique_ptr<IndirectStubsManager> Stubs;
+  std::mutex RedirectMutex;
+  std::map<std::pair<JITDylib *, SymbolStringPtr>, Redirection> Redirections;
+  unsigned NextStub = 0;
+
+  class RedirectionMaterializationUnit;
 
 public:
+  /// A uniquely named entry point for one top-level expression. Slots are
+  /// recycled once their code is removed, so a long session keeps reusing the
+  /// same few names and never re-mangles or re-interns them.
+  struct EntrySlot {
+    unsigned Index;
+    std::string Name;
+    ResourceTrackerSP RT;
+    JITDylib *JD;
+  };
+
   KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                  JITTargetMachineBuilder JTMB, DataLayout DL)
-      : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
+                  JITTargetMachineBuilder JTMB, DataLayout DL,
+                  HugePageKind HugePages = HugePageKind::None)
+      : ES(std::move(ES)), JTMB(JTMB), DL(std::move(DL)),
+        Mangle(*this->ES, this->DL),
+        MemPool(HugePages),
         ObjectLayer(*this->ES,
-                    []() { return std::make_unique<SectionMemoryManager>(); }),
+                    [this]() {
+                      return std::make_unique<SlabMemoryManager>(MemPool);
+                    }),
         CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-        MainJD(this->ES->createBareJITDylib("<main>")) {
-    MainJD.addGenerator(
-        cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
-            DL.getGlobalPrefix())));
-    if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
+                     std::make_unique<ThreadLocalTMCompiler>(std::move(JTMB))),
+        Stubs(createLocalIndirectStubsManagerBuilder(
+            this->JTMB.getTargetTriple())()),
+        MainJD(this->ES->createBareJITDylib("<main>")),
+        RuntimeJD(this->ES->createBareJITDylib("<runtime>")) {
+    MainJD.addToLinkOrder(RuntimeJD);
+    if (this->JTMB.getTargetTriple().isOSBinFormatCOFF()) {
       ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
       ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
     }
@@ -66,8 +130,19 @@ public:
       ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
-    auto EPC = SelfExecutorProcessControl::Create();
+  /// With CompileThreads == 0 every materialization runs on the thread that
+  /// triggered it, as before; otherwise a fixed pool of that many threads
+  /// compiles in the background, which speculate() relies on. With
+  /// BackgroundCompiles the pool runs at background priority, so threads
+  /// running JIT'd code get the CPU first.
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(HugePageKind HugePages = HugePageKind::None,
+         unsigned CompileThreads = 0, bool BackgroundCompiles = false) {
+    std::unique_ptr<TaskDispatcher> D;
+    if (CompileThreads)
+      D = std::make_unique<ThreadPoolTaskDispatcher>(CompileThreads,
+                                                     BackgroundCompiles);
+    auto EPC = SelfExecutorProcessControl::Create(nullptr, std::move(D));
     if (!EPC)
       return EPC.takeError();
 
@@ -81,13 +156,201 @@ public:
       return DL.takeError();
 
     return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+                                             std::move(*DL), HugePages);
   }
 
   const DataLayout &getDataLayout() const { return DL; }
 
+  /// A TargetMachine matching the one code is emitted with, for IR passes
+  /// that need target cost models (the inliner, the vectorizers).
+  Expected<std::unique_ptr<TargetMachine>> createTargetMachine() {
+    return JTMB.createTargetMachine();
+  }
+
   JITDylib &getMainJITDylib() { return MainJD; }
 
+  /// A new, empty JITDylib whose definitions can call MainJD's and the
+  /// builtins, and with SearchProcess whatever searchProcessSymbols() finds.
+  /// Dylibs are independent of each other, so each can define the same names.
+  Expected<JITDylib &> createLinkedJITDylib(std::string Name,
+                                            bool SearchProcess = true) {
+    auto JD = ES->createJITDylib(std::move(Name));
+    if (!JD)
+      return JD.takeError();
+    JD->addToLinkOrder(MainJD);
+    JD->addToLinkOrder(RuntimeJD);
+    if (ProcessJD && SearchProcess)
+      JD->addToLinkOrder(*ProcessJD);
+    return *JD;
+  }
+
+  /// Define each of Symbols, by unmangled name, as a builtin at its address;
+  /// functions unless Callable is false.
+  Error defineRuntimeSymbols(const std::map<std::string, JITTargetAddress> &Symbols,
+                             bool Callable = true) {
+    JITSymbolFlags Flags = JITSymbolFlags::Exported;
+    if (Callable)
+      Flags |= JITSymbolFlags::Callable;
+    SymbolMap Map;
+    for (auto &KV : Symbols)
+      Map[Mangle(KV.first)] = JITEvaluatedSymbol(KV.second, Flags);
+    return RuntimeJD.define(absoluteSymbols(std::move(Map)));
+  }
+
+  /// Resolve names nothing else defines by searching every library loaded
+  /// into the process, after the builtins. Affects MainJD and the dylibs
+  /// created from now on.
+  void searchProcessSymbols() {
+    if (ProcessJD)
+      return;
+    ProcessJD = &ES->createBareJITDylib("<process>");
+    ProcessJD->addGenerator(
+        cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            DL.getGlobalPrefix())));
+    MainJD.addToLinkOrder(*ProcessJD);
+  }
+
+  /// Make Name from the shared library at Path callable from JD: load the
+  /// library on first use, look Name up in it once, and put the library's
+  /// dylib in JD's link order right after JD itself, ahead of the builtins.
+  Error linkForeignSymbol(JITDylib &JD, StringRef Path, StringRef Name) {
+    JITDylib *LibJD;
+    {
+      std::lock_guard<std::mutex> Lock(ForeignMutex);
+      auto I = ForeignLibraries.find(Path);
+      if (I == ForeignLibraries.end()) {
+        std::string ErrMsg;
+        auto Lib = sys::DynamicLibrary::getPermanentLibrary(Path.str().c_str(),
+                                                            &ErrMsg);
+        if (!Lib.isValid())
+          return createStringError(inconvertibleErrorCode(), ErrMsg);
+        I = ForeignLibraries
+                .insert({Path, ForeignLibrary{Lib, &ES->createBareJITDylib(
+                                                       "<" + Path.str() + ">"),
+                                              {}}})
+                .first;
+      }
+      ForeignLibrary &FL = I->second;
+      LibJD = FL.JD;
+      if (!FL.Defined.count(Name)) {
+        void *Addr = FL.Lib.getAddressOfSymbol(Name.str().c_str());
+        if (!Addr)
+          return createStringError(inconvertibleErrorCode(),
+                                   "%s: undefined symbol '%s'",
+                                   Path.str().c_str(), Name.str().c_str());
+        if (auto Err = LibJD->define(absoluteSymbols(
+                {{Mangle(Name), JITEvaluatedSymbol(pointerToJITTargetAddress(Addr),
+                                                   JITSymbolFlags::Exported |
+                                                       JITSymbolFlags::Callable)}})))
+          return Err;
+        FL.Defined.insert(Name);
+      }
+    }
+
+    JITDylibSearchOrder Order;
+    JD.withLinkOrderDo([&](const JITDylibSearchOrder &LinkOrder) {
+      Order = LinkOrder;
+    });
+    for (auto &Entry : Order)
+      if (Entry.first == LibJD)
+        return Error::success();
+    // The link order starts with JD itself.
+    Order.insert(Order.begin() + 1,
+                 {LibJD, JITDylibLookupFlags::MatchExportedSymbolsOnly});
+    JD.setLinkOrder(std::move(Order), /*LinkAgainstThisJITDylibFirst=*/false);
+    return Error::success();
+  }
+
+  /// Free a dylib from createLinkedJITDylib() and all code in it. Its stubs'
+  /// few bytes stay allocated; the stubs manager cannot free them.
+  Error removeJITDylib(JITDylib &JD) {
+    {
+      std::lock_guard<std::mutex> Lock(RedirectMutex);
+      for (auto I = Redirections.begin(); I != Redirections.end();)
+        I = I->first.first == &JD ? Redirections.erase(I) : std::next(I);
+    }
+    return ES->removeJITDylib(JD);
+  }
+
+  /// Define Name in JD as a stub that jumps to Body, looked up from JD once
+  /// something links against Name. Calling this again for the same Name
+  /// repoints the stub, so code already linked against it reaches the new
+  /// Body; if the stub is in use, Body is materialized before this returns.
+  Error redirect(JITDylib &JD, StringRef Name, StringRef Body) {
+    SymbolStringPtr StubSym = Mangle(Name), BodySym = Mangle(Body);
+    bool Existing;
+    {
+      std::lock_guard<std::mutex> Lock(RedirectMutex);
+      auto I = Redirections.insert(
+          {{&JD, StubSym},
+           {BodySym, "stub." + std::to_string(NextStub), false}});
+      Existing = !I.second;
+      if (!Existing)
+        ++NextStub;
+      else if (!I.first->second.Materialized) {
+        I.first->second.Body = BodySym;
+        return Error::success();
+      }
+    }
+    if (!Existing) {
+      if (auto Err = JD.define(std::make_unique<RedirectionMaterializationUnit>(
+              *this, JD, StubSym))) {
+        std::lock_guard<std::mutex> Lock(RedirectMutex);
+        Redirections.erase({&JD, StubSym});
+        return Err;
+      }
+      return Error::success();
+    }
+
+    // Wait until the stub's first body is in place, so that cannot land after
+    // the new one, then point the stub at the new body.
+    auto Stub = ES->lookup({&JD}, StubSym);
+    if (!Stub)
+      return Stub.takeError();
+    auto Sym = ES->lookup(getSearchOrder(JD), BodySym);
+    if (!Sym)
+      return Sym.takeError();
+    std::lock_guard<std::mutex> Lock(RedirectMutex);
+    auto &R = Redirections[{&JD, StubSym}];
+    R.Body = BodySym;
+    return Stubs->updatePointer(R.StubName, Sym->getAddress());
+  }
+
+  SlabMemoryPool &getMemoryPool() { return MemPool; }
+
+  /// Report emit/link times and machine code size of every module added from
+  /// now on to T, which must outlive the JIT.
+  void setTelemetry(CompileTelemetry &T) {
+    static_cast<ThreadLocalTMCompiler &>(CompileLayer.getCompiler())
+        .setTelemetry(&T);
+    ObjectLayer.setNotifyLoaded([&T](MaterializationResponsibility &R,
+                                     const object::ObjectFile &Obj,
+                                     const RuntimeDyld::LoadedObjectInfo &) {
+      uint64_t CodeBytes = 0;
+      for (auto &Sec : Obj.sections())
+        if (Sec.isText())
+          CodeBytes += Sec.getSize();
+      T.notifyCodeBytes(Obj.getFileName(), CodeBytes);
+    });
+    ObjectLayer.setNotifyEmitted(
+        [&T](MaterializationResponsibility &R,
+             std::unique_ptr<MemoryBuffer> Obj) {
+          T.notifyLinked(Obj->getBufferIdentifier());
+        });
+  }
+
+  /// Look modules up in C before compiling them, and store what is compiled
+  /// in it. C must outlive the JIT.
+  void setObjectCache(ObjectCache &C) {
+    static_cast<ThreadLocalTMCompiler &>(CompileLayer.getCompiler())
+        .setObjectCache(&C);
+  }
+
+  /// Notify L of every object loaded from now on. L must outlive the JIT.
+  void registerJITEventListener(JITEventListener &L) {
+    ObjectLayer.registerJITEventListener(L);
+  }
+
   Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
@@ -99,10 +362,190 @@ public:
     return ES->lookup({&MainJD}, Mangle(Name.str()));
   }
 #else
-  Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
-    return ES->lookup({&MainJD}, Mangle(Name.str()));
+  /// Look up a named definition visible from JD. Callers that look the same
+  /// name up repeatedly keep the address themselves.
+  Expected<JITEvaluatedSymbol> lookup(JITDylib &JD, StringRef Name) {
+    return ES->lookup(getSearchOrder(JD), Mangle(Name.str()));
   }
 #endif
+
+  /// Start materializing Names without waiting for the result. Names that
+  /// are not (yet) defined are ignored, and failures are dropped: the real
+  /// lookup that follows will report them.
+  void speculate(JITDylib &JD, ArrayRef<std::string> Names) {
+    SymbolLookupSet Symbols;
+    for (auto &Name : Names)
+      Symbols.add(Mangle(Name), SymbolLookupFlags::WeaklyReferencedSymbol);
+    ES->lookup(
+        LookupKind::Static, getSearchOrder(JD),
+        std::move(Symbols), SymbolState::Ready,
+        [](Expected<SymbolMap> Result) {
+          if (!Result)
+            consumeError(Result.takeError());
+        },
+        NoDependenciesToRegister);
+  }
+
+  /// Look up all of Names visible from JD in one query, so the modules
+  /// defining them are materialized together rather than one lookup at a
+  /// time. Addresses come back in the order of Names.
+  Expected<std::vector<JITTargetAddress>> lookupAll(JITDylib &JD,
+                                                    ArrayRef<std::string> Names) {
+    std::vector<SymbolStringPtr> Mangled;
+    SymbolLookupSet Symbols;
+    for (auto &Name : Names) {
+      Mangled.push_back(Mangle(Name));
+      Symbols.add(Mangled.back());
+    }
+    auto Result = ES->lookup(getSearchOrder(JD), std::move(Symbols));
+    if (!Result)
+      return Result.takeError();
+    std::vector<JITTargetAddress> Addrs;
+    for (auto &Name : Mangled)
+      Addrs.push_back((*Result)[Name].getAddress());
+    return Addrs;
+  }
+
+  /// Reserve an entry slot and a fresh tracker in JD for a top-level
+  /// expression.
+  EntrySlot acquireEntrySlot(JITDylib &JD) {
+    std::lock_guard<std::mutex> Lock(EntrySlotMutex);
+    unsigned Index;
+    if (!FreeEntrySlots.empty()) {
+      Index = FreeEntrySlots.back();
+      FreeEntrySlots.pop_back();
+    } else {
+      Index = EntrySlotNames.size();
+      EntrySlotNames.push_back(
+          Mangle("__anon_expr." + std::to_string(Index)));
+    }
+    return {Index, "__anon_expr." + std::to_string(Index),
+            JD.createResourceTracker(), &JD};
+  }
+
+  /// Materialize the slot's code and return its address. The name was
+  /// interned when the slot was created, so this goes straight to the
+  /// session without mangling, searching only the slot's JITDylib.
+  Expected<JITEvaluatedSymbol> lookup(const EntrySlot &Slot) {
+    SymbolStringPtr Name;
+    {
+      std::lock_guard<std::mutex> Lock(EntrySlotMutex);
+      Name = EntrySlotNames[Slot.Index];
+    }
+    return ES->lookup({Slot.JD}, Name);
+  }
+
+  /// Start materializing the slot's code and call OnResolved with its
+  /// address once it is ready, on whichever thread finishes the work.
+  void lookupAsync(const EntrySlot &Slot,
+                   unique_function<void(Expected<JITEvaluatedSymbol>)> OnResolved) {
+    SymbolStringPtr Name;
+    {
+      std::lock_guard<std::mutex> Lock(EntrySlotMutex);
+      Name = EntrySlotNames[Slot.Index];
+    }
+    ES->lookup(
+        LookupKind::Static, makeJITDylibSearchOrder(Slot.JD),
+        SymbolLookupSet(Name), SymbolState::Ready,
+        [Name, OnResolved = std::move(OnResolved)](
+            Expected<SymbolMap> Result) mutable {
+          if (!Result)
+            return OnResolved(Result.takeError());
+          OnResolved((*Result)[Name]);
+        },
+        NoDependenciesToRegister);
+  }
+
+  /// Free the slot's code and make the slot available for reuse.
+  Error releaseEntrySlot(EntrySlot Slot) {
+    if (auto Err = Slot.RT->remove())
+      return Err;
+    std::lock_guard<std::mutex> Lock(EntrySlotMutex);
+    FreeEntrySlots.push_back(Slot.Index);
+    return Error::success();
+  }
+
+private:
+  /// Defines one name for redirect(). Materializing it creates the stub and
+  /// resolves the name to it at once, then fills in the body's address when
+  /// the body resolves. The stub depends on the body, so code calling it is
+  /// not run before the body is ready, and mutually recursive definitions
+  /// materialize together rather than waiting on each other.
+  class RedirectionMaterializationUnit : public MaterializationUnit {
+  public:
+    RedirectionMaterializationUnit(KaleidoscopeJIT &J, JITDylib &JD,
+                                   SymbolStringPtr Name)
+        : MaterializationUnit(Interface(
+              SymbolFlagsMap{{Name, JITSymbolFlags::Exported |
+                                        JITSymbolFlags::Callable}},
+              nullptr)),
+          J(J), JD(JD), Name(std::move(Name)) {}
+
+    StringRef getName() const override { return "<redirection>"; }
+
+    void materialize(std::unique_ptr<MaterializationResponsibility> R) override {
+      SymbolStringPtr Body;
+      std::string StubName;
+      {
+        std::lock_guard<std::mutex> Lock(J.RedirectMutex);
+        auto &Entry = J.Redirections[{&JD, Name}];
+        Entry.Materialized = true;
+        Body = Entry.Body;
+        StubName = Entry.StubName;
+      }
+      if (auto Err = J.Stubs->createStub(StubName, 0, JITSymbolFlags::Exported)) {
+        J.ES->reportError(std::move(Err));
+        return R->failMaterialization();
+      }
+      auto Stub = J.Stubs->findStub(StubName, false);
+      if (auto Err = R->notifyResolved({{Name, JITEvaluatedSymbol(
+                                                   Stub.getAddress(),
+                                                   JITSymbolFlags::Exported |
+                                                       JITSymbolFlags::Callable)}})) {
+        J.ES->reportError(std::move(Err));
+        return R->failMaterialization();
+      }
+
+      std::shared_ptr<MaterializationResponsibility> SharedR = std::move(R);
+      KaleidoscopeJIT &J = this->J;
+      J.ES->lookup(
+          LookupKind::Static, J.getSearchOrder(JD), SymbolLookupSet(Body),
+          SymbolState::Resolved,
+          [&J, SharedR, Body, StubName](Expected<SymbolMap> Result) {
+            Error Err = Result ? J.Stubs->updatePointer(
+                                     StubName, (*Result)[Body].getAddress())
+                               : Result.takeError();
+            if (!Err)
+              Err = SharedR->notifyEmitted();
+            if (Err) {
+              J.ES->reportError(std::move(Err));
+              SharedR->failMaterialization();
+            }
+          },
+          [SharedR](const SymbolDependenceMap &Deps) {
+            SharedR->addDependenciesForAll(Deps);
+          });
+    }
+
+  private:
+    void discard(const JITDylib &, const SymbolStringPtr &) override {}
+
+    KaleidoscopeJIT &J;
+    JITDylib &JD;
+    SymbolStringPtr Name;
+  };
+
+  /// JD, then what it links against: MainJD for dylibs from
+  /// createLinkedJITDylib(), plus any library dylibs added to its link order.
+  JITDylibSearchOrder getSearchOrder(JITDylib &JD) {
+    JITDylibSearchOrder Order = makeJITDylibSearchOrder(&JD);
+    JD.withLinkOrderDo([&](const JITDylibSearchOrder &LinkOrder) {
+      for (auto &Entry : LinkOrder)
+        if (Entry.first != &JD)
+          Order.push_back(Entry);
+    });
+    return Order;
+  }
 };
 
 } // end namespace orc
@@ -1,19 +1,31 @@
 #include "llvm/ADT/APFloat.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ADT/FoldingSet.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LLVMRemarkStreamer.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
 
 #include "llvm/Passes/PassBuilder.h"
-#include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/Remarks/RemarkStreamer.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO/HotColdSplitting.h"
+#include "llvm/Transforms/IPO/Internalize.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
@@ -21,17 +33,36 @@
 #include "llvm/Transforms/Scalar/SimplifyCFG.h"
 
 #include "include/mylexer.h"
+#include "include/PerfMapListener.h"
+#include "include/CompileTelemetry.h"
+#include "include/PassStatistics.h"
+#include "include/ProfileCounters.h"
+#include "include/ArgValueProfile.h"
+#include "include/KaleidoscopeEngine.h"
+#include "include/EvaluationServer.h"
+#include "include/BatchEvaluator.h"
+#include "include/SharedObjectCache.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
+#include <deque>
+#include <future>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
 #include <string>
 #include <vector>
 #include <string>
 #include <iostream>
+#include <thread>
 #include <utility>
 
 #ifdef _WIN32
@@ -48,50 +79,16 @@ extern double putchard(double X);
 /// printd - printf that takes a double prints it as "%f\n", returning 0.
 extern double printd(double X);
 
+#ifndef KALEIDOSCOPE_NO_MAIN
+/// runtime.ll as bitcode, embedded by the linker (ld -r -b binary runtime.bc).
+extern const char _binary_runtime_bc_start[];
+extern const char _binary_runtime_bc_end[];
+#endif
+
 #include <stdio.h>
 #include <dlfcn.h>
+#include <signal.h>
 
-typedef double(*my_func_t)(double); // 定义一个函数指针类型
-
-int loadso() {
-	#if 0
-    void *handle;
-    char *error;
-    my_func_t my_func;
-
-    // 加载动态链接库
-    handle = dlopen("./libmylib.so", RTLD_NOW);
-    if (!handle) {
-        fprintf(stderr, "%s\n", dlerror());
-				exit(-1);
-        return 1;
-    }
-
-    // 清除之前的错误
-    dlerror();
-
-    // 查找符号
-    *(void **) (&my_func) = dlsym(handle, "putchard");
-    error = dlerror();
-    if (error != NULL) {
-        fprintf(stderr, "%s\n", error);
-        dlclose(handle);
-        return 1;
-    }
-
-    // 调用函数
-    my_func(42);
-    //printf("Result: %d\n", result);
-
-    //// 关闭动态链接库
-    //dlclose(handle);
-#else
-extern double putchard(double X) ;
-putchard(42) ;
-#endif
-
-    return 0;
-}
 }
 
 
@@ -120,30 +117,87 @@ enum Token
 
 	tok_for = -9,
 	tok_in = -10,
+
+	// modules
+	tok_import = -11,
+	tok_string = -12,
+};
+
+/// SourceLocation - A line/column position in the input, both 1-based.
+struct SourceLocation
+{
+	int Line;
+	int Col;
 };
 
-static std::string IdentifierStr; // Filled in if tok identifier
-static double NumVal;
+/// Lexer - Splits stdin, or a string, into tokens. Each engine entry point
+/// lexes with its own Lexer, so engines on different threads never share one.
+class Lexer
+{
+	public:
+		/// Read from standard input.
+		Lexer() : FromStdin(true) {}
+		/// Read from Source, which must outlive the lexer.
+		explicit Lexer(llvm::StringRef Source) : Source(Source), FromStdin(false) {}
+
+		int gettok();
+
+		std::string IdentifierStr; // Filled in if tok identifier
+		double NumVal = 0;
+		std::string StringVal; // Filled in if tok_string
+		/// CurLoc is where the current token starts; LexLoc is where the lexer is.
+		SourceLocation CurLoc = {0, 0};
+		SourceLocation LexLoc = {1, 0};
+
+	private:
+		int advance();
+
+		llvm::StringRef Source;
+		size_t Pos = 0;
+		bool FromStdin;
+		int LastChar = ' ';
+};
 
-//gettok - Return the next token from standard input.
-static int gettok()
+/// advance - Read the next input character, keeping LexLoc up to date.
+int Lexer::advance()
 {
-	static int LastChar = ' ';
+	int ThisChar;
+	if(FromStdin)
+		ThisChar = getchar();
+	else
+		ThisChar = Pos < Source.size() ? (unsigned char)Source[Pos++] : EOF;
+
+	if(ThisChar == '\n' || ThisChar == '\r')
+	{
+		LexLoc.Line++;
+		LexLoc.Col = 0;
+	}
+	else
+		LexLoc.Col++;
+	return ThisChar;
+}
 
+//gettok - Return the next token from the input.
+int Lexer::gettok()
+{
 	//Skip any whitespace.
 	while(isspace(LastChar))
-		LastChar = getchar();
+		LastChar = advance();
+
+	CurLoc = LexLoc;
 
 	if(isalpha(LastChar)) //identifier: [a-zA-Z][a-zA-Z0-9]*
 	{
 		IdentifierStr = LastChar;
-		while(isalnum(LastChar = getchar()))
+		while(isalnum(LastChar = advance()))
 			IdentifierStr += LastChar;
 
 		if(IdentifierStr == "def")
 			return tok_def;
 		if(IdentifierStr == "extern")
 			return tok_extern;
+		if(IdentifierStr == "import")
+			return tok_import;
 
 		if (IdentifierStr == "if")
 			  return tok_if;
@@ -166,19 +220,29 @@ static int gettok()
 		do
 		{
 			NumStr += LastChar;
-			LastChar = getchar();
+			LastChar = advance();
 		}while(isdigit(LastChar) || LastChar == '.');
 
 		NumVal = strtod(NumStr.c_str(),0);
 		return tok_number;
 	}
 
+	if(LastChar == '"') //string: "[^"\n]*"
+	{
+		StringVal.clear();
+		while((LastChar = advance()) != '"' && LastChar != EOF && LastChar != '\n')
+			StringVal += LastChar;
+		if(LastChar == '"')
+			LastChar = advance();
+		return tok_string;
+	}
+
 	if(LastChar == '#')
 	{
 		//Comment unilt end of line.
 		do
 		{
-			LastChar = getchar();
+			LastChar = advance();
 		}while(LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
 		if(LastChar != EOF)
@@ -191,18 +255,31 @@ static int gettok()
 
 	//Otherwise, just return the character as its ascii value.
 	int ThisChar = LastChar;
-	LastChar = getchar();
+	LastChar = advance();
 	return ThisChar;
 }
 
 /********************************************************* parser **************************************************************/
+/// EngineImpl - Per-engine compiler and JIT state, see the codegen section.
+using EngineImpl = llvm::orc::KaleidoscopeEngine::Impl;
 
 ///ExprAST - Base class for all expression nodes.
 class ExprAST
 {
+		SourceLocation Loc;
+
 	public:
+		ExprAST(SourceLocation Loc) : Loc(Loc) {}
 		virtual ~ExprAST() = default;
-		virtual llvm::Value *codegen() = 0;
+		int getLine() const { return Loc.Line; }
+		int getCol() const { return Loc.Col; }
+		virtual llvm::Value *codegen(EngineImpl &E) = 0;
+		/// collectCalls - Add the expected number of calls to each callee per
+		/// evaluation of this expression, scaled by Expected, to Calls.
+		virtual void collectCalls(std::map<std::string, double> &Calls, double Expected) const = 0;
+		/// profile - Add this expression's structure to ID, with the version of
+		/// every function it calls, so equal IDs compute equal values.
+		virtual void profile(llvm::FoldingSetNodeID &ID, const EngineImpl &E) const = 0;
 };
 
 //NumberExprAST - Expression class for numeric literals like "1.0".
@@ -210,8 +287,10 @@ class NumberExprAST : public ExprAST
 {
 		double Val;
 	public:
-		NumberExprAST(double V) : Val(V){}
-		llvm::Value *codegen() override;
+		NumberExprAST(SourceLocation Loc, double V) : ExprAST(Loc), Val(V){}
+		llvm::Value *codegen(EngineImpl &E) override;
+		void collectCalls(std::map<std::string, double> &Calls, double Expected) const override {}
+		void profile(llvm::FoldingSetNodeID &ID, const EngineImpl &E) const override;
 };
 
 ///VariableExprAST - Expression class for referencing a variable, like "a"
@@ -220,8 +299,10 @@ class VariableExprAST : public ExprAST
 		std::string Name;
 
 	public:
-		VariableExprAST(const std::string &N) : Name(N){}
-		llvm::Value *codegen() override;
+		VariableExprAST(SourceLocation Loc, const std::string &N) : ExprAST(Loc), Name(N){}
+		llvm::Value *codegen(EngineImpl &E) override;
+		void collectCalls(std::map<std::string, double> &Calls, double Expected) const override {}
+		void profile(llvm::FoldingSetNodeID &ID, const EngineImpl &E) const override;
 };
 
 ///BinaryExprAST - Expression class for a binary operator.
@@ -232,11 +313,14 @@ class BinaryExprAST : public ExprAST
 
 	public:
 		BinaryExprAST(
+								SourceLocation Loc,
 								char Op, 
 								std::unique_ptr<ExprAST> LHS, 
 								std::unique_ptr<ExprAST> RHS) :
-			Op(Op) , LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-		llvm::Value *codegen() override;
+			ExprAST(Loc), Op(Op) , LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+		llvm::Value *codegen(EngineImpl &E) override;
+		void collectCalls(std::map<std::string, double> &Calls, double Expected) const override;
+		void profile(llvm::FoldingSetNodeID &ID, const EngineImpl &E) const override;
 };
 
 ///CallExprAst - Expression class for function calls.
@@ -247,10 +331,13 @@ class CallExprAst : public ExprAST
 
 	public:
 		CallExprAst(
+								SourceLocation Loc,
 								const std::string &Callee, 
 								std::vector<std::unique_ptr<ExprAST>> Args) :
-			Callee(Callee), Args(std::move(Args)){}
-		llvm::Value *codegen() override;
+			ExprAST(Loc), Callee(Callee), Args(std::move(Args)){}
+		llvm::Value *codegen(EngineImpl &E) override;
+		void collectCalls(std::map<std::string, double> &Calls, double Expected) const override;
+		void profile(llvm::FoldingSetNodeID &ID, const EngineImpl &E) const override;
 };
 
 /// IfExprAST - Expresion class for if/than/else.
@@ -259,11 +346,14 @@ class IfExprAST : public ExprAST
 	std::unique_ptr<ExprAST> Cond, Then, Else;
 
 	public:
-	IfExprAST(std::unique_ptr<ExprAST> C, 
+	IfExprAST(SourceLocation Loc,
+						std::unique_ptr<ExprAST> C, 
 						std::unique_ptr<ExprAST> T,
-						std::unique_ptr<ExprAST> E) : Cond(std::move(C)), Then(std::move(T)), Else(std::move(E)) 
+						std::unique_ptr<ExprAST> E) : ExprAST(Loc), Cond(std::move(C)), Then(std::move(T)), Else(std::move(E)) 
 	{}
-	llvm::Value * codegen() override;
+	llvm::Value * codegen(EngineImpl &E) override;
+	void collectCalls(std::map<std::string, double> &Calls, double Expected) const override;
+	void profile(llvm::FoldingSetNodeID &ID, const EngineImpl &E) const override;
 };
 
 ///ForExprAST - Expression class for for/in.
@@ -274,14 +364,17 @@ class ForExprAST : public ExprAST
 
 	public:
 	ForExprAST(
+						SourceLocation Loc,
 						const std::string &V, 
 						std::unique_ptr<ExprAST> Start,
 						std::unique_ptr<ExprAST> End,
 						std::unique_ptr<ExprAST> Step,
 						std::unique_ptr<ExprAST> Body
-						): VarName(V) , Start(std::move(Start)) ,End(std::move(End)) , Step(std::move(Step)) , Body(std::move(Body))
+						): ExprAST(Loc), VarName(V) , Start(std::move(Start)) ,End(std::move(End)) , Step(std::move(Step)) , Body(std::move(Body))
 	{}
-	llvm::Value * codegen() override;
+	llvm::Value * codegen(EngineImpl &E) override;
+	void collectCalls(std::map<std::string, double> &Calls, double Expected) const override;
+	void profile(llvm::FoldingSetNodeID &ID, const EngineImpl &E) const override;
 };
 
 ///PrototypeAST - This class represents the "prototype" for a function,
@@ -290,15 +383,23 @@ class PrototypeAST
 {
 		std::string Name;
 		std::vector<std::string> Args;
+		int Line;
 
 	public:
-		PrototypeAST(const std::string &Name, std::vector<std::string> Args):
-			Name(Name), Args(std::move(Args)){}
+		PrototypeAST(SourceLocation Loc, const std::string &Name, std::vector<std::string> Args):
+			Name(Name), Args(std::move(Args)), Line(Loc.Line){}
 
 		const std::string &getName() const {
 			return Name;
 		}
-		llvm::Function *codegen();
+		const std::vector<std::string> &getArgs() const {
+			return Args;
+		}
+		int getLine() const { return Line; }
+		/// codegen - Declare the function under the JIT's name for its latest
+		/// version, or under Symbol.
+		llvm::Function *codegen(EngineImpl &E);
+		llvm::Function *codegen(EngineImpl &E, const std::string &Symbol);
 };
 
 /// FunctionAst - This class represents a functions a function definition ifself.
@@ -312,46 +413,137 @@ class FunctionAST
 								std::unique_ptr<ExprAST> Body):
 			Proto(std::move(Proto)), Body(std::move(Body))
 		{ }
-		llvm::Function *codegen();
+		llvm::Function *codegen(EngineImpl &E);
+		/// codegenSpecialization - After codegen() of Generic, emit a copy named
+		/// Name that takes the same arguments but uses Consts[i] in place of
+		/// argument i.
+		llvm::Function *codegenSpecialization(EngineImpl &E, const std::string &Generic, const std::string &Name,
+		                                      const std::map<unsigned, double> &Consts);
+		/// getName - Only valid until codegen() hands the prototype to FunctionProtos.
+		const std::string &getName() const {
+			return Proto->getName();
+		}
+		/// collectCalls - Expected calls to each callee per call of this function.
+		void collectCalls(std::map<std::string, double> &Calls) const {
+			Body->collectCalls(Calls, 1.0);
+		}
+		/// profile - The body's structure; see ExprAST::profile.
+		void profile(llvm::FoldingSetNodeID &ID, const EngineImpl &E) const {
+			Body->profile(ID, E);
+		}
+
+	private:
+		llvm::Function *emitBody(EngineImpl &E, llvm::Function *TheFunction, const PrototypeAST &P,
+		                         const std::map<unsigned, double> &Consts);
 };
 
-/// CurTok/getNextToken - Provide a simple token buffer. CurTok is the current
-/// token the parser is looking at. getNextToken reads another token from the lexer and updates CurTok with its results.
-static int CurTok = ';';
-static int getNextToken()
+using TelemetryScope = llvm::orc::CompileTelemetry::Scope;
+using Phase = llvm::orc::CompileTelemetry::Phase;
+
+/// Diagnostics - Where parse and codegen errors go. The REPL prints them as
+/// they happen; KaleidoscopeEngine::compile() and evaluate() return Text.
+struct Diagnostics
 {
-	return CurTok = gettok();
-}
+	bool Echo = false;
+	std::string Text;
 
-///LogError * - These are little helper functions for error handing.
-std::unique_ptr<ExprAST> LogError(const char * Str)
+	void report(const char *Str)
+	{
+		if(Echo)
+			fprintf(stderr, "Error:%s\n", Str);
+		Text += Str;
+		Text += '\n';
+	}
+	void report(llvm::Error Err)
+	{
+		report(llvm::toString(std::move(Err)).c_str());
+	}
+};
+
+/// Parser - A recursive descent parser over one Lexer's tokens.
+class Parser
 {
-	fprintf(stderr, "Error:%s\n", Str);
-	return nullptr;
+	public:
+		/// Telemetry, when non-null, is charged the time spent lexing.
+		Parser(Lexer &Lex, Diagnostics &Diags, llvm::orc::CompileTelemetry *Telemetry)
+			: Lex(Lex), Diags(Diags), Telemetry(Telemetry)
+		{
+			// Install standard binary operators.
+			// 1 is lowest precedence.
+			BinopPrecedence['<'] = 10;
+			BinopPrecedence['>'] = 10;
+			BinopPrecedence['+'] = 20;
+			BinopPrecedence['-'] = 20;
+			BinopPrecedence['/'] = 40;
+			BinopPrecedence['*'] = 40; //highest
+		}
+
+		/// CurTok/getNextToken - Provide a simple token buffer. CurTok is the current
+		/// token the parser is looking at. getNextToken reads another token from the lexer and updates CurTok with its results.
+		int CurTok = ';';
+		int getNextToken();
+
+		std::unique_ptr<FunctionAST> ParseDefinition();
+		std::unique_ptr<PrototypeAST> ParseExtern(std::string &Library);
+		std::unique_ptr<FunctionAST> ParseTopLevelExpr(const std::string &EntryName);
+		std::string ParseImport();
+
+	private:
+		std::unique_ptr<ExprAST> LogError(const char * Str);
+		std::unique_ptr<PrototypeAST> LogErrorP(const char * Str);
+
+		std::unique_ptr<ExprAST> ParseNumberExpr();
+		std::unique_ptr<ExprAST> ParseParenExpr();
+		std::unique_ptr<ExprAST> ParseIdentifierExpr();
+		std::unique_ptr<ExprAST> ParseIfExpr();
+		std::unique_ptr<ExprAST> ParseForExpr();
+		std::unique_ptr<ExprAST> ParsePrimary();
+		int GetTokPrecedence();
+		std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<ExprAST> LHS);
+		std::unique_ptr<ExprAST> ParseExpression();
+		std::unique_ptr<PrototypeAST> ParsePrototype();
+
+		Lexer &Lex;
+		Diagnostics &Diags;
+		llvm::orc::CompileTelemetry *Telemetry;
+		/// BinopPrecedence - This holds the precedence for each binary operator that is defined.
+		std::map<char, int> BinopPrecedence;
+};
+
+int Parser::getNextToken()
+{
+	if(!Telemetry)
+		return CurTok = Lex.gettok();
+
+	auto Start = llvm::orc::CompileTelemetry::Clock::now();
+	CurTok = Lex.gettok();
+	auto End = llvm::orc::CompileTelemetry::Clock::now();
+	Telemetry->addLexTime(std::chrono::duration<double, std::micro>(End - Start).count());
+	return CurTok;
 }
-std::unique_ptr<PrototypeAST> LogErrorP(const char * Str)
+
+///LogError * - These are little helper functions for error handing.
+std::unique_ptr<ExprAST> Parser::LogError(const char * Str)
 {
-	LogError(Str);
+	Diags.report(Str);
 	return nullptr;
 }
-
-llvm::Value *LogErrorV(const char * Str)
+std::unique_ptr<PrototypeAST> Parser::LogErrorP(const char * Str)
 {
 	LogError(Str);
 	return nullptr;
 }
 
 /// numberexpr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr()
+std::unique_ptr<ExprAST> Parser::ParseNumberExpr()
 {
-	auto Result = std::make_unique<NumberExprAST>(NumVal);
+	auto Result = std::make_unique<NumberExprAST>(Lex.CurLoc, Lex.NumVal);
 	getNextToken();
 	return std::move(Result);
 }
 
-static std::unique_ptr<ExprAST> ParseExpression();
 /// pareexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr()
+std::unique_ptr<ExprAST> Parser::ParseParenExpr()
 {
 	getNextToken(); // eat (
 	auto V = ParseExpression();
@@ -369,13 +561,14 @@ static std::unique_ptr<ExprAST> ParseParenExpr()
 /// identifierexpr
 /// ::= identifier
 /// ::= identifier '(' expression ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr()
+std::unique_ptr<ExprAST> Parser::ParseIdentifierExpr()
 {
-	std::string IdName = IdentifierStr;
+	std::string IdName = Lex.IdentifierStr;
+	SourceLocation LitLoc = Lex.CurLoc;
 	getNextToken(); // eat identifier
 									
 	if(CurTok != '(')
-		return std::make_unique<VariableExprAST>(IdName);
+		return std::make_unique<VariableExprAST>(LitLoc, IdName);
 
 	//Call
 	getNextToken(); //eat (
@@ -401,12 +594,13 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr()
 	//Eat the ')'
 	getNextToken();
 
-	return std::make_unique<CallExprAst>(IdName, std::move(Args));
+	return std::make_unique<CallExprAst>(LitLoc, IdName, std::move(Args));
 }
 
 ///ifexpr::= 'if' expression 'then' expression 'else' expression
-static std::unique_ptr<ExprAST> ParseIfExpr()
+std::unique_ptr<ExprAST> Parser::ParseIfExpr()
 {
+	SourceLocation IfLoc = Lex.CurLoc;
 	getNextToken();
 
 	//condition
@@ -430,18 +624,19 @@ static std::unique_ptr<ExprAST> ParseIfExpr()
 	if(!Else)
 		return nullptr;
 
-	return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then), std::move(Else));
+	return std::make_unique<IfExprAST>(IfLoc, std::move(Cond), std::move(Then), std::move(Else));
 }
 
 ///forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
-static std::unique_ptr<ExprAST> ParseForExpr()
+std::unique_ptr<ExprAST> Parser::ParseForExpr()
 {
+	SourceLocation ForLoc = Lex.CurLoc;
 	getNextToken(); //eat the for.
 									//
 	if(CurTok != tok_identifier)
 		return LogError("expected identifier after for");
 
-	std::string IdName = IdentifierStr;
+	std::string IdName = Lex.IdentifierStr;
 	getNextToken(); //eat identifier
 	
 	if(CurTok != '=')
@@ -477,7 +672,7 @@ static std::unique_ptr<ExprAST> ParseForExpr()
 	if(!Body)
 		return nullptr;
 
-	return std::make_unique<ForExprAST>(IdName, 
+	return std::make_unique<ForExprAST>(ForLoc, IdName, 
 																			std::move(Start), 
 																			std::move(End), 
 																			std::move(Step), 
@@ -489,7 +684,7 @@ static std::unique_ptr<ExprAST> ParseForExpr()
 /// ::= numberexpr
 /// ::= parenexpr
 /// ::= ifexpr
-static std::unique_ptr<ExprAST> ParsePrimary()
+std::unique_ptr<ExprAST> Parser::ParsePrimary()
 {
 	switch(CurTok)
 	{
@@ -508,10 +703,8 @@ static std::unique_ptr<ExprAST> ParsePrimary()
 	}
 }
 
-/// BinopPrecedence - This holds the precedence for each binary operator that is defined.
-static std::map<char, int> BinopPrecedence;
 /// GetTokPrecedence - Get the precedence of the pending binary operator token.
-static int GetTokPrecedence()
+int Parser::GetTokPrecedence()
 {
 	if(!isascii(CurTok))
 		return -1;
@@ -525,8 +718,8 @@ static int GetTokPrecedence()
 
 ///binoprhs
 // ::= ('+' primary)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-																							std::unique_ptr<ExprAST> LHS)
+std::unique_ptr<ExprAST> Parser::ParseBinOpRHS(int ExprPrec,
+																											std::unique_ptr<ExprAST> LHS)
 {
 	//if this is a binop, find its precedence
 	while(true)
@@ -538,6 +731,7 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
 		
 		// Okay, we know this is a binop.
 		int BinOp = CurTok;
+		SourceLocation BinLoc = Lex.CurLoc;
 		getNextToken(); //eat binop
 
 		//Parse the primary expression after the binary operator.
@@ -556,13 +750,13 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
 		}
 
 		//Merge LHS/RHS.
-		LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+		LHS = std::make_unique<BinaryExprAST>(BinLoc, BinOp, std::move(LHS), std::move(RHS));
 	}//loop around to the top of the while loop.
 }
 
 /// expression
 /// ::= primary binoprhs
-static std::unique_ptr<ExprAST> ParseExpression()
+std::unique_ptr<ExprAST> Parser::ParseExpression()
 {
 	auto LHS = ParsePrimary();
 	if(!LHS)
@@ -572,12 +766,13 @@ static std::unique_ptr<ExprAST> ParseExpression()
 
 /// Prototype
 //::= id '(' id* ')'
-static std::unique_ptr<PrototypeAST> ParsePrototype()
+std::unique_ptr<PrototypeAST> Parser::ParsePrototype()
 {
 	if(CurTok != tok_identifier)
 		return LogErrorP("Expected function name in prototype");
 
-	std::string FnName = IdentifierStr;
+	std::string FnName = Lex.IdentifierStr;
+	SourceLocation FnLoc = Lex.CurLoc;
 	getNextToken();
 
 	if(CurTok != '(')
@@ -586,18 +781,18 @@ static std::unique_ptr<PrototypeAST> ParsePrototype()
 	//Read the list of argument names.
 	std::vector<std::string> ArgNames;
 	while(getNextToken() == tok_identifier)
-		ArgNames.push_back(IdentifierStr);
+		ArgNames.push_back(Lex.IdentifierStr);
 	if(CurTok != ')')
 		return LogErrorP("Expected ')' in prototype");
 
 	//sucesss.
 	getNextToken(); //eat )
 	
-	return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
+	return std::make_unique<PrototypeAST>(FnLoc, FnName, std::move(ArgNames));
 }
 
 //define ::= 'def' prototype expression
-static std::unique_ptr<FunctionAST> ParseDefinition()
+std::unique_ptr<FunctionAST> Parser::ParseDefinition()
 {
 	getNextToken(); //eat def
 	auto Proto = ParsePrototype();
@@ -610,114 +805,536 @@ static std::unique_ptr<FunctionAST> ParseDefinition()
 	return nullptr;
 }
 
-static std::unique_ptr<PrototypeAST> ParseExtern()
+//external ::= 'extern' string? prototype
+//Library is set to the quoted shared library, if any, the symbol comes from.
+std::unique_ptr<PrototypeAST> Parser::ParseExtern(std::string &Library)
 {
 	getNextToken(); //eat extern
+	Library.clear();
+	if(CurTok == tok_string)
+	{
+		Library = Lex.StringVal;
+		getNextToken(); //eat the library
+	}
 	return ParsePrototype();
 }
 
+//import ::= 'import' string
+//Returns the library name, or an empty string after reporting an error.
+std::string Parser::ParseImport()
+{
+	getNextToken(); //eat import
+	if(CurTok != tok_string || Lex.StringVal.empty())
+	{
+		LogError("Expected a library name in quotes after import");
+		return "";
+	}
+	std::string Name = Lex.StringVal;
+	getNextToken(); //eat the name
+	return Name;
+}
+
 //toplevelexpr ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr()
+//EntryName is the unique symbol the expression is compiled under.
+std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr(const std::string &EntryName)
 {
+	SourceLocation FnLoc = Lex.CurLoc;
 	if(auto E = ParseExpression())
 	{
 		//Make an anonymous proto
-		auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
+		auto Proto = std::make_unique<PrototypeAST>(FnLoc, EntryName, std::vector<std::string>());
 		return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
 	}
 	return nullptr;
 }
 /********************************************************* codegen **************************************************************/
-static std::unique_ptr<llvm::LLVMContext> TheContext;
-static std::unique_ptr<llvm::IRBuilder<>> Builder;
-static std::unique_ptr<llvm::Module> TheModule;
-static std::map<std::string, llvm::Value *> NamedValues;
+using SiteKind = llvm::orc::ProfileCounters::SiteKind;
+
+/// DebugInfo - DWARF state for the module being built. DBuilder is only
+/// non-null with debug info enabled, and every helper is a no-op without it.
+struct DebugInfo
+{
+	llvm::DIBuilder *DBuilder = nullptr;
+	llvm::IRBuilder<> *Builder = nullptr;
+	llvm::DICompileUnit *TheCU = nullptr;
+	llvm::DIType *DblTy = nullptr;
+	std::vector<llvm::DIScope *> LexicalBlocks;
+
+	void emitLocation(ExprAST *AST);
+	llvm::DIType *getDoubleTy();
+};
+
+llvm::DIType *DebugInfo::getDoubleTy()
+{
+	if(DblTy)
+		return DblTy;
+	DblTy = DBuilder->createBasicType("double", 64, llvm::dwarf::DW_ATE_float);
+	return DblTy;
+}
+
+/// emitLocation - Attach AST's position to the instructions built next, or
+/// clear the location (for prologue code) when AST is null.
+void DebugInfo::emitLocation(ExprAST *AST)
+{
+	if(!DBuilder)
+		return;
+	if(!AST)
+		return Builder->SetCurrentDebugLocation(llvm::DebugLoc());
+	llvm::DIScope *Scope = LexicalBlocks.empty() ? TheCU : LexicalBlocks.back();
+	Builder->SetCurrentDebugLocation(
+			llvm::DILocation::get(Scope->getContext(), AST->getLine(), AST->getCol(), Scope));
+}
+
+/// ProfileSite - One site of the function being built: the counter to bump
+/// (when counting) and what an earlier run counted there (with -profile-in).
+struct ProfileSite
+{
+	llvm::orc::ProfileCounters::Counter *Counter = nullptr;
+	bool HasCount = false;
+	uint64_t Count = 0;
+};
+
+/// Specialization - A clone of a function with some arguments folded to
+/// constants. Calls compiled after it exists test those arguments and take
+/// the clone when all of them match.
+struct Specialization
+{
+	std::string Name;
+	std::map<unsigned, double> Consts;
+};
+
+/// KaleidoscopeEngine::Impl - Everything one engine compiles with: the module
+/// under construction and its pass managers, what has been defined so far,
+/// and the JIT it all ends up in. Nothing here is shared with other engines.
+class llvm::orc::KaleidoscopeEngine::Impl
+{
+	public:
+		explicit Impl(Options Opts) : Opts(std::move(Opts)),
+			TheTelemetry(this->Opts.Telemetry), TheProfile(this->Opts.Profile),
+			TheProfileData(this->Opts.ProfileIn), ThePassStats(this->Opts.PassStats)
+		{
+			Diags.Echo = this->Opts.Echo;
+		}
+
+		~Impl();
+
+		llvm::Error initialize();
+
+		llvm::Value *LogErrorV(const char * Str);
+		ProfileSite AddProfileSite(SiteKind Kind, unsigned Line);
+		void EmitCounterIncrement(const ProfileSite &S);
+		void EmitArgValueRecording(llvm::Function *TheFunction);
+		void SetBranchWeights(llvm::Instruction *Br, const ProfileSite &True, const ProfileSite &False);
+		llvm::DISubroutineType *CreateFunctionType(unsigned NumArgs);
+		llvm::Function *getFunction(std::string Name);
+		std::map<std::string, double> LikelyCallees(const std::map<std::string, double> &Direct);
+
+		llvm::Error InitializeModule();
+		void OptimizeModule();
+		llvm::Error LinkRuntime();
+		void FlushRemarks();
+		llvm::Error FinishModule(llvm::orc::ResourceTrackerSP RT = nullptr);
+		void BeginItem(const char *Kind);
+		void RecordIR(llvm::Function *IR);
+		void HandleDefinition(Parser &P);
+		void CompileDefinition(std::unique_ptr<FunctionAST> AST);
+		void HandleExtern(Parser &P);
+		void CompileExtern(std::unique_ptr<PrototypeAST> AST, const std::string &Library);
+		void HandleImport(Parser &P);
+		void ImportLibrary(const std::string &Name);
+		llvm::Expected<std::string> FindLibrary(const std::string &Name) const;
+		llvm::Error LinkIntoLibrary();
+		void WriteLibraryExports();
+		llvm::Optional<double> HandleTopLevelExpression(Parser &P);
+		std::string HandleBatchExpression(Parser &P);
+		void SpecializeStableFunctions();
+		void Mainloop(Parser &P, llvm::function_ref<void()> OnPrompt,
+		              std::vector<double> *Results = nullptr);
+
+		struct ParsedItem;
+		struct PendingExpression;
+		bool CompileExpression(ParsedItem &Item, PendingExpression &Pending);
+		void PipelinedLoop(Lexer &Lex);
+
+		Options Opts;
+		Diagnostics Diags;
+
+		/// TheJIT is OwnedJIT, or the prelude's when sharing one; TheJD is where
+		/// this engine's code goes.
+		std::unique_ptr<llvm::orc::KaleidoscopeJIT> OwnedJIT;
+		llvm::orc::KaleidoscopeJIT *TheJIT = nullptr;
+		llvm::orc::JITDylib *TheJD = nullptr;
+		/// TheTM - Target cost models for the -O2/-O3 module pipeline.
+		std::unique_ptr<llvm::TargetMachine> TheTM;
+
+		std::unique_ptr<llvm::LLVMContext> TheContext;
+		std::unique_ptr<llvm::IRBuilder<>> Builder;
+		std::unique_ptr<llvm::Module> TheModule;
+		std::map<std::string, llvm::Value *> NamedValues;
+		std::unique_ptr<llvm::FunctionPassManager> TheFPM;
+		std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
+		std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
+		std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
+		std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
+		std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
+		std::unique_ptr<llvm::DIBuilder> DBuilder;
+		DebugInfo KSDbgInfo;
+
+		/// ModuleRemarks - Remarks of the module under construction. Each module has
+		/// its own context, so each gets its own streamer; FlushRemarks() detaches it
+		/// once the IR passes are done and appends what it wrote to RemarksOS.
+		llvm::SmallString<0> ModuleRemarks;
+		std::unique_ptr<llvm::raw_svector_ostream> ModuleRemarksOS;
+		std::unique_ptr<llvm::raw_fd_ostream> RemarksOS;
+		unsigned NumRemarkModules = 0;
+
+		/// Borrowed from Opts; each is null when not in use, in which case
+		/// nothing is timed, counted or annotated.
+		llvm::orc::CompileTelemetry *TheTelemetry;
+		llvm::orc::ProfileCounters *TheProfile;
+		const llvm::orc::ProfileData *TheProfileData;
+		llvm::orc::PassStatistics *ThePassStats;
+		/// TheArgProfile - Argument value history; null unless Opts.Specialize.
+		std::unique_ptr<llvm::orc::ArgValueProfile> TheArgProfile;
+
+		/// NextSiteOrdinal - Position of the next site within the function being
+		/// built, which is how a site is found again in a later run.
+		unsigned NextSiteOrdinal = 0;
+
+		std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+		std::map<std::string, Specialization> Specializations;
+		/// FunctionDefs - Definitions kept for specialization (Opts.Specialize only).
+		std::map<std::string, std::unique_ptr<FunctionAST>> FunctionDefs;
+		/// CallGraph - Expected calls from each defined function to its callees.
+		std::map<std::string, std::map<std::string, double>> CallGraph;
+		/// CallHistory - How many executed top-level expressions have reached each function.
+		std::map<std::string, unsigned> CallHistory;
+		/// PureFunctions - Functions whose calls have no effect but their value:
+		/// side-effect-free libm externs, and definitions that only call pure
+		/// functions (or themselves).
+		std::set<std::string> PureFunctions;
+		bool IsPure(const FunctionAST &AST, llvm::StringRef Name) const;
+
+		/// RuntimeFunctions - What Opts.RuntimeBitcode defines, to be linked into
+		/// modules calling them unless the program defines the name itself or
+		/// took it from a named library (ForeignExterns).
+		std::set<std::string> RuntimeFunctions;
+		std::set<std::string> ForeignExterns;
+
+		/// DefinitionVersions - How many times each function has been defined.
+		/// Version n > 1 goes by "name.n" in the JIT so a redefinition never
+		/// clashes with code already there. Calls go through the stub
+		/// "name.stub", which each definition repoints, so code compiled
+		/// before a redefinition calls the new version too.
+		std::map<std::string, unsigned> DefinitionVersions;
+		unsigned getVersion(const std::string &Name) const;
+		std::string getSymbolName(const std::string &Name) const;
+		/// SharedDefinitions - Functions from the prelude or an imported library.
+		/// Their stubs live in a dylib other engines or libraries link against,
+		/// so they cannot be redefined here.
+		std::set<std::string> SharedDefinitions;
+		/// SpecializationStubs - Functions ever specialized. Calls that take the
+		/// clone go through "name.spec.stub", which a redefinition points back
+		/// at the new generic version.
+		std::set<std::string> SpecializationStubs;
+		/// DefinitionCallees - What the latest version of each definition calls.
+		std::map<std::string, std::set<std::string>> DefinitionCallees;
+
+		/// ResultCache - Values of pure top-level expressions (Opts.CacheResults),
+		/// keyed on ExprAST::profile(). Reaches lists every function the
+		/// expression may end up calling, so redefining one evicts the entry.
+		struct CachedResult
+		{
+			double Value;
+			std::set<std::string> Reaches;
+		};
+		struct NodeIDHash
+		{
+			size_t operator()(const llvm::FoldingSetNodeID &ID) const { return ID.ComputeHash(); }
+		};
+		std::unordered_map<llvm::FoldingSetNodeID, CachedResult, NodeIDHash> ResultCache;
+		std::set<std::string> ReachableFunctions(const FunctionAST &AST) const;
+		void InvalidateResults(const std::string &Name);
+
+		/// ImportedLibraries - The dylib each imported library was loaded into.
+		std::map<std::string, llvm::orc::JITDylib *> ImportedLibraries;
+		/// LibraryModule - While compileLibrary() runs, where finished modules
+		/// are linked instead of being handed to the JIT.
+		std::unique_ptr<llvm::LLVMContext> LibraryContext;
+		std::unique_ptr<llvm::Module> LibraryModule;
+
+		/// EntryPoint - Resolved addresses of a function handed out to the host:
+		/// the function itself and, once asked for, its argument-array trampoline.
+		struct EntryPoint
+		{
+			unsigned Arity = 0;
+			llvm::JITTargetAddress Address = 0;
+			llvm::JITTargetAddress Apply = 0;
+		};
+		std::map<std::string, EntryPoint> EntryPoints;
+
+		/// Batch expressions are named batch.<n>, and BatchModuleSize of them go
+		/// into one module so a big batch materializes as a few modules rather
+		/// than one per expression.
+		static const unsigned BatchModuleSize = 256;
+		unsigned NextBatchExpr = 0;
+
+		llvm::Expected<EntryPoint *> getEntryPoint(llvm::StringRef Name);
+		llvm::Error EmitApplyTrampoline(const std::string &Name, EntryPoint &EP);
+};
+
+llvm::Value *EngineImpl::LogErrorV(const char * Str)
+{
+	Diags.report(Str);
+	return nullptr;
+}
+
+/// AddProfileSite - Register the next site of the function being built.
+ProfileSite EngineImpl::AddProfileSite(SiteKind Kind, unsigned Line)
+{
+	ProfileSite S;
+	if(!TheProfile && !TheProfileData)
+		return S;
+	//Top-level expressions share recycled entry names, so they all go by one
+	//name and are told apart by line.
+	llvm::StringRef Name = Builder->GetInsertBlock()->getParent()->getName();
+	if(Name.startswith("__anon_expr") || Name.startswith("batch."))
+		Name = llvm::orc::getExpressionProfileName();
+	unsigned Ordinal = NextSiteOrdinal++;
+	if(TheProfile)
+		S.Counter = TheProfile->addSite(Name, Kind, Line, Ordinal);
+	if(TheProfileData)
+		S.HasCount = TheProfileData->lookup(Name, Line, Ordinal, S.Count);
+	return S;
+}
+
+/// EmitCounterIncrement - Bump S's counter at the insertion point with a
+/// relaxed atomic add.
+void EngineImpl::EmitCounterIncrement(const ProfileSite &S)
+{
+	if(!S.Counter)
+		return;
+	llvm::Type *Int64Ty = llvm::Type::getInt64Ty(*TheContext);
+	llvm::Constant *Addr = llvm::ConstantExpr::getIntToPtr(
+			llvm::ConstantInt::get(Int64Ty, reinterpret_cast<uintptr_t>(S.Counter)),
+			Int64Ty->getPointerTo());
+	Builder->CreateAtomicRMW(llvm::AtomicRMWInst::Add, Addr, llvm::ConstantInt::get(Int64Ty, 1),
+	                         llvm::MaybeAlign(8), llvm::AtomicOrdering::Monotonic);
+}
+
+/// EmitArgValueRecording - Count calls of TheFunction and, on every
+/// ArgValueProfile::SamplePeriod'th, record its arguments into TheArgProfile
+/// inline, with relaxed atomics. Leaves the builder in the block after.
+void EngineImpl::EmitArgValueRecording(llvm::Function *TheFunction)
+{
+	using llvm::orc::ArgValueProfile;
+	llvm::Type *Int64Ty = llvm::Type::getInt64Ty(*TheContext);
+	llvm::Type *DoubleTy = llvm::Type::getDoubleTy(*TheContext);
+	auto Pointer = [&](const void *P, llvm::Type *Ty) {
+		return llvm::ConstantExpr::getIntToPtr(
+				llvm::ConstantInt::get(Int64Ty, reinterpret_cast<uintptr_t>(P)), Ty->getPointerTo());
+	};
+	auto *S = TheArgProfile->addFunction(TheFunction->getName(), TheFunction->arg_size());
+
+	llvm::Value *N = Builder->CreateAtomicRMW(llvm::AtomicRMWInst::Add, Pointer(&S->Calls, Int64Ty),
+	                                          llvm::ConstantInt::get(Int64Ty, 1), llvm::MaybeAlign(8),
+	                                          llvm::AtomicOrdering::Monotonic);
+	llvm::Value *Sampled = Builder->CreateICmpEQ(
+			Builder->CreateAnd(N, ArgValueProfile::SamplePeriod - 1), llvm::ConstantInt::get(Int64Ty, 0));
+	llvm::BasicBlock *RecordBB = llvm::BasicBlock::Create(*TheContext, "argprof", TheFunction);
+	llvm::BasicBlock *BodyBB = llvm::BasicBlock::Create(*TheContext, "argprof.done", TheFunction);
+	Builder->CreateCondBr(Sampled, RecordBB, BodyBB,
+	                      llvm::MDBuilder(*TheContext).createBranchWeights(1, ArgValueProfile::SamplePeriod - 1));
+
+	Builder->SetInsertPoint(RecordBB);
+	for(auto &Arg : TheFunction->args())
+	{
+		auto &Slot = S->Slots[Arg.getArgNo()];
+		llvm::Constant *ValuePtr = Pointer(&Slot.Value, DoubleTy), *RunPtr = Pointer(&Slot.Run, Int64Ty);
+		auto *Last = Builder->CreateAlignedLoad(DoubleTy, ValuePtr, llvm::MaybeAlign(8));
+		auto *Run = Builder->CreateAlignedLoad(Int64Ty, RunPtr, llvm::MaybeAlign(8));
+		Last->setAtomic(llvm::AtomicOrdering::Monotonic);
+		Run->setAtomic(llvm::AtomicOrdering::Monotonic);
+		llvm::Value *Same = Builder->CreateAnd(Builder->CreateFCmpOEQ(Last, &Arg),
+		                                       Builder->CreateICmpNE(Run, llvm::ConstantInt::get(Int64Ty, 0)));
+		llvm::Value *NextRun = Builder->CreateSelect(Same, Builder->CreateAdd(Run, llvm::ConstantInt::get(Int64Ty, 1)),
+		                                             llvm::ConstantInt::get(Int64Ty, 1));
+		Builder->CreateAlignedStore(&Arg, ValuePtr, llvm::MaybeAlign(8))
+				->setAtomic(llvm::AtomicOrdering::Monotonic);
+		Builder->CreateAlignedStore(NextRun, RunPtr, llvm::MaybeAlign(8))
+				->setAtomic(llvm::AtomicOrdering::Monotonic);
+	}
+	Builder->CreateBr(BodyBB);
+	Builder->SetInsertPoint(BodyBB);
+}
+
+/// SetBranchWeights - Give Br the earlier run's counts of its two successors.
+void EngineImpl::SetBranchWeights(llvm::Instruction *Br, const ProfileSite &True, const ProfileSite &False)
+{
+	if(!True.HasCount || !False.HasCount)
+		return;
+	//Weights are 32-bit; scale both counts down by the same factor.
+	unsigned Shift = 0;
+	while((std::max(True.Count, False.Count) >> Shift) > UINT32_MAX)
+		++Shift;
+	Br->setMetadata(llvm::LLVMContext::MD_prof,
+	                llvm::MDBuilder(*TheContext).createBranchWeights(
+	                    uint32_t(True.Count >> Shift), uint32_t(False.Count >> Shift)));
+}
 
-llvm::Value * NumberExprAST::codegen()
+/// CreateFunctionType - The DWARF type of a Kaleidoscope function: NumArgs doubles to double.
+llvm::DISubroutineType *EngineImpl::CreateFunctionType(unsigned NumArgs)
 {
-	return llvm::ConstantFP::get(*TheContext, llvm::APFloat(Val));
+	llvm::SmallVector<llvm::Metadata *, 8> EltTys;
+	llvm::DIType *DblTy = KSDbgInfo.getDoubleTy();
+
+	//Add the result type.
+	EltTys.push_back(DblTy);
+	for(unsigned i = 0, e = NumArgs; i != e; ++i)
+		EltTys.push_back(DblTy);
+
+	return DBuilder->createSubroutineType(DBuilder->getOrCreateTypeArray(EltTys));
+}
+
+llvm::Value * NumberExprAST::codegen(EngineImpl &E)
+{
+	E.KSDbgInfo.emitLocation(this);
+	return llvm::ConstantFP::get(*E.TheContext, llvm::APFloat(Val));
 }
 
-llvm::Value *VariableExprAST::codegen()
+llvm::Value *VariableExprAST::codegen(EngineImpl &E)
 {
-	llvm::Value * V = NamedValues[Name];
+	E.KSDbgInfo.emitLocation(this);
+	llvm::Value * V = E.NamedValues[Name];
 	if(!V)
-		LogErrorV("Unknow variable name");
+		E.LogErrorV("Unknow variable name");
 	return V;
 }
 
-llvm::Value *BinaryExprAST::codegen()
+llvm::Value *BinaryExprAST::codegen(EngineImpl &E)
 {
-	llvm::Value *L = LHS->codegen();
-	llvm::Value *R = RHS->codegen();
+	llvm::Value *L = LHS->codegen(E);
+	llvm::Value *R = RHS->codegen(E);
 	if(!L || !R)
 		return nullptr;
 
+	E.KSDbgInfo.emitLocation(this);
 	switch(Op)
 	{
 		case '+':
-			return Builder->CreateFAdd(L, R, "addtmp");
+			return E.Builder->CreateFAdd(L, R, "addtmp");
 		case '-':
-			return Builder->CreateFSub(L, R, "subtmp");
+			return E.Builder->CreateFSub(L, R, "subtmp");
 		case '*':
-			return Builder->CreateFMul(L, R, "multmp");
+			return E.Builder->CreateFMul(L, R, "multmp");
+		case '/':
+			return E.Builder->CreateFDiv(L, R, "divtmp");
 		case '<':
-			L = Builder->CreateFCmpULT(L, R, "cmptmp");
+			L = E.Builder->CreateFCmpULT(L, R, "cmptmp");
 			//Convert bool 0/1 to double 0.0 or 1.0
-			return Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*TheContext), "booltmp");
+			return E.Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*E.TheContext), "booltmp");
+		case '>':
+			L = E.Builder->CreateFCmpUGT(L, R, "cmptmp");
+			return E.Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*E.TheContext), "booltmp");
 		default:
-			return LogErrorV("invalid binary operator");
+			return E.LogErrorV("invalid binary operator");
 	}
 }
 
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
-
-llvm::Function *getFunction(std::string Name) {
+llvm::Function *EngineImpl::getFunction(std::string Name) {
   // First, see if the function has already been added to the current module.
-  if (auto *F = TheModule->getFunction(Name))
+  // Only the definition being compiled is, so it calls itself directly; other
+  // definitions are called through their stubs.
+  std::string Symbol = getSymbolName(Name);
+  if (auto *F = TheModule->getFunction(Symbol))
+    return F;
+  if (getVersion(Name))
+    Symbol = Name + ".stub";
+  if (auto *F = TheModule->getFunction(Symbol))
     return F;
 
   // If not, check whether we can codegen the declaration from some existing
   // prototype.
   auto FI = FunctionProtos.find(Name);
   if (FI != FunctionProtos.end())
-    return FI->second->codegen();
+    return FI->second->codegen(*this, Symbol);
 
   // If no existing prototype exists, return null.
   return nullptr;
 }
 
-llvm::Value * CallExprAst::codegen()
+llvm::Value * CallExprAst::codegen(EngineImpl &E)
 {
 	//Look up the name in the golbal module table.
-	//llvm::Function *CalleeF = TheModule->getFunction(Callee);
-	llvm::Function *CalleeF = getFunction(Callee);
+	//llvm::Function *CalleeF = E.TheModule->getFunction(Callee);
+	llvm::Function *CalleeF = E.getFunction(Callee);
 	if(!CalleeF)
-		return LogErrorV("Unknow function referenced");
+		return E.LogErrorV("Unknow function referenced");
 
 	//If argument mismatch error.
 	if(CalleeF->arg_size() != Args.size())
-		return LogErrorV("Incorrect #arguments passed");
+		return E.LogErrorV("Incorrect #arguments passed");
 
 	std::vector<llvm::Value *> ArgsV;
 	for(unsigned i = 0, e = Args.size(); i !=e; ++i)
 	{
-		ArgsV.push_back(Args[i]->codegen());
+		ArgsV.push_back(Args[i]->codegen(E));
 		if(!ArgsV.back())
 			return nullptr;
 	}
 
-	return Builder->CreateCall(CalleeF, ArgsV, "Calltmp");
+	E.KSDbgInfo.emitLocation(this);
+	auto SI = E.Specializations.find(Callee);
+	if(SI == E.Specializations.end())
+		return E.Builder->CreateCall(CalleeF, ArgsV, "Calltmp");
+
+	//Guard on the folded arguments' bits, so -0.0 and NaN never take the clone
+	//by accident. Constant arguments fold the guard away.
+	llvm::Type *Int64Ty = llvm::Type::getInt64Ty(*E.TheContext);
+	llvm::Value *Guard = nullptr;
+	for(auto &C : SI->second.Consts)
+	{
+		llvm::Value *Eq = E.Builder->CreateICmpEQ(
+				E.Builder->CreateBitCast(ArgsV[C.first], Int64Ty),
+				llvm::ConstantInt::get(Int64Ty, llvm::APFloat(C.second).bitcastToAPInt()), "spec.guard");
+		Guard = Guard ? E.Builder->CreateAnd(Guard, Eq) : Eq;
+	}
+
+	llvm::Function *TheFunction = E.Builder->GetInsertBlock()->getParent();
+	llvm::BasicBlock *SpecBB = llvm::BasicBlock::Create(*E.TheContext, "spec.call", TheFunction);
+	llvm::BasicBlock *GenericBB = llvm::BasicBlock::Create(*E.TheContext, "generic.call", TheFunction);
+	llvm::BasicBlock *MergeBB = llvm::BasicBlock::Create(*E.TheContext, "spec.cont", TheFunction);
+	E.Builder->CreateCondBr(Guard, SpecBB, GenericBB);
+
+	E.Builder->SetInsertPoint(SpecBB);
+	llvm::FunctionCallee SpecF = E.TheModule->getOrInsertFunction(Callee + ".spec.stub", CalleeF->getFunctionType());
+	llvm::Value *SpecV = E.Builder->CreateCall(SpecF, ArgsV, "Calltmp");
+	E.Builder->CreateBr(MergeBB);
+
+	E.Builder->SetInsertPoint(GenericBB);
+	llvm::Value *GenericV = E.Builder->CreateCall(CalleeF, ArgsV, "Calltmp");
+	E.Builder->CreateBr(MergeBB);
+
+	E.Builder->SetInsertPoint(MergeBB);
+	llvm::PHINode *PN = E.Builder->CreatePHI(llvm::Type::getDoubleTy(*E.TheContext), 2, "calltmp");
+	PN->addIncoming(SpecV, SpecBB);
+	PN->addIncoming(GenericV, GenericBB);
+	return PN;
+}
+
+llvm::Function *PrototypeAST::codegen(EngineImpl &E)
+{
+	return codegen(E, E.getSymbolName(Name));
 }
 
-llvm::Function *PrototypeAST::codegen()
+llvm::Function *PrototypeAST::codegen(EngineImpl &E, const std::string &Symbol)
 {
 	//Make the function type: double(double,double) etc.
-	std::vector<llvm::Type*> Doubles(Args.size(), llvm::Type::getDoubleTy(*TheContext));
+	std::vector<llvm::Type*> Doubles(Args.size(), llvm::Type::getDoubleTy(*E.TheContext));
 
-	llvm::FunctionType *FT = llvm::FunctionType::get(llvm::Type::getDoubleTy(*TheContext), Doubles, false);
+	llvm::FunctionType *FT = llvm::FunctionType::get(llvm::Type::getDoubleTy(*E.TheContext), Doubles, false);
 
-	llvm::Function *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, Name, TheModule.get());
+	llvm::Function *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, Symbol, E.TheModule.get());
 
 	//Set names for all arguments.
 	unsigned Idx = 0;
@@ -727,179 +1344,280 @@ llvm::Function *PrototypeAST::codegen()
 	return F;
 }
 
-llvm::Value *IfExprAST::codegen()
+llvm::Value *IfExprAST::codegen(EngineImpl &E)
 {
-	llvm::Value * CondV = Cond->codegen();
+	llvm::Value * CondV = Cond->codegen(E);
 	if(!CondV)
 		return nullptr;
 
+	E.KSDbgInfo.emitLocation(this);
 	//Convert condition to a bool by comparing non-equal to 0.0
-	CondV = Builder->CreateFCmpONE(CondV, llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0)), "ifcond");
+	CondV = E.Builder->CreateFCmpONE(CondV, llvm::ConstantFP::get(*E.TheContext, llvm::APFloat(0.0)), "ifcond");
 
-	llvm::Function *TheFunction = Builder->GetInsertBlock()->getParent();
+	llvm::Function *TheFunction = E.Builder->GetInsertBlock()->getParent();
 
 	//Create blocks for the then and else cases. Insert the 'then' block at the
 	//end of the funcion
 
-	llvm::BasicBlock *ThenBB = llvm::BasicBlock::Create(*TheContext, "then", TheFunction);
-	llvm::BasicBlock *ElseBB = llvm::BasicBlock::Create(*TheContext, "Else");
-	llvm::BasicBlock *MergeBB = llvm::BasicBlock::Create(*TheContext, "ifcont");
+	llvm::BasicBlock *ThenBB = llvm::BasicBlock::Create(*E.TheContext, "then", TheFunction);
+	llvm::BasicBlock *ElseBB = llvm::BasicBlock::Create(*E.TheContext, "Else");
+	llvm::BasicBlock *MergeBB = llvm::BasicBlock::Create(*E.TheContext, "ifcont");
 
-	Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+	ProfileSite ThenSite = E.AddProfileSite(SiteKind::IfThen, getLine());
+	ProfileSite ElseSite = E.AddProfileSite(SiteKind::IfElse, getLine());
+	E.SetBranchWeights(E.Builder->CreateCondBr(CondV, ThenBB, ElseBB), ThenSite, ElseSite);
 
 	//Emit then value.
-	Builder->SetInsertPoint(ThenBB);
+	E.Builder->SetInsertPoint(ThenBB);
+	E.EmitCounterIncrement(ThenSite);
 
-	llvm::Value *ThenV = Then->codegen();
+	llvm::Value *ThenV = Then->codegen(E);
 	if(!ThenV)
 		return nullptr;
 
-	Builder->CreateBr(MergeBB);
+	E.Builder->CreateBr(MergeBB);
 	//Codegen of 'Then' can change the current block, update ThenBB for the PHI.
-	ThenBB = Builder->GetInsertBlock();
+	ThenBB = E.Builder->GetInsertBlock();
 
 	//Emit else block.
 	TheFunction->getBasicBlockList().push_back(ElseBB);
-	Builder->SetInsertPoint(ElseBB);                                                         
-	llvm::Value * ElseV = Else->codegen();
+	E.Builder->SetInsertPoint(ElseBB);                                                         
+	E.EmitCounterIncrement(ElseSite);
+	llvm::Value * ElseV = Else->codegen(E);
 	if(!ElseV)
 		return nullptr;
-	Builder->CreateBr(MergeBB);
-	ElseBB = Builder->GetInsertBlock();
+	E.Builder->CreateBr(MergeBB);
+	ElseBB = E.Builder->GetInsertBlock();
 
 	//Emit merge block.
 	TheFunction->getBasicBlockList().push_back(MergeBB);
-	Builder->SetInsertPoint(MergeBB);
-	llvm::PHINode * PN = Builder->CreatePHI(llvm::Type::getDoubleTy(*TheContext), 2, "iftmp");
+	E.Builder->SetInsertPoint(MergeBB);
+	llvm::PHINode * PN = E.Builder->CreatePHI(llvm::Type::getDoubleTy(*E.TheContext), 2, "iftmp");
 	PN->addIncoming(ThenV, ThenBB);
 	PN->addIncoming(ElseV, ElseBB);
 
 	return PN;
 }
 
-llvm::Value *ForExprAST::codegen()
+llvm::Value *ForExprAST::codegen(EngineImpl &E)
 {
 	//Emit the start code first, without 'variable' in scope.
-	llvm::Value *StartVal = Start->codegen();
+	llvm::Value *StartVal = Start->codegen(E);
 	if(!StartVal)
 		return nullptr;
 
+	E.KSDbgInfo.emitLocation(this);
 	// Make the new basic block for the loop header, inserting after current block
-	llvm::Function * TheFunction = Builder->GetInsertBlock()->getParent();
-	llvm::BasicBlock *PreheadBB = Builder->GetInsertBlock();
-	llvm::BasicBlock *LoopBB = llvm::BasicBlock::Create(*TheContext, "loop", TheFunction);
+	llvm::Function * TheFunction = E.Builder->GetInsertBlock()->getParent();
+	llvm::BasicBlock *PreheadBB = E.Builder->GetInsertBlock();
+	llvm::BasicBlock *LoopBB = llvm::BasicBlock::Create(*E.TheContext, "loop", TheFunction);
+
+	ProfileSite EntrySite = E.AddProfileSite(SiteKind::LoopEntry, getLine());
+	ProfileSite BackedgeSite = E.AddProfileSite(SiteKind::LoopBackedge, getLine());
+	E.EmitCounterIncrement(EntrySite);
 
 	//Insert an explicit fall through from the current block to the LoopBB.
-	Builder->CreateBr(LoopBB);
+	E.Builder->CreateBr(LoopBB);
 
 	//Start insertion in LoopBB.
-	Builder->SetInsertPoint(LoopBB);
+	E.Builder->SetInsertPoint(LoopBB);
 
 	//Start the PHI node with an entry for Start.
-	llvm::PHINode * Variable = Builder->CreatePHI(llvm::Type::getDoubleTy(*TheContext), 2, VarName);
+	llvm::PHINode * Variable = E.Builder->CreatePHI(llvm::Type::getDoubleTy(*E.TheContext), 2, VarName);
 	Variable->addIncoming(StartVal, PreheadBB);
 
 	//Within the loop, the varibale is defined equal to the PHI node.
 	//If it shadows an existing variable, we have to restore it, so save it now.
-	llvm::Value *OldVal = NamedValues[VarName];
-	NamedValues[VarName] = Variable;
+	llvm::Value *OldVal = E.NamedValues[VarName];
+	E.NamedValues[VarName] = Variable;
 
 	//Emit the body of the loop. This, like any other expr, can change the
 	//current BB. Note that we ignore the value computed by the body, but don't
 	//allow an error.
-	if(!Body->codegen())
+	if(!Body->codegen(E))
 		return nullptr;
 
 	//Emit the step value.
 	llvm::Value * StepVal = nullptr;
 	if(Step)
 	{
-		StepVal = Step->codegen();
+		StepVal = Step->codegen(E);
 		if(!StepVal)
 			return nullptr;
 	}
 	else
-		StepVal = llvm::ConstantFP::get(*TheContext, llvm::APFloat(1.0));
+		StepVal = llvm::ConstantFP::get(*E.TheContext, llvm::APFloat(1.0));
 
-	llvm::Value *NextVar = Builder->CreateFAdd(Variable, StepVal,  "nextvar");
+	llvm::Value *NextVar = E.Builder->CreateFAdd(Variable, StepVal,  "nextvar");
 
 	//Compute the end condition
-	llvm::Value *EndCond = End->codegen();
+	llvm::Value *EndCond = End->codegen(E);
 	if(!EndCond)
 		return nullptr;
 
 	//Convert condition to a bool by comparing non-equal to 0.0.
-	EndCond = Builder->CreateFCmpONE(EndCond, llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0)), "loopcond");
+	E.KSDbgInfo.emitLocation(this);
+	EndCond = E.Builder->CreateFCmpONE(EndCond, llvm::ConstantFP::get(*E.TheContext, llvm::APFloat(0.0)), "loopcond");
 
 	//Create the 'after loop' block and insert it.
-	llvm::BasicBlock *LoopEndBB = Builder->GetInsertBlock();
-	llvm::BasicBlock *AfterBB = llvm::BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+	llvm::BasicBlock *LoopEndBB = E.Builder->GetInsertBlock();
+	llvm::BasicBlock *AfterBB = llvm::BasicBlock::Create(*E.TheContext, "afterloop", TheFunction);
 
-	//Insert the conditional branch into the end of LoopEndBB.
-	Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+	//Insert the conditional branch into the end of LoopEndBB. When counting,
+	//the back edge goes through a block that counts it. The loop is left once
+	//per entry, which weighs the exit edge.
+	if(BackedgeSite.Counter)
+	{
+		llvm::BasicBlock *BackedgeBB = llvm::BasicBlock::Create(*E.TheContext, "loop.backedge", TheFunction, AfterBB);
+		E.SetBranchWeights(E.Builder->CreateCondBr(EndCond, BackedgeBB, AfterBB), BackedgeSite, EntrySite);
+		E.Builder->SetInsertPoint(BackedgeBB);
+		E.EmitCounterIncrement(BackedgeSite);
+		E.Builder->CreateBr(LoopBB);
+		LoopEndBB = BackedgeBB;
+	}
+	else
+		E.SetBranchWeights(E.Builder->CreateCondBr(EndCond, LoopBB, AfterBB), BackedgeSite, EntrySite);
 
 	//And new code will be inserted in AfterBB.
-	Builder->SetInsertPoint(AfterBB);
+	E.Builder->SetInsertPoint(AfterBB);
 
 	//Add a new entry to the PHI node for the backedge.
 	Variable->addIncoming(NextVar, LoopEndBB);
 
 	//Restore the unshadowed variable.
 	if(OldVal)
-		NamedValues[VarName] = OldVal;
+		E.NamedValues[VarName] = OldVal;
 	else
-		NamedValues.erase(VarName);
+		E.NamedValues.erase(VarName);
 
 	//for expr always return 0.0
-	return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*TheContext));
+	return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*E.TheContext));
 }
 
-llvm::Function *FunctionAST::codegen()
+llvm::Function *FunctionAST::codegen(EngineImpl &E)
 {
 	#ifdef RECALL
 	// Transfer ownership of the prototype to the FunctionProtos map, but keep a
   // reference to it for use below.
   auto &P = *Proto;
-  FunctionProtos[Proto->getName()] = std::move(Proto);
-  llvm::Function *TheFunction = getFunction(P.getName());
+  E.FunctionProtos[Proto->getName()] = std::move(Proto);
+  // An extern compiled into this module may have declared it already.
+  llvm::Function *TheFunction = E.TheModule->getFunction(E.getSymbolName(P.getName()));
+  if (!TheFunction)
+    TheFunction = P.codegen(E);
   if (!TheFunction)
     return nullptr;
 
 	#else
 	//First, check for an existing function from a previous 'extern' declaration.
-	llvm::Function * TheFunction = TheModule->getFunction(Proto->getName());
+	llvm::Function * TheFunction = E.TheModule->getFunction(Proto->getName());
 	
 	if(!TheFunction)
-		TheFunction = Proto->codegen();
+		TheFunction = Proto->codegen(E);
 
 	if(!TheFunction)
 		return nullptr;
 
 	if(!TheFunction->empty())
-		return (llvm::Function *)LogErrorV("Function cannot be redefined.");
+		return (llvm::Function *)E.LogErrorV("Function cannot be redefined.");
+	auto &P = *Proto;
 	#endif
 
+	return emitBody(E, TheFunction, P, {});
+}
+
+llvm::Function *FunctionAST::codegenSpecialization(EngineImpl &E, const std::string &Generic,
+                                                   const std::string &Name,
+                                                   const std::map<unsigned, double> &Consts)
+{
+	auto &G = *E.FunctionProtos[Generic];
+	auto &P = *(E.FunctionProtos[Name] = std::make_unique<PrototypeAST>(
+			SourceLocation{G.getLine(), 0}, Name, G.getArgs()));
+	llvm::Function *TheFunction = E.getFunction(Name);
+	if(!TheFunction)
+		return nullptr;
+	return emitBody(E, TheFunction, P, Consts);
+}
+
+llvm::Function *FunctionAST::emitBody(EngineImpl &E, llvm::Function *TheFunction,
+                                      const PrototypeAST &P,
+                                      const std::map<unsigned, double> &Consts)
+{
+	//Keep frame pointers when profiling so perf can walk through JIT'd frames.
+	if(E.Opts.FramePointers)
+		TheFunction->addFnAttr("frame-pointer", "all");
+
 	//Create a new basic block to start insertion into.
-	llvm::BasicBlock *BB = llvm::BasicBlock::Create(*TheContext, "entry", TheFunction);
-	Builder->SetInsertPoint(BB);
+	llvm::BasicBlock *BB = llvm::BasicBlock::Create(*E.TheContext, "entry", TheFunction);
+	E.Builder->SetInsertPoint(BB);
+
+	//Describe the function and its parameters to the debugger.
+	if(E.DBuilder)
+	{
+		llvm::DIFile *Unit = E.DBuilder->createFile(E.KSDbgInfo.TheCU->getFilename(),
+		                                            E.KSDbgInfo.TheCU->getDirectory());
+		unsigned LineNo = P.getLine();
+		llvm::DISubprogram *SP = E.DBuilder->createFunction(
+				Unit, P.getName(), llvm::StringRef(), Unit, LineNo,
+				E.CreateFunctionType(TheFunction->arg_size()), LineNo,
+				llvm::DINode::FlagPrototyped, llvm::DISubprogram::SPFlagDefinition);
+		TheFunction->setSubprogram(SP);
+		E.KSDbgInfo.LexicalBlocks.push_back(SP);
+
+		//Unset the location for the prologue emission.
+		E.KSDbgInfo.emitLocation(nullptr);
+
+		unsigned ArgIdx = 0;
+		for(auto &Arg : TheFunction->args())
+		{
+			llvm::DILocalVariable *D = E.DBuilder->createParameterVariable(
+					SP, Arg.getName(), ++ArgIdx, Unit, LineNo, E.KSDbgInfo.getDoubleTy(), true);
+			E.DBuilder->insertDbgValueIntrinsic(&Arg, D, E.DBuilder->createExpression(),
+			                                  llvm::DILocation::get(SP->getContext(), LineNo, 0, SP), BB);
+		}
+	}
 
-	//Record the function arguments in the NamedValues map.
-	NamedValues.clear();
+	//Record the function arguments in the NamedValues map; a specialization
+	//sees its folded arguments as constants.
+	E.NamedValues.clear();
 	for(auto &Arg : TheFunction->args())
-		NamedValues[std::string(Arg.getName())] = &Arg;
+	{
+		auto C = Consts.find(Arg.getArgNo());
+		E.NamedValues[std::string(Arg.getName())] = C == Consts.end()
+				? static_cast<llvm::Value *>(&Arg)
+				: llvm::ConstantFP::get(*E.TheContext, llvm::APFloat(C->second));
+	}
 
-	if(llvm::Value *RetVal = Body->codegen())
+	if(E.TheArgProfile && Consts.empty() && !TheFunction->arg_empty())
+		E.EmitArgValueRecording(TheFunction);
+
+	E.NextSiteOrdinal = 0;
+	ProfileSite EntrySite = E.AddProfileSite(SiteKind::FunctionEntry, P.getLine());
+	E.EmitCounterIncrement(EntrySite);
+	if(EntrySite.HasCount)
+		TheFunction->setEntryCount(EntrySite.Count);
+
+	if(llvm::Value *RetVal = Body->codegen(E))
 	{
 		//Finish off the function.
-		Builder->CreateRet(RetVal);
+		E.Builder->CreateRet(RetVal);
+
+		//Pop off the lexical block for the function.
+		if(E.DBuilder)
+			E.KSDbgInfo.LexicalBlocks.pop_back();
 
 		//Validate the generated code, checking for consistency.
-		verifyFunction(*TheFunction);
+		{
+			TelemetryScope S(E.TheTelemetry, Phase::Verify);
+			verifyFunction(*TheFunction);
+		}
 
 		// Optimize the function.
-		#ifdef OPTIMIZATION
-		TheFPM->run(*TheFunction, *TheFAM);
-		#endif
+		if(E.Opts.OptLevel == 1)
+		{
+			TelemetryScope S(E.TheTelemetry, Phase::Optimize);
+			E.TheFPM->run(*TheFunction, *E.TheFAM);
+		}
 
 		//TheFunction->viewCFG();
 		//TheFunction->viewCFG(Only);
@@ -907,186 +1625,2261 @@ llvm::Function *FunctionAST::codegen()
 	}
 
 	TheFunction->eraseFromParent();
+
+	//Pop off the lexical block for the function since we added it unconditionally.
+	if(E.DBuilder)
+		E.KSDbgInfo.LexicalBlocks.pop_back();
 	return nullptr;
 }
 
-/********************************************************* jit **************************************************************/
-static std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
-static std::unique_ptr<llvm::FunctionPassManager> TheFPM;
-static std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
-static std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
-static std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
-static std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
-static std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
-static std::unique_ptr<llvm::StandardInstrumentations> TheSI;
-static llvm::ExitOnError ExitOnErr;
-
-static void InitializeModule();
-
-static void HandleDefinition() {
-  if (auto AST = ParseDefinition()) {
-    fprintf(stderr, "Parsed a function definition.\n");
-		auto *IR = AST->codegen();
-		IR->print(llvm::outs());
-    fprintf(stderr, "\n");
+/********************************************************* speculation **************************************************************/
+/// Static estimates used to turn the AST into expected call counts: each arm
+/// of an 'if' is taken half the time and a 'for' body runs a few times.
+static const double BranchProbability = 0.5;
+static const double LoopTripEstimate = 8.0;
 
-     ExitOnErr(TheJIT->addModule(
-          llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
-     InitializeModule();
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
-  }
+void BinaryExprAST::collectCalls(std::map<std::string, double> &Calls, double Expected) const
+{
+	LHS->collectCalls(Calls, Expected);
+	RHS->collectCalls(Calls, Expected);
 }
 
-static void HandleExtern() {
-  if (auto AST = ParseExtern()) {
-    fprintf(stderr, "Parsed an extern\n");
-		auto *IR = AST->codegen();
-		IR->print(llvm::outs());
-    fprintf(stderr, "\n");
+void CallExprAst::collectCalls(std::map<std::string, double> &Calls, double Expected) const
+{
+	Calls[Callee] += Expected;
+	for(auto &Arg : Args)
+		Arg->collectCalls(Calls, Expected);
+}
 
-		FunctionProtos[AST->getName()] = std::move(AST);
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
-  }
+void IfExprAST::collectCalls(std::map<std::string, double> &Calls, double Expected) const
+{
+	Cond->collectCalls(Calls, Expected);
+	Then->collectCalls(Calls, Expected * BranchProbability);
+	Else->collectCalls(Calls, Expected * BranchProbability);
 }
 
-static void InitializeModule() {
-  // Open a new context and module.
-  TheContext = std::make_unique<llvm::LLVMContext>();
-  TheModule = std::make_unique<llvm::Module>("my cool jit", *TheContext);
-	TheModule->setDataLayout(TheJIT->getDataLayout());
+void ForExprAST::collectCalls(std::map<std::string, double> &Calls, double Expected) const
+{
+	Start->collectCalls(Calls, Expected);
+	End->collectCalls(Calls, Expected * LoopTripEstimate);
+	if(Step)
+		Step->collectCalls(Calls, Expected * LoopTripEstimate);
+	Body->collectCalls(Calls, Expected * LoopTripEstimate);
+}
 
-  // Create a new builder for the module.
-  Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
+/// LikelyCallees - Score every function reachable from Direct by its expected
+/// call count along the best path, boosted by how often earlier expressions
+/// reached it. Scores are capped so recursive cycles terminate.
+std::map<std::string, double> EngineImpl::LikelyCallees(const std::map<std::string, double> &Direct)
+{
+	const double ScoreCap = 1e6;
+	std::map<std::string, double> Score;
+	std::vector<std::pair<std::string, double>> Work(Direct.begin(), Direct.end());
+	while(!Work.empty())
+	{
+		auto Item = Work.back();
+		Work.pop_back();
+		double S = std::min(Item.second, ScoreCap);
+		auto &Best = Score[Item.first];
+		if(Best >= S)
+			continue;
+		Best = S;
+
+		auto CG = CallGraph.find(Item.first);
+		if(CG == CallGraph.end())
+			continue;
+		for(auto &Edge : CG->second)
+			Work.push_back({Edge.first, S * Edge.second});
+	}
 
-  // Create new pass and analysis managers.
-  TheFPM = std::make_unique<llvm::FunctionPassManager>();
-  TheLAM = std::make_unique<llvm::LoopAnalysisManager>();
-  TheFAM = std::make_unique<llvm::FunctionAnalysisManager>();
-  TheCGAM = std::make_unique<llvm::CGSCCAnalysisManager>();
-  TheMAM = std::make_unique<llvm::ModuleAnalysisManager>();
-  ThePIC = std::make_unique<llvm::PassInstrumentationCallbacks>();
-  TheSI = std::make_unique<llvm::StandardInstrumentations>(
-                                                    /*DebugLogging*/ true);
-  TheSI->registerCallbacks(*ThePIC, TheFAM.get());
+	for(auto &Entry : Score)
+		Entry.second *= 1 + CallHistory[Entry.first];
+	return Score;
+}
 
-  // Add transform passes.
-  // Do simple "peephole" optimizations and bit-twiddling optzns.
-  TheFPM->addPass(llvm::InstCombinePass());
-  // Reassociate expressions.
-  TheFPM->addPass(llvm::ReassociatePass());
-  // Eliminate Common SubExpressions.
-  TheFPM->addPass(llvm::GVNPass());
-  // Simplify the control flow graph (deleting unreachable blocks, etc).
-  TheFPM->addPass(llvm::SimplifyCFGPass());
+/********************************************************* result cache **************************************************************/
+/// Node kinds, so that different expressions never profile alike.
+enum ProfileKind { PK_Number, PK_Variable, PK_Binary, PK_Call, PK_If, PK_For };
 
-  // Register analysis passes used in these transform passes.
-  llvm::PassBuilder PB;
-  PB.registerModuleAnalyses(*TheMAM);
-  PB.registerFunctionAnalyses(*TheFAM);
-  PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
+void NumberExprAST::profile(llvm::FoldingSetNodeID &ID, const EngineImpl &E) const
+{
+	ID.AddInteger(unsigned(PK_Number));
+	ID.AddInteger(llvm::DoubleToBits(Val));
 }
 
-static void HandleTopLevelExpression() {
-	auto AST = ParseTopLevelExpr();
-  // Evaluate a top-level expression into an anonymous function.
-  if (AST) {
-    fprintf(stderr, "Parsed a top-level expr\n");
-		auto *IR = AST->codegen();
-			#ifdef PRINT_ALIR
-      IR->print(llvm::outs());
-      fprintf(stderr,"\n");
-      // Remove the anonymous expression.
-      IR->eraseFromParent();
-
-			#else
-      IR->print(llvm::outs());
-      fprintf(stderr,"\n");
+void VariableExprAST::profile(llvm::FoldingSetNodeID &ID, const EngineImpl &E) const
+{
+	ID.AddInteger(unsigned(PK_Variable));
+	ID.AddString(Name);
+}
 
-      // Create a ResourceTracker to track JIT'd memory allocated to our
-      // anonymous expression -- that way we can free it after executing.
-      auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+void BinaryExprAST::profile(llvm::FoldingSetNodeID &ID, const EngineImpl &E) const
+{
+	ID.AddInteger(unsigned(PK_Binary));
+	ID.AddInteger(unsigned(Op));
+	LHS->profile(ID, E);
+	RHS->profile(ID, E);
+}
 
-      auto TSM = llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
-      ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-      InitializeModule();
+void CallExprAst::profile(llvm::FoldingSetNodeID &ID, const EngineImpl &E) const
+{
+	// Each version's body binds its own callees for good, so the version of
+	// the function called directly pins down everything below it.
+	ID.AddInteger(unsigned(PK_Call));
+	ID.AddString(Callee);
+	ID.AddInteger(E.getVersion(Callee));
+	ID.AddInteger(unsigned(Args.size()));
+	for(auto &Arg : Args)
+		Arg->profile(ID, E);
+}
 
-      // Search the JIT for the __anon_expr symbol.
-      auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
-      assert(ExprSymbol && "Function not found");
+void IfExprAST::profile(llvm::FoldingSetNodeID &ID, const EngineImpl &E) const
+{
+	ID.AddInteger(unsigned(PK_If));
+	Cond->profile(ID, E);
+	Then->profile(ID, E);
+	Else->profile(ID, E);
+}
 
-      // Get the symbol's address and cast it to the right type (takes no
-      // arguments, returns a double) so we can call it as a native function.
-			#if 0
-      double (*FP)() = ExprSymbol.getAddress().toPtr<double (*)()>();
-			#else
-			llvm::JITTargetAddress funcAddr = ExprSymbol.getAddress(); // 从 JIT 获取的函数地址
-			double (*FP)() = reinterpret_cast<double (*)()>(static_cast<unsigned long>(funcAddr));
-			#endif
+void ForExprAST::profile(llvm::FoldingSetNodeID &ID, const EngineImpl &E) const
+{
+	ID.AddInteger(unsigned(PK_For));
+	ID.AddString(VarName);
+	Start->profile(ID, E);
+	End->profile(ID, E);
+	ID.AddBoolean(Step != nullptr);
+	if(Step)
+		Step->profile(ID, E);
+	Body->profile(ID, E);
+}
 
-      fprintf(stderr, "Evaluated to %f\n", FP());
+/// getVersion - Times Name has been defined; 0 for externs and unknown names.
+unsigned EngineImpl::getVersion(const std::string &Name) const
+{
+	auto VI = DefinitionVersions.find(Name);
+	return VI == DefinitionVersions.end() ? 0 : VI->second;
+}
 
-      // Delete the anonymous expression module from the JIT.
-      ExitOnErr(RT->remove());
-			#endif
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
-  }
+/// getSymbolName - The JIT's name for the latest version of Name.
+std::string EngineImpl::getSymbolName(const std::string &Name) const
+{
+	unsigned Version = getVersion(Name);
+	return Version < 2 ? Name : Name + "." + std::to_string(Version);
 }
 
-/// top ::= definition | external | expression | ';'
-static void Mainloop()
+/// ReachableFunctions - Every function AST may call, directly or not.
+std::set<std::string> EngineImpl::ReachableFunctions(const FunctionAST &AST) const
 {
-	while(true)
+	std::map<std::string, double> Calls;
+	AST.collectCalls(Calls);
+	std::vector<std::string> Worklist;
+	for(auto &Call : Calls)
+		Worklist.push_back(Call.first);
+	std::set<std::string> Reached;
+	while(!Worklist.empty())
 	{
-		fprintf(stderr, "ready> ");
-		switch(CurTok)
-		{
-			case tok_eof:
-				TheModule->print(llvm::outs(), nullptr);
-				return;
-			case ';': //ignore top-level semicolons.
-				getNextToken();
-				break;
-			case tok_def: //ignore top-level semicolons.
-				HandleDefinition();
-				break;
-			case tok_extern:
-				HandleExtern();
-				break;
-			default:
-				HandleTopLevelExpression();
-				break;
-		}
+		std::string Name = std::move(Worklist.back());
+		Worklist.pop_back();
+		if(!Reached.insert(Name).second)
+			continue;
+		auto DI = DefinitionCallees.find(Name);
+		if(DI != DefinitionCallees.end())
+			Worklist.insert(Worklist.end(), DI->second.begin(), DI->second.end());
 	}
+	return Reached;
 }
 
-int main()
+/// InvalidateResults - Drop cached results that may reach Name.
+void EngineImpl::InvalidateResults(const std::string &Name)
 {
-	// Install standard binary operators.
-	// 1 is lowest precedence.
-	BinopPrecedence['<'] = 10;
-	BinopPrecedence['>'] = 10;
-	BinopPrecedence['+'] = 20;
-	BinopPrecedence['-'] = 20;
-	BinopPrecedence['/'] = 40;
-	BinopPrecedence['*'] = 40; //highest
-
-  llvm::InitializeNativeTarget();
-  llvm::InitializeNativeTargetAsmPrinter();
-  llvm::InitializeNativeTargetAsmParser();
-	
-	TheJIT = ExitOnErr(llvm::orc::KaleidoscopeJIT::Create());
+	for(auto I = ResultCache.begin(); I != ResultCache.end();)
+	{
+		if(I->second.Reaches.count(Name))
+			I = ResultCache.erase(I);
+		else
+			++I;
+	}
+}
+
+/********************************************************* runtime **************************************************************/
+/// MathBuiltins - The C math functions programs declare with a plain extern,
+/// by name. Their addresses are known when we are built, so the JIT defines
+/// them up front instead of searching the process for them.
+static std::map<std::string, llvm::JITTargetAddress> MathBuiltins()
+{
+	using Unary = double (*)(double);
+	using Binary = double (*)(double, double);
+	static const std::pair<const char *, Unary> UnaryFns[] = {
+		{"sin", ::sin}, {"cos", ::cos}, {"tan", ::tan}, {"asin", ::asin},
+		{"acos", ::acos}, {"atan", ::atan}, {"sinh", ::sinh}, {"cosh", ::cosh},
+		{"tanh", ::tanh}, {"exp", ::exp}, {"exp2", ::exp2}, {"log", ::log},
+		{"log2", ::log2}, {"log10", ::log10}, {"sqrt", ::sqrt}, {"cbrt", ::cbrt},
+		{"fabs", ::fabs}, {"floor", ::floor}, {"ceil", ::ceil}, {"round", ::round},
+		{"trunc", ::trunc}};
+	static const std::pair<const char *, Binary> BinaryFns[] = {
+		{"atan2", ::atan2}, {"pow", ::pow}, {"fmod", ::fmod}, {"fmin", ::fmin},
+		{"fmax", ::fmax}, {"hypot", ::hypot}};
+	std::map<std::string, llvm::JITTargetAddress> Builtins;
+	for(auto &F : UnaryFns)
+		Builtins[F.first] = llvm::pointerToJITTargetAddress(F.second);
+	for(auto &F : BinaryFns)
+		Builtins[F.first] = llvm::pointerToJITTargetAddress(F.second);
+	return Builtins;
+}
+
+/// RuntimeDependencies - The C library functions and variables the runtime
+/// bitcode uses. LinkRuntime() renames them to "runtime.<name>", which the
+/// JIT defines, so linked runtime code never needs the process-wide search
+/// and programs cannot reach them through an extern.
+static const std::map<std::string, llvm::JITTargetAddress> &RuntimeFunctionDependencies()
+{
+	static const std::map<std::string, llvm::JITTargetAddress> Deps = {
+		{"fputc", llvm::pointerToJITTargetAddress(&::fputc)},
+		{"fprintf", llvm::pointerToJITTargetAddress(&::fprintf)}};
+	return Deps;
+}
+
+static const std::map<std::string, llvm::JITTargetAddress> &RuntimeDataDependencies()
+{
+	static const std::map<std::string, llvm::JITTargetAddress> Deps = {
+		{"stderr", llvm::pointerToJITTargetAddress(&stderr)}};
+	return Deps;
+}
+
+/// RuntimeDependencyName - What the runtime's reference to Name is linked as.
+static std::string RuntimeDependencyName(llvm::StringRef Name)
+{
+	return ("runtime." + Name).str();
+}
+
+/********************************************************* libraries **************************************************************/
+/// NextDylib - Numbers the JITDylibs engines and libraries create, whose names
+/// must be unique within an ExecutionSession.
+static std::atomic<unsigned> NextDylib(0);
+
+/// HandleImport - import "name": load a precompiled library.
+void EngineImpl::HandleImport(Parser &P) {
+	BeginItem("import");
+	std::string Name;
+	{
+		TelemetryScope S(TheTelemetry, Phase::Parse);
+		Name = P.ParseImport();
+	}
+	if(Name.empty())
+	{
+		// Skip token for error recovery.
+		P.getNextToken();
+		return;
+	}
+	ImportLibrary(Name);
+}
+
+/// FindLibrary - The file import "Name" loads: Name itself if that is a
+/// file, otherwise Name.klib in the current directory or Opts.LibraryPath.
+/// With Opts.RestrictLibraries, only a plain name found in Opts.LibraryPath.
+llvm::Expected<std::string> EngineImpl::FindLibrary(const std::string &Name) const {
+	std::vector<std::string> Dirs;
+	if(Opts.RestrictLibraries)
+	{
+		if(Name.find('/') != std::string::npos || Name == "." || Name == "..")
+			return llvm::createStringError(llvm::inconvertibleErrorCode(),
+			                               "library '%s' is not allowed", Name.c_str());
+	}
+	else
+	{
+		if(llvm::sys::fs::is_regular_file(Name))
+			return Name;
+		Dirs.push_back(".");
+	}
+	Dirs.insert(Dirs.end(), Opts.LibraryPath.begin(), Opts.LibraryPath.end());
+	for(auto &Dir : Dirs)
+	{
+		llvm::SmallString<128> Path(Dir);
+		llvm::sys::path::append(Path, Name + ".klib");
+		if(llvm::sys::fs::is_regular_file(Path))
+			return std::string(Path);
+	}
+	return llvm::createStringError(llvm::inconvertibleErrorCode(),
+	                               "cannot find library '%s'", Name.c_str());
+}
+
+/// ImportLibrary - Load library Name, and the libraries it imports, each into
+/// a dylib of its own that TheJD links against, and declare its exports. No
+/// source is parsed: prototypes come from the library's export table.
+void EngineImpl::ImportLibrary(const std::string &Name) {
+	if(ImportedLibraries.count(Name))
+		return;
+	auto Path = FindLibrary(Name);
+	if(!Path)
+		return Diags.report(Path.takeError());
+	auto Buf = llvm::MemoryBuffer::getFile(*Path);
+	if(!Buf)
+		return Diags.report(llvm::createFileError(*Path, llvm::errorCodeToError(Buf.getError())));
+	auto Ctx = std::make_unique<llvm::LLVMContext>();
+	auto M = llvm::parseBitcodeFile(**Buf, *Ctx);
+	if(!M)
+		return Diags.report(llvm::createFileError(*Path, M.takeError()));
+	auto *Exports = (*M)->getNamedMetadata("kaleidoscope.exports");
+	if(!Exports)
+		return Diags.report(llvm::createStringError(llvm::inconvertibleErrorCode(),
+		                                            "'%s' is not a Kaleidoscope library", Path->c_str()));
+	(*M)->setDataLayout(TheJIT->getDataLayout());
+
+	// The library may call into the ones it was compiled against.
+	std::vector<std::string> Dependencies;
+	if(auto *Imports = (*M)->getNamedMetadata("kaleidoscope.imports"))
+		for(auto *Op : Imports->operands())
+			Dependencies.push_back(llvm::cast<llvm::MDString>(Op->getOperand(0))->getString().str());
+	for(auto &Dependency : Dependencies)
+	{
+		ImportLibrary(Dependency);
+		if(!ImportedLibraries.count(Dependency))
+			return;
+	}
+
+	// Exports are (name, symbol, "pure" or ""); symbol is "name.n" for the
+	// n-th definition of name, as getSymbolName() spells it.
+	struct Export { std::string Name, Symbol; bool Pure; std::vector<std::string> Args; };
+	std::vector<Export> Exported;
+	for(auto *Op : Exports->operands())
+	{
+		Export E;
+		E.Name = llvm::cast<llvm::MDString>(Op->getOperand(0))->getString().str();
+		E.Symbol = llvm::cast<llvm::MDString>(Op->getOperand(1))->getString().str();
+		E.Pure = llvm::cast<llvm::MDString>(Op->getOperand(2))->getString() == "pure";
+		llvm::Function *F = (*M)->getFunction(E.Symbol);
+		if(!F || F->isDeclaration())
+			continue;
+		if(DefinitionVersions.count(E.Name))
+		{
+			Diags.report(("'" + E.Name + "' from '" + Name + "' is already defined").c_str());
+			continue;
+		}
+		for(auto &Arg : F->args())
+			E.Args.push_back(Arg.getName().str());
+		Exported.push_back(std::move(E));
+	}
+
+	auto JD = TheJIT->createLinkedJITDylib("lib." + Name + "." + std::to_string(NextDylib++),
+	                                       Opts.ProcessSymbols);
+	if(!JD)
+		return Diags.report(JD.takeError());
+	for(auto &Dependency : Dependencies)
+		JD->addToLinkOrder(*ImportedLibraries[Dependency]);
+	if(Opts.CodeCache)
+		llvm::orc::SharedObjectCache::markCacheable(**M);
+	if(auto Err = TheJIT->addModule(llvm::orc::ThreadSafeModule(std::move(*M), std::move(Ctx)),
+	                                JD->getDefaultResourceTracker()))
+		return Diags.report(std::move(Err));
+	TheJD->addToLinkOrder(*JD);
+	ImportedLibraries[Name] = &*JD;
+
+	for(auto &E : Exported)
+	{
+		unsigned Version = 1;
+		llvm::StringRef Suffix(E.Symbol);
+		if(Suffix.consume_front(E.Name + ".") && Suffix.getAsInteger(10, Version))
+			continue;
+		if(auto Err = TheJIT->redirect(*JD, E.Name + ".stub", E.Symbol))
+		{
+			Diags.report(std::move(Err));
+			continue;
+		}
+		DefinitionVersions[E.Name] = Version;
+		SharedDefinitions.insert(E.Name);
+		FunctionProtos[E.Name] = std::make_unique<PrototypeAST>(SourceLocation{0, 0}, E.Name, E.Args);
+		if(E.Pure)
+			PureFunctions.insert(E.Name);
+		if(Opts.Echo)
+			fprintf(stderr, "Imported %s from %s\n", E.Name.c_str(), Name.c_str());
+	}
+}
+
+/// LinkIntoLibrary - FinishModule() for compileLibrary(): move the finished
+/// module into LibraryModule. Modules each have their own context, so it
+/// crosses over as bitcode.
+llvm::Error EngineImpl::LinkIntoLibrary() {
+	llvm::SmallVector<char, 0> Buffer;
+	{
+		llvm::raw_svector_ostream OS(Buffer);
+		llvm::WriteBitcodeToFile(*TheModule, OS);
+	}
+	auto M = llvm::parseBitcodeFile(
+			llvm::MemoryBufferRef(llvm::StringRef(Buffer.data(), Buffer.size()), "item"),
+			*LibraryContext);
+	if(!M)
+		return M.takeError();
+	if(llvm::Linker::linkModules(*LibraryModule, std::move(*M)))
+		return llvm::createStringError(llvm::inconvertibleErrorCode(),
+		                               "cannot link into the library");
+	// The module must go before the context InitializeModule() replaces.
+	TheModule.reset();
+	return InitializeModule();
+}
+
+/// WriteLibraryExports - Record what LibraryModule defines and imports, for
+/// ImportLibrary() to read back.
+void EngineImpl::WriteLibraryExports() {
+	auto *Exports = LibraryModule->getOrInsertNamedMetadata("kaleidoscope.exports");
+	for(auto &KV : DefinitionVersions)
+	{
+		std::string Symbol = getSymbolName(KV.first);
+		llvm::Function *F = LibraryModule->getFunction(Symbol);
+		if(!F || F->isDeclaration())
+			continue;
+		Exports->addOperand(llvm::MDTuple::get(*LibraryContext, {
+				llvm::MDString::get(*LibraryContext, KV.first),
+				llvm::MDString::get(*LibraryContext, Symbol),
+				llvm::MDString::get(*LibraryContext, PureFunctions.count(KV.first) ? "pure" : "")}));
+	}
+	auto *Imports = LibraryModule->getOrInsertNamedMetadata("kaleidoscope.imports");
+	for(auto &KV : ImportedLibraries)
+		Imports->addOperand(llvm::MDTuple::get(*LibraryContext,
+				{llvm::MDString::get(*LibraryContext, KV.first)}));
+}
+
+/********************************************************* jit **************************************************************/
+/// initialize - Create the JIT, or a dylib in the prelude's, and everything
+/// Opts asks for, and open the first module.
+llvm::Error EngineImpl::initialize() {
+  if (Opts.Prelude) {
+    TheJIT = Opts.Prelude->I->TheJIT;
+    auto JD = TheJIT->createLinkedJITDylib("engine." + std::to_string(NextDylib++),
+                                           Opts.ProcessSymbols);
+    if (!JD)
+      return JD.takeError();
+    TheJD = &*JD;
+    // Calls to the prelude's functions resolve through the dylib's link order.
+    for (auto &KV : Opts.Prelude->I->FunctionProtos)
+      FunctionProtos[KV.first] = std::make_unique<PrototypeAST>(
+          SourceLocation{KV.second->getLine(), 0}, KV.first, KV.second->getArgs());
+    PureFunctions = Opts.Prelude->I->PureFunctions;
+    DefinitionVersions = Opts.Prelude->I->DefinitionVersions;
+    for (auto &KV : DefinitionVersions)
+      SharedDefinitions.insert(KV.first);
+    // Link order is not transitive, so the prelude's imports are ours too.
+    ImportedLibraries = Opts.Prelude->I->ImportedLibraries;
+    for (auto &KV : ImportedLibraries)
+      TheJD->addToLinkOrder(*KV.second);
+  } else {
+    unsigned Threads = Opts.CompileThreads;
+    if (Opts.Speculate && !Threads)
+      Threads = std::max(1u, std::thread::hardware_concurrency());
+    auto JIT = llvm::orc::KaleidoscopeJIT::Create(Opts.HugePages, Threads,
+                                                  Opts.BackgroundCompiles);
+    if (!JIT)
+      return JIT.takeError();
+    OwnedJIT = std::move(*JIT);
+    TheJIT = OwnedJIT.get();
+    TheJD = &TheJIT->getMainJITDylib();
+    if (TheTelemetry)
+      TheJIT->setTelemetry(*TheTelemetry);
+    if (Opts.CodeCache)
+      TheJIT->setObjectCache(*Opts.CodeCache);
+    auto Builtins = MathBuiltins();
+    for (auto &KV : Opts.Builtins)
+      Builtins[KV.first] = KV.second;
+    if (auto Err = TheJIT->defineRuntimeSymbols(Builtins))
+      return Err;
+    std::map<std::string, llvm::JITTargetAddress> Functions, Data;
+    for (auto &KV : RuntimeFunctionDependencies())
+      Functions[RuntimeDependencyName(KV.first)] = KV.second;
+    for (auto &KV : RuntimeDataDependencies())
+      Data[RuntimeDependencyName(KV.first)] = KV.second;
+    if (auto Err = TheJIT->defineRuntimeSymbols(Functions))
+      return Err;
+    if (auto Err = TheJIT->defineRuntimeSymbols(Data, /*Callable=*/false))
+      return Err;
+    if (Opts.ProcessSymbols)
+      TheJIT->searchProcessSymbols();
+  }
+  if (Opts.Specialize)
+    TheArgProfile = std::make_unique<llvm::orc::ArgValueProfile>();
+
+  if (!Opts.RuntimeBitcode.empty()) {
+    llvm::LLVMContext Ctx;
+    auto Runtime = llvm::parseBitcodeFile(
+        llvm::MemoryBufferRef(Opts.RuntimeBitcode, "runtime"), Ctx);
+    if (!Runtime)
+      return Runtime.takeError();
+    bool Resolvable = true;
+    for (auto &F : **Runtime) {
+      if (!F.isDeclaration())
+        RuntimeFunctions.insert(F.getName().str());
+      else if (!F.isIntrinsic() &&
+               !RuntimeFunctionDependencies().count(F.getName().str()))
+        Resolvable = false;
+    }
+    for (auto &G : (*Runtime)->globals())
+      if (G.isDeclaration() && !RuntimeDataDependencies().count(G.getName().str()))
+        Resolvable = false;
+    // Without the process-wide search, a runtime that uses anything we do not
+    // define could not be linked; its calls go to the builtins instead.
+    if (!Resolvable && !Opts.ProcessSymbols)
+      RuntimeFunctions.clear();
+  }
+
+  if (Opts.OptLevel >= 2) {
+    auto TM = TheJIT->createTargetMachine();
+    if (!TM)
+      return TM.takeError();
+    TheTM = std::move(*TM);
+  }
+  if (!Opts.RemarksFile.empty() && Opts.RemarksFormat != "bitstream") {
+    std::error_code EC;
+    RemarksOS = std::make_unique<llvm::raw_fd_ostream>(Opts.RemarksFile, EC);
+    if (EC)
+      return llvm::createFileError(Opts.RemarksFile, EC);
+  }
+
+  return InitializeModule();
+}
+
+EngineImpl::~Impl() {
+  // A dylib in a shared JIT goes away with its engine.
+  if (!OwnedJIT && TheJD)
+    if (auto Err = TheJIT->removeJITDylib(*TheJD))
+      llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "engine: ");
+}
+
+/// OptimizeModule - Run LLVM's default -O2/-O3 pipeline over TheModule. Each
+/// definition is its own module, so only calls within it can be inlined; the
+/// inliner's missed remarks say so for everything else.
+void EngineImpl::OptimizeModule() {
+  TelemetryScope S(TheTelemetry, Phase::Optimize);
+  llvm::LoopAnalysisManager LAM;
+  llvm::FunctionAnalysisManager FAM;
+  llvm::CGSCCAnalysisManager CGAM;
+  llvm::ModuleAnalysisManager MAM;
+  llvm::PassBuilder PB(TheTM.get(), llvm::PipelineTuningOptions(), llvm::None,
+                       ThePIC.get());
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  // With a profile, move code that never ran out of the hot functions.
+  if (TheProfileData)
+    PB.registerOptimizerLastEPCallback(
+        [](llvm::ModulePassManager &MPM, llvm::OptimizationLevel) {
+          MPM.addPass(llvm::HotColdSplittingPass());
+        });
+  PB.buildPerModuleDefaultPipeline(Opts.OptLevel >= 3 ? llvm::OptimizationLevel::O3
+                                                      : llvm::OptimizationLevel::O2)
+      .run(*TheModule, MAM);
+}
+
+/// FlushRemarks - Stop streaming TheContext's remarks and write them out.
+/// Remarks from instruction selection onwards run on the compile threads and
+/// are not collected.
+void EngineImpl::FlushRemarks() {
+  if (!ModuleRemarksOS)
+    return;
+  TheContext->setLLVMRemarkStreamer(nullptr);
+  TheContext->setMainRemarkStreamer(nullptr);
+  ModuleRemarksOS.reset();
+  if (ModuleRemarks.empty())
+    return;
+  if (RemarksOS) {
+    *RemarksOS << ModuleRemarks;
+    RemarksOS->flush();
+    return;
+  }
+  std::string Name = Opts.RemarksFile + "." + std::to_string(NumRemarkModules++);
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(Name, EC);
+  if (EC)
+    fprintf(stderr, "Error: %s: %s\n", Name.c_str(), EC.message().c_str());
+  else
+    OS << ModuleRemarks;
+}
+
+/// LinkRuntime - Link the runtime functions TheModule calls into it, ahead of
+/// optimization so the inliner sees their bodies. Each module gets private
+/// copies of just what it calls; calls nothing links resolve to the builtins.
+llvm::Error EngineImpl::LinkRuntime() {
+  auto Linked = [this](llvm::StringRef Name) {
+    std::string N = Name.str();
+    return RuntimeFunctions.count(N) && !DefinitionVersions.count(N) &&
+           !ForeignExterns.count(N);
+  };
+  if (llvm::none_of(*TheModule, [&](llvm::Function &F) {
+        return F.isDeclaration() && Linked(F.getName());
+      }))
+    return llvm::Error::success();
+
+  auto Runtime = llvm::parseBitcodeFile(
+      llvm::MemoryBufferRef(Opts.RuntimeBitcode, "runtime"), *TheContext);
+  if (!Runtime)
+    return Runtime.takeError();
+  (*Runtime)->setDataLayout(TheModule->getDataLayout());
+  for (auto &F : **Runtime) {
+    if (!F.isDeclaration() && !Linked(F.getName()))
+      F.deleteBody();
+    else if (F.isDeclaration() &&
+             RuntimeFunctionDependencies().count(F.getName().str()))
+      F.setName(RuntimeDependencyName(F.getName()));
+  }
+  for (auto &G : (*Runtime)->globals())
+    if (G.isDeclaration() && RuntimeDataDependencies().count(G.getName().str()))
+      G.setName(RuntimeDependencyName(G.getName()));
+  if (llvm::Linker::linkModules(
+          *TheModule, std::move(*Runtime), llvm::Linker::Flags::LinkOnlyNeeded,
+          [](llvm::Module &M, const llvm::StringSet<> &Runtime) {
+            llvm::internalizeModule(M, [&](const llvm::GlobalValue &GV) {
+              return !GV.hasName() || !Runtime.count(GV.getName());
+            });
+          }))
+    return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                   "cannot link the runtime");
+  return llvm::Error::success();
+}
+
+/// FinishModule - Hand the module under construction to the JIT, tracked by
+/// RT (or TheJD's default tracker), and start a fresh one.
+llvm::Error EngineImpl::FinishModule(llvm::orc::ResourceTrackerSP RT) {
+  if (DBuilder)
+    DBuilder->finalize();
+  // Only code that stays is worth sharing: not expressions, which run once,
+  // and not instrumented code, which holds this process's addresses.
+  if (Opts.CodeCache && !RT && !TheProfile && !TheArgProfile &&
+      llvm::none_of(*TheModule, [](llvm::Function &F) {
+        return !F.isDeclaration() && (F.getName().startswith("__anon_expr.") ||
+                                      F.getName().startswith("batch."));
+      }))
+    llvm::orc::SharedObjectCache::markCacheable(*TheModule);
+  if (auto Err = LinkRuntime())
+    return Err;
+  if (Opts.OptLevel >= 2)
+    OptimizeModule();
+  FlushRemarks();
+  if (LibraryModule)
+    return LinkIntoLibrary();
+  TelemetryScope S(TheTelemetry, Phase::AddModule);
+  if (TheTelemetry)
+    TheModule->setModuleIdentifier(llvm::orc::CompileTelemetry::getModuleIdentifier(
+        TheTelemetry->getCurrentItem()));
+  if (!RT)
+    RT = TheJD->getDefaultResourceTracker();
+  if (auto Err = TheJIT->addModule(
+          llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext)),
+          std::move(RT)))
+    return Err;
+  return InitializeModule();
+}
+
+/// BeginItem - Start a telemetry item for the next top-level construct.
+void EngineImpl::BeginItem(const char *Kind) {
+  if (TheTelemetry)
+    TheTelemetry->beginItem(Kind);
+}
+
+/// RecordIR - Name the current telemetry item after IR and count its IR bytes.
+void EngineImpl::RecordIR(llvm::Function *IR) {
+  if (!TheTelemetry || !IR)
+    return;
+  std::string Text;
+  llvm::raw_string_ostream OS(Text);
+  IR->print(OS);
+  unsigned Item = TheTelemetry->getCurrentItem();
+  TheTelemetry->setItemName(Item, IR->getName());
+  TheTelemetry->addIRBytes(Item, OS.str().size());
+}
+
+void EngineImpl::HandleDefinition(Parser &P) {
+  BeginItem("definition");
+  std::unique_ptr<FunctionAST> AST;
+  {
+    TelemetryScope S(TheTelemetry, Phase::Parse);
+    AST = P.ParseDefinition();
+  }
+  if (AST) {
+    CompileDefinition(std::move(AST));
+  } else {
+    // Skip token for error recovery.
+    P.getNextToken();
+  }
+}
+
+/// CompileDefinition - Codegen a parsed definition and hand it to the JIT.
+void EngineImpl::CompileDefinition(std::unique_ptr<FunctionAST> AST) {
+    if (Opts.Echo)
+      fprintf(stderr, "Parsed a function definition.\n");
+		if(Opts.Speculate)
+		{
+			auto &Calls = CallGraph[AST->getName()];
+			Calls.clear();
+			AST->collectCalls(Calls);
+		}
+		std::string Name = AST->getName();
+		if(SharedDefinitions.count(Name))
+			return Diags.report(("'" + Name + "' comes from the prelude or a library and cannot be redefined").c_str());
+		// A redefinition is compiled under the next version's name.
+		unsigned Previous = getVersion(Name);
+		DefinitionVersions[Name] = Previous + 1;
+		auto Revert = [&] {
+			if(Previous)
+				DefinitionVersions[Name] = Previous;
+			else
+				DefinitionVersions.erase(Name);
+		};
+		llvm::Function *IR;
+		{
+			TelemetryScope S(TheTelemetry, Phase::Codegen);
+			IR = AST->codegen(*this);
+		}
+		RecordIR(IR);
+		if(!IR)
+			return Revert();
+		if(Opts.Echo && Opts.EchoIR)
+		{
+			IR->print(llvm::outs());
+			fprintf(stderr, "\n");
+		}
+
+     if (auto Err = FinishModule()) {
+       Revert();
+       return Diags.report(std::move(Err));
+     }
+		// Point the stub at the new version, so callers compiled before reach it
+		// too. A library's stubs are made once the library is in the JIT.
+		if(!LibraryModule)
+			if(auto Err = TheJIT->redirect(*TheJD, Name + ".stub", getSymbolName(Name)))
+				Diags.report(std::move(Err));
+		if(Previous)
+		{
+			// Host entry points, specializations and cached results all refer
+			// to the old version. Calls guarded for the clone take the new
+			// version instead.
+			EntryPoints.erase(Name);
+			Specializations.erase(Name);
+			if(SpecializationStubs.count(Name) && !LibraryModule)
+				if(auto Err = TheJIT->redirect(*TheJD, Name + ".spec.stub", getSymbolName(Name)))
+					Diags.report(std::move(Err));
+			InvalidateResults(Name);
+		}
+		std::map<std::string, double> Calls;
+		AST->collectCalls(Calls);
+		auto &Callees = DefinitionCallees[Name];
+		Callees.clear();
+		for(auto &Call : Calls)
+			Callees.insert(Call.first);
+		if(IsPure(*AST, Name))
+			PureFunctions.insert(Name);
+		else
+			PureFunctions.erase(Name);
+		if(TheArgProfile)
+			FunctionDefs[Name] = std::move(AST);
+}
+
+void EngineImpl::HandleExtern(Parser &P) {
+  BeginItem("extern");
+  std::unique_ptr<PrototypeAST> AST;
+  std::string Library;
+  {
+    TelemetryScope S(TheTelemetry, Phase::Parse);
+    AST = P.ParseExtern(Library);
+  }
+  if (AST) {
+    CompileExtern(std::move(AST), Library);
+  } else {
+    // Skip token for error recovery.
+    P.getNextToken();
+  }
+}
+
+/// CompileExtern - Declare a parsed extern in the module under construction.
+/// With a Library, the symbol is bound to that shared library's definition.
+void EngineImpl::CompileExtern(std::unique_ptr<PrototypeAST> AST, const std::string &Library) {
+		if(!Library.empty() && Opts.RestrictLibraries &&
+		   !llvm::is_contained(Opts.AllowedLibraries, Library))
+			return Diags.report(("library '" + Library + "' is not allowed").c_str());
+		if(!Library.empty())
+			if(auto Err = TheJIT->linkForeignSymbol(*TheJD, Library, AST->getName()))
+				return Diags.report(std::move(Err));
+		if(Library.empty())
+			ForeignExterns.erase(AST->getName());
+		else
+			ForeignExterns.insert(AST->getName());
+		// An extern for a defined function declares its stub, like a call would.
+		auto *IR = getVersion(AST->getName()) ? AST->codegen(*this, AST->getName() + ".stub")
+		                                      : AST->codegen(*this);
+		if(TheTelemetry)
+			TheTelemetry->setItemName(TheTelemetry->getCurrentItem(), AST->getName());
+		if(Opts.Echo)
+		{
+			fprintf(stderr, "Parsed an extern\n");
+			if(Opts.EchoIR)
+			{
+				IR->print(llvm::outs());
+				fprintf(stderr, "\n");
+			}
+		}
+
+		// Externs are opaque; only the math library's, known to be free of side
+		// effects, count as pure. putchard, printd, anything unknown and
+		// anything bound to a library of the program's choosing are not.
+		static const std::set<std::string> PureExterns = {
+			"sin", "cos", "tan", "asin", "acos", "atan", "atan2", "sinh", "cosh",
+			"tanh", "exp", "exp2", "log", "log2", "log10", "pow", "sqrt", "cbrt",
+			"fabs", "floor", "ceil", "round", "trunc", "fmod", "fmin", "fmax", "hypot"};
+		if(Library.empty() && PureExterns.count(AST->getName()))
+			PureFunctions.insert(AST->getName());
+		else
+			PureFunctions.erase(AST->getName());
+		FunctionProtos[AST->getName()] = std::move(AST);
+}
+
+/// IsPure - Whether running AST, named Name, can have no effect but computing
+/// its value. Every callee was declared before AST, so the table already
+/// covers them.
+bool EngineImpl::IsPure(const FunctionAST &AST, llvm::StringRef Name) const {
+	std::map<std::string, double> Calls;
+	AST.collectCalls(Calls);
+	for(auto &Call : Calls)
+		if(Call.first != Name && !PureFunctions.count(Call.first))
+			return false;
+	return true;
+}
+
+llvm::Error EngineImpl::InitializeModule() {
+  // Open a new context and module.
+  TheContext = std::make_unique<llvm::LLVMContext>();
+  TheModule = std::make_unique<llvm::Module>("my cool jit", *TheContext);
+	TheModule->setDataLayout(TheJIT->getDataLayout());
+
+  // Create a new builder for the module.
+  Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
+
+  // Each module carries its own compile unit, finalized in FinishModule().
+  KSDbgInfo = DebugInfo();
+  KSDbgInfo.Builder = Builder.get();
+  if (Opts.DebugInfo) {
+    TheModule->addModuleFlag(llvm::Module::Warning, "Debug Info Version",
+                             llvm::DEBUG_METADATA_VERSION);
+    TheModule->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 4);
+    DBuilder = std::make_unique<llvm::DIBuilder>(*TheModule);
+    KSDbgInfo.DBuilder = DBuilder.get();
+    llvm::StringRef Dir = llvm::sys::path::parent_path(Opts.SourceName);
+    KSDbgInfo.TheCU = DBuilder->createCompileUnit(
+        llvm::dwarf::DW_LANG_C,
+        DBuilder->createFile(llvm::sys::path::filename(Opts.SourceName),
+                             Dir.empty() ? "." : Dir),
+        "Kaleidoscope Compiler", /*isOptimized*/ Opts.OptLevel > 0, "", 0);
+  }
+
+  if (TheProfileData)
+    TheModule->setProfileSummary(TheProfileData->getSummary(*TheContext),
+                                 llvm::ProfileSummary::PSK_Instr);
+
+  if (!Opts.RemarksFile.empty()) {
+    ModuleRemarks.clear();
+    ModuleRemarksOS = std::make_unique<llvm::raw_svector_ostream>(ModuleRemarks);
+    if (auto Err = llvm::setupLLVMOptimizationRemarks(
+            *TheContext, *ModuleRemarksOS, Opts.RemarksFilter, Opts.RemarksFormat,
+            /*RemarksWithHotness*/ false))
+      return Err;
+  }
+
+  // Create new pass and analysis managers.
+  TheFPM = std::make_unique<llvm::FunctionPassManager>();
+  TheLAM = std::make_unique<llvm::LoopAnalysisManager>();
+  TheFAM = std::make_unique<llvm::FunctionAnalysisManager>();
+  TheCGAM = std::make_unique<llvm::CGSCCAnalysisManager>();
+  TheMAM = std::make_unique<llvm::ModuleAnalysisManager>();
+  ThePIC.reset();
+  if (ThePassStats) {
+    ThePIC = std::make_unique<llvm::PassInstrumentationCallbacks>();
+    ThePassStats->registerCallbacks(*ThePIC);
+  }
+
+  // Add transform passes.
+  // Do simple "peephole" optimizations and bit-twiddling optzns.
+  TheFPM->addPass(llvm::InstCombinePass());
+  // Reassociate expressions.
+  TheFPM->addPass(llvm::ReassociatePass());
+  // Eliminate Common SubExpressions.
+  TheFPM->addPass(llvm::GVNPass());
+  // Simplify the control flow graph (deleting unreachable blocks, etc).
+  TheFPM->addPass(llvm::SimplifyCFGPass());
+
+  // Register analysis passes used in these transform passes.
+  llvm::PassBuilder PB(nullptr, llvm::PipelineTuningOptions(), llvm::None,
+                       ThePIC.get());
+  PB.registerModuleAnalyses(*TheMAM);
+  PB.registerFunctionAnalyses(*TheFAM);
+  PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
+  return llvm::Error::success();
+}
+
+/// SpecializeStableFunctions - Clone each definition whose arguments have
+/// kept the same value for Opts.SpecializeThreshold calls, with those
+/// arguments folded. Each function is specialized at most once.
+void EngineImpl::SpecializeStableFunctions() {
+  for (auto &Def : FunctionDefs) {
+    const std::string &Generic = Def.first;
+    if (Specializations.count(Generic))
+      continue;
+    auto Consts = TheArgProfile->getStableArgs(getSymbolName(Generic), Opts.SpecializeThreshold);
+    if (Consts.empty())
+      continue;
+
+    BeginItem("specialization");
+    Specialization Spec = {getSymbolName(Generic) + ".spec", Consts};
+    llvm::Function *IR;
+    {
+      TelemetryScope S(TheTelemetry, Phase::Codegen);
+      IR = Def.second->codegenSpecialization(*this, Generic, Spec.Name, Consts);
+    }
+    RecordIR(IR);
+    if (!IR)
+      continue;
+    if (Opts.Echo)
+      fprintf(stderr, "Specialized %s on %zu argument(s)\n", Generic.c_str(), Consts.size());
+    if (auto Err = FinishModule()) {
+      Diags.report(std::move(Err));
+      continue;
+    }
+    if (auto Err = TheJIT->redirect(*TheJD, Generic + ".spec.stub", Spec.Name)) {
+      Diags.report(std::move(Err));
+      continue;
+    }
+    SpecializationStubs.insert(Generic);
+    Specializations[Generic] = std::move(Spec);
+  }
+}
 
-	loadso();
+/// HandleTopLevelExpression - Compile and run the next top-level expression,
+/// returning its value, or None once the failure has been reported.
+llvm::Optional<double> EngineImpl::HandleTopLevelExpression(Parser &P) {
+	// Each expression gets its own entry slot, so its symbol never collides
+	// with another expression still in flight.
+	BeginItem("expression");
+	auto Slot = TheJIT->acquireEntrySlot(*TheJD);
+	std::unique_ptr<FunctionAST> AST;
+	{
+		TelemetryScope S(TheTelemetry, Phase::Parse);
+		AST = P.ParseTopLevelExpr(Slot.Name);
+	}
+  // Evaluate a top-level expression into an anonymous function.
+  if (AST) {
+    if (Opts.Echo)
+      fprintf(stderr, "Parsed a top-level expr\n");
+		// A pure expression seen before with the same callee versions has the
+		// same value; instrumented code must run to be counted.
+		llvm::FoldingSetNodeID Key;
+		bool Cacheable = Opts.CacheResults && !TheProfile && !TheArgProfile &&
+		                 IsPure(*AST, Slot.Name);
+		if(Cacheable)
+		{
+			AST->profile(Key, *this);
+			auto CI = ResultCache.find(Key);
+			if(CI != ResultCache.end())
+			{
+				if(Opts.Echo)
+					fprintf(stderr, "Evaluated to %f\n", CI->second.Value);
+				if(auto Err = TheJIT->releaseEntrySlot(std::move(Slot)))
+					Diags.report(std::move(Err));
+				return CI->second.Value;
+			}
+		}
+		// Get likely callees compiling on the background threads while we
+		// codegen and compile the expression itself.
+		std::map<std::string, double> Likely;
+		if(Opts.Speculate)
+		{
+			std::map<std::string, double> Calls;
+			AST->collectCalls(Calls);
+			Likely = LikelyCallees(Calls);
+			std::vector<std::string> Names;
+			for(auto &Entry : Likely)
+				if(Entry.second >= Opts.SpeculationThreshold)
+					Names.push_back(getSymbolName(Entry.first));
+			if(!Names.empty())
+				TheJIT->speculate(*TheJD, Names);
+		}
+		llvm::Function *IR;
+		{
+			TelemetryScope S(TheTelemetry, Phase::Codegen);
+			IR = AST->codegen(*this);
+		}
+		RecordIR(IR);
+		if(!IR)
+		{
+			if(auto Err = TheJIT->releaseEntrySlot(std::move(Slot)))
+				Diags.report(std::move(Err));
+			return llvm::None;
+		}
+			#ifdef PRINT_ALIR
+      IR->print(llvm::outs());
+      fprintf(stderr,"\n");
+      // Remove the anonymous expression.
+      IR->eraseFromParent();
+      if (auto Err = TheJIT->releaseEntrySlot(std::move(Slot)))
+        Diags.report(std::move(Err));
+      return llvm::None;
 
-	InitializeModule();
+			#else
+      if (Opts.Echo && Opts.EchoIR) {
+        IR->print(llvm::outs());
+        fprintf(stderr,"\n");
+      }
 
-	Mainloop();
+      // The slot's ResourceTracker tracks JIT'd memory allocated to our
+      // anonymous expression -- that way we can free it after executing.
+      if (auto Err = FinishModule(Slot.RT)) {
+        Diags.report(std::move(Err));
+        return llvm::None;
+      }
+
+      // Search the JIT for the slot's entry symbol.
+      llvm::Expected<llvm::JITEvaluatedSymbol> ExprSymbol = llvm::JITEvaluatedSymbol(nullptr);
+      {
+        TelemetryScope S(TheTelemetry, Phase::Lookup);
+        ExprSymbol = TheJIT->lookup(Slot);
+      }
+      if (!ExprSymbol) {
+        Diags.report(ExprSymbol.takeError());
+        if (auto Err = TheJIT->releaseEntrySlot(std::move(Slot)))
+          Diags.report(std::move(Err));
+        return llvm::None;
+      }
 
+      // Get the symbol's address and cast it to the right type (takes no
+      // arguments, returns a double) so we can call it as a native function.
+			#if 0
+      double (*FP)() = ExprSymbol->getAddress().toPtr<double (*)()>();
+			#else
+			llvm::JITTargetAddress funcAddr = ExprSymbol->getAddress(); // 从 JIT 获取的函数地址
+			double (*FP)() = reinterpret_cast<double (*)()>(static_cast<unsigned long>(funcAddr));
+			#endif
+
+      double Result;
+      {
+        TelemetryScope S(TheTelemetry, Phase::Execute);
+        Result = FP();
+      }
+      if (Opts.Echo)
+        fprintf(stderr, "Evaluated to %f\n", Result);
+			if(Cacheable)
+				ResultCache[Key] = {Result, ReachableFunctions(*AST)};
+			for(auto &Entry : Likely)
+				++CallHistory[Entry.first];
+
+      // Delete the anonymous expression module from the JIT and recycle the slot.
+      if (auto Err = TheJIT->releaseEntrySlot(std::move(Slot)))
+        Diags.report(std::move(Err));
+
+      if (TheArgProfile)
+        SpecializeStableFunctions();
+      return Result;
+			#endif
+  } else {
+    if (auto Err = TheJIT->releaseEntrySlot(std::move(Slot)))
+      Diags.report(std::move(Err));
+    // Skip token for error recovery.
+    P.getNextToken();
+    return llvm::None;
+  }
+}
+
+/// HandleBatchExpression - Compile the next top-level expression into the
+/// module under construction without running it. Returns its name, or an
+/// empty string once the failure has been reported.
+std::string EngineImpl::HandleBatchExpression(Parser &P) {
+	BeginItem("expression");
+	std::string Name = "batch." + std::to_string(NextBatchExpr++);
+	std::unique_ptr<FunctionAST> AST;
+	{
+		TelemetryScope S(TheTelemetry, Phase::Parse);
+		AST = P.ParseTopLevelExpr(Name);
+	}
+	if(!AST)
+	{
+		// Skip token for error recovery.
+		P.getNextToken();
+		return "";
+	}
+	llvm::Function *IR;
+	{
+		TelemetryScope S(TheTelemetry, Phase::Codegen);
+		IR = AST->codegen(*this);
+	}
+	RecordIR(IR);
+	if(!IR)
+		return "";
+	if(NextBatchExpr % BatchModuleSize == 0)
+		if(auto Err = FinishModule())
+		{
+			Diags.report(std::move(Err));
+			return "";
+		}
+	return Name;
+}
+
+/// top ::= definition | external | import | expression | ';'
+void EngineImpl::Mainloop(Parser &P, llvm::function_ref<void()> OnPrompt,
+                          std::vector<double> *Results)
+{
+	while(true)
+	{
+		if(Opts.Echo)
+			fprintf(stderr, "ready> ");
+		if(OnPrompt)
+			OnPrompt();
+		switch(P.CurTok)
+		{
+			case tok_eof:
+				if(Opts.Echo && Opts.EchoIR)
+					TheModule->print(llvm::outs(), nullptr);
+				return;
+			case ';': //ignore top-level semicolons.
+				P.getNextToken();
+				break;
+			case tok_def: //ignore top-level semicolons.
+				HandleDefinition(P);
+				break;
+			case tok_extern:
+				HandleExtern(P);
+				break;
+			case tok_import:
+				HandleImport(P);
+				break;
+			default:
+				if(auto Result = HandleTopLevelExpression(P))
+					if(Results)
+						Results->push_back(*Result);
+				break;
+		}
+	}
+}
+
+/********************************************************* pipeline **************************************************************/
+/// PipelineQueue - Unbounded FIFO handing items from one pipeline stage to
+/// the next.
+template <typename T>
+class PipelineQueue
+{
+	public:
+		void push(T Item)
+		{
+			{
+				std::lock_guard<std::mutex> Lock(M);
+				Items.push_back(std::move(Item));
+			}
+			CV.notify_one();
+		}
+
+		/// close - No more items will be pushed.
+		void close()
+		{
+			{
+				std::lock_guard<std::mutex> Lock(M);
+				Closed = true;
+			}
+			CV.notify_all();
+		}
+
+		/// pop - Wait for the next item; false once closed and drained.
+		bool pop(T &Item)
+		{
+			std::unique_lock<std::mutex> Lock(M);
+			CV.wait(Lock, [this] { return !Items.empty() || Closed; });
+			if(Items.empty())
+				return false;
+			Item = std::move(Items.front());
+			Items.pop_front();
+			return true;
+		}
+
+	private:
+		std::mutex M;
+		std::condition_variable CV;
+		std::deque<T> Items;
+		bool Closed = false;
+};
+
+/// ParsedItem - A top-level item on its way from the parse stage to the
+/// compile stage. Expressions already hold their entry slot, whose name the
+/// parser gave them.
+struct EngineImpl::ParsedItem
+{
+	int Kind = 0; // tok_def, tok_extern, tok_import, or 0 for an expression
+	std::unique_ptr<FunctionAST> Fn;
+	std::unique_ptr<PrototypeAST> Proto;
+	std::string Library; // The import's, or the extern's shared library
+	llvm::orc::KaleidoscopeJIT::EntrySlot Slot;
+};
+
+/// PendingExpression - A compiled expression on its way to the execute
+/// stage, with its address arriving once the JIT has materialized it.
+struct EngineImpl::PendingExpression
+{
+	llvm::orc::KaleidoscopeJIT::EntrySlot Slot;
+	std::future<llvm::Expected<llvm::JITEvaluatedSymbol>> Address;
+	/// Pure - Running it has no effect but its value (see IsPure).
+	bool Pure = false;
+};
+
+/// ExpressionOutcome - What running a PendingExpression produced, for the
+/// report stage to print in program order.
+struct ExpressionOutcome
+{
+	double Value = 0;
+	std::string Error;
+};
+
+/// CompileExpression - Codegen a parsed expression into its slot and start
+/// materializing it without waiting. False once the failure is reported.
+bool EngineImpl::CompileExpression(ParsedItem &Item, PendingExpression &Pending)
+{
+	if(Opts.Echo)
+		fprintf(stderr, "Parsed a top-level expr\n");
+	llvm::Function *IR;
+	{
+		TelemetryScope S(TheTelemetry, Phase::Codegen);
+		IR = Item.Fn->codegen(*this);
+	}
+	RecordIR(IR);
+	if(IR && Opts.Echo && Opts.EchoIR)
+	{
+		IR->print(llvm::outs());
+		fprintf(stderr, "\n");
+	}
+	llvm::Error Err = IR ? FinishModule(Item.Slot.RT) : llvm::Error::success();
+	if(!IR || Err)
+	{
+		if(Err)
+			Diags.report(std::move(Err));
+		if(auto Err = TheJIT->releaseEntrySlot(std::move(Item.Slot)))
+			Diags.report(std::move(Err));
+		return false;
+	}
+
+	std::promise<llvm::Expected<llvm::JITEvaluatedSymbol>> Promise;
+	Pending.Address = Promise.get_future();
+	Pending.Slot = std::move(Item.Slot);
+	Pending.Pure = IsPure(*Item.Fn, Pending.Slot.Name);
+	TheJIT->lookupAsync(Pending.Slot,
+		[Promise = std::move(Promise)](llvm::Expected<llvm::JITEvaluatedSymbol> Sym) mutable {
+			Promise.set_value(std::move(Sym));
+		});
+	return true;
+}
+
+/// PipelinedLoop - Three stages joined by queues: a parse thread, the compile
+/// stage, which hands finished modules to the JIT and moves on while they are
+/// materialized, and an execute thread running expressions in program order.
+/// Each stage reports its own errors.
+void EngineImpl::PipelinedLoop(Lexer &Lex)
+{
+	PipelineQueue<ParsedItem> Parsed;
+	PipelineQueue<PendingExpression> Compiled;
+
+	Diagnostics ParseDiags;
+	ParseDiags.Echo = Opts.Echo;
+	std::thread ParseStage([&] {
+		Parser P(Lex, ParseDiags, nullptr);
+		P.getNextToken();
+		while(P.CurTok != tok_eof)
+		{
+			ParsedItem Item;
+			switch(P.CurTok)
+			{
+				case ';':
+					P.getNextToken();
+					continue;
+				case tok_def:
+					Item.Kind = tok_def;
+					Item.Fn = P.ParseDefinition();
+					break;
+				case tok_extern:
+					Item.Kind = tok_extern;
+					Item.Proto = P.ParseExtern(Item.Library);
+					break;
+				case tok_import:
+					Item.Kind = tok_import;
+					Item.Library = P.ParseImport();
+					break;
+				default:
+					Item.Slot = TheJIT->acquireEntrySlot(*TheJD);
+					Item.Fn = P.ParseTopLevelExpr(Item.Slot.Name);
+					if(!Item.Fn)
+						if(auto Err = TheJIT->releaseEntrySlot(std::move(Item.Slot)))
+							ParseDiags.report(std::move(Err));
+					break;
+			}
+			if(Item.Kind == tok_import ? Item.Library.empty() : !Item.Fn && !Item.Proto)
+			{
+				// Skip token for error recovery.
+				P.getNextToken();
+				continue;
+			}
+			Parsed.push(std::move(Item));
+		}
+		Parsed.close();
+	});
+
+	// Runs one expression and frees its slot; safe on any thread.
+	auto Run = [this](PendingExpression &Pending) {
+		ExpressionOutcome Out;
+		auto Sym = Pending.Address.get();
+		if(!Sym)
+			Out.Error = llvm::toString(Sym.takeError());
+		else
+		{
+			auto *FP = reinterpret_cast<double (*)()>(
+				static_cast<uintptr_t>(Sym->getAddress()));
+			Out.Value = FP();
+		}
+		if(auto Err = TheJIT->releaseEntrySlot(std::move(Pending.Slot)))
+			Out.Error += llvm::toString(std::move(Err));
+		return Out;
+	};
+
+	// With Opts.ParallelExpressions, runs of pure expressions go to
+	// ExecutePool and run concurrently. An expression with side effects is a
+	// barrier: it waits for everything before it and runs on this thread, so
+	// effects happen in program order. Profile counters and argument samples
+	// are relaxed atomics, so instrumented code may run concurrently too.
+	PipelineQueue<std::shared_future<ExpressionOutcome>> Outcomes;
+	bool Parallel = Opts.ParallelExpressions;
+	std::thread ExecuteStage([&] {
+		std::unique_ptr<llvm::ThreadPool> ExecutePool;
+		if(Parallel)
+			ExecutePool = std::make_unique<llvm::ThreadPool>();
+		std::vector<std::shared_future<ExpressionOutcome>> InFlight;
+		PendingExpression Pending;
+		while(Compiled.pop(Pending))
+		{
+			if(ExecutePool && Pending.Pure)
+			{
+				auto Shared = std::make_shared<PendingExpression>(std::move(Pending));
+				InFlight.push_back(ExecutePool->async([Run, Shared] { return Run(*Shared); }));
+				Outcomes.push(InFlight.back());
+				continue;
+			}
+			for(auto &F : InFlight)
+				F.wait();
+			InFlight.clear();
+			std::promise<ExpressionOutcome> Done;
+			Done.set_value(Run(Pending));
+			Outcomes.push(Done.get_future().share());
+		}
+		Outcomes.close();
+	});
+
+	// Results are reported in program order, whichever order they finish in.
+	Diagnostics ExecuteDiags;
+	ExecuteDiags.Echo = Opts.Echo;
+	std::thread ReportStage([&] {
+		std::shared_future<ExpressionOutcome> Next;
+		while(Outcomes.pop(Next))
+		{
+			const ExpressionOutcome &Out = Next.get();
+			if(!Out.Error.empty())
+				ExecuteDiags.report(Out.Error.c_str());
+			else if(Opts.Echo)
+				fprintf(stderr, "Evaluated to %f\n", Out.Value);
+			ExecuteDiags.Text.clear();
+		}
+	});
+
+	// The compile stage gives way to execution too, not just the JIT's pool.
+	std::thread CompileStage([&] {
+		if(Opts.BackgroundCompiles)
+			llvm::set_thread_priority(llvm::ThreadPriority::Background);
+		ParsedItem Item;
+		while(Parsed.pop(Item))
+		{
+			Diags.Text.clear();
+			switch(Item.Kind)
+			{
+				case tok_def:
+					BeginItem("definition");
+					CompileDefinition(std::move(Item.Fn));
+					break;
+				case tok_extern:
+					BeginItem("extern");
+					CompileExtern(std::move(Item.Proto), Item.Library);
+					break;
+				case tok_import:
+					BeginItem("import");
+					ImportLibrary(Item.Library);
+					break;
+				default:
+				{
+					BeginItem("expression");
+					PendingExpression Pending;
+					if(CompileExpression(Item, Pending))
+						Compiled.push(std::move(Pending));
+					break;
+				}
+			}
+		}
+		Compiled.close();
+	});
+
+	ParseStage.join();
+	CompileStage.join();
+	ExecuteStage.join();
+	ReportStage.join();
+	if(Opts.Echo && Opts.EchoIR)
+		TheModule->print(llvm::outs(), nullptr);
+}
+
+/********************************************************* engine **************************************************************/
+llvm::Expected<std::unique_ptr<llvm::orc::KaleidoscopeEngine>>
+llvm::orc::KaleidoscopeEngine::Create(Options Opts)
+{
+	static std::once_flag TargetsInitialized;
+	std::call_once(TargetsInitialized, [] {
+		llvm::InitializeNativeTarget();
+		llvm::InitializeNativeTargetAsmPrinter();
+		llvm::InitializeNativeTargetAsmParser();
+	});
+
+	// Remarks without line tables could only name the function.
+	if(!Opts.RemarksFile.empty())
+		Opts.DebugInfo = true;
+
+	std::unique_ptr<Impl> I(new Impl(std::move(Opts)));
+	if(auto Err = I->initialize())
+		return Err;
+	return std::unique_ptr<KaleidoscopeEngine>(new KaleidoscopeEngine(std::move(I)));
+}
+
+llvm::orc::KaleidoscopeEngine::KaleidoscopeEngine(std::unique_ptr<Impl> I) : I(std::move(I)) {}
+
+llvm::orc::KaleidoscopeEngine::~KaleidoscopeEngine() = default;
+
+/// TakeDiagnostics - The errors reported since Diags was last emptied, as an
+/// Error, emptying it again.
+static llvm::Error TakeDiagnostics(Diagnostics &Diags)
+{
+	if(Diags.Text.empty())
+		return llvm::Error::success();
+	auto Err = llvm::make_error<llvm::StringError>(llvm::StringRef(Diags.Text).rtrim(),
+	                                               llvm::inconvertibleErrorCode());
+	Diags.Text.clear();
+	return Err;
+}
+
+llvm::Error llvm::orc::KaleidoscopeEngine::compile(llvm::StringRef Source,
+                                                  std::vector<double> *Results)
+{
+	Lexer Lex(Source);
+	Parser P(Lex, I->Diags, I->TheTelemetry);
+	I->Diags.Text.clear();
+	I->Mainloop(P, nullptr, Results);
+	return TakeDiagnostics(I->Diags);
+}
+
+llvm::Error llvm::orc::KaleidoscopeEngine::compileBatch(llvm::StringRef Source,
+                                                       std::vector<ExpressionFn> &Exprs)
+{
+	Lexer Lex(Source);
+	Parser P(Lex, I->Diags, I->TheTelemetry);
+	I->Diags.Text.clear();
+	// Definitions finish their own modules as they go; expressions pile up in
+	// the current one and are all resolved by a single lookup at the end.
+	std::vector<std::string> Names;
+	// The expressions run after everything has been compiled, so nothing
+	// could be specialized; don't pay for recording arguments.
+	auto ArgProfile = std::move(I->TheArgProfile);
+	P.getNextToken();
+	while(P.CurTok != tok_eof)
+	{
+		switch(P.CurTok)
+		{
+			case ';':
+				P.getNextToken();
+				break;
+			case tok_def:
+				I->HandleDefinition(P);
+				break;
+			case tok_extern:
+				I->HandleExtern(P);
+				break;
+			case tok_import:
+				I->HandleImport(P);
+				break;
+			default:
+				Names.push_back(I->HandleBatchExpression(P));
+				break;
+		}
+	}
+	if(auto Err = I->FinishModule())
+		I->Diags.report(std::move(Err));
+	I->TheArgProfile = std::move(ArgProfile);
+
+	std::vector<std::string> Compiled;
+	for(auto &Name : Names)
+		if(!Name.empty())
+			Compiled.push_back(Name);
+	std::vector<llvm::JITTargetAddress> Addrs;
+	if(!Compiled.empty())
+	{
+		TelemetryScope S(I->TheTelemetry, Phase::Lookup);
+		auto Resolved = I->TheJIT->lookupAll(*I->TheJD, Compiled);
+		if(!Resolved)
+			I->Diags.report(Resolved.takeError());
+		else
+			Addrs = std::move(*Resolved);
+	}
+
+	auto Addr = Addrs.begin();
+	for(auto &Name : Names)
+	{
+		ExpressionFn Fn = nullptr;
+		if(!Name.empty() && Addr != Addrs.end())
+			Fn = reinterpret_cast<ExpressionFn>(static_cast<uintptr_t>(*Addr++));
+		Exprs.push_back(Fn);
+	}
+	return TakeDiagnostics(I->Diags);
+}
+
+llvm::Error llvm::orc::KaleidoscopeEngine::compileLibrary(llvm::StringRef Source,
+                                                         llvm::raw_ostream &OS)
+{
+	Lexer Lex(Source);
+	Parser P(Lex, I->Diags, I->TheTelemetry);
+	I->Diags.Text.clear();
+	// Whatever is pending belongs to the engine, not the library.
+	if(auto Err = I->FinishModule())
+		I->Diags.report(std::move(Err));
+	I->LibraryContext = std::make_unique<llvm::LLVMContext>();
+	I->LibraryModule = std::make_unique<llvm::Module>(I->Opts.SourceName, *I->LibraryContext);
+	I->LibraryModule->setDataLayout(I->TheJIT->getDataLayout());
+	// Profile counters and argument slots live in this process; a library
+	// must not bake their addresses into its code.
+	auto *Profile = I->TheProfile;
+	auto ArgProfile = std::move(I->TheArgProfile);
+	I->TheProfile = nullptr;
+	P.getNextToken();
+	while(P.CurTok != tok_eof)
+	{
+		switch(P.CurTok)
+		{
+			case ';':
+				P.getNextToken();
+				break;
+			case tok_def:
+				I->HandleDefinition(P);
+				break;
+			case tok_extern:
+				I->HandleExtern(P);
+				break;
+			case tok_import:
+				I->HandleImport(P);
+				break;
+			default:
+				I->Diags.report("Top-level expressions are not allowed in a library");
+				if(!P.ParseTopLevelExpr("library.expr"))
+					P.getNextToken();
+				break;
+		}
+	}
+	if(auto Err = I->FinishModule())
+		I->Diags.report(std::move(Err));
+
+	I->TheProfile = Profile;
+	I->TheArgProfile = std::move(ArgProfile);
+
+	I->WriteLibraryExports();
+	if(llvm::verifyModule(*I->LibraryModule, &llvm::errs()))
+		I->Diags.report("The library failed to verify");
+	else
+		llvm::WriteBitcodeToFile(*I->LibraryModule, OS);
+	// The definitions were only declared to the engine; now give it the code,
+	// and point their stubs at it.
+	std::vector<std::string> Defined;
+	for(auto &KV : I->DefinitionVersions)
+		if(auto *F = I->LibraryModule->getFunction(I->getSymbolName(KV.first)))
+			if(!F->isDeclaration())
+				Defined.push_back(KV.first);
+	auto Library = std::move(I->LibraryModule);
+	if(auto Err = I->TheJIT->addModule(
+	       llvm::orc::ThreadSafeModule(std::move(Library), std::move(I->LibraryContext)),
+	       I->TheJD->getDefaultResourceTracker()))
+		I->Diags.report(std::move(Err));
+	else
+		for(auto &Name : Defined)
+			if(auto Err = I->TheJIT->redirect(*I->TheJD, Name + ".stub", I->getSymbolName(Name)))
+				I->Diags.report(std::move(Err));
+	return TakeDiagnostics(I->Diags);
+}
+
+llvm::Expected<double> llvm::orc::KaleidoscopeEngine::evaluate(llvm::StringRef Expr)
+{
+	Lexer Lex(Expr);
+	Parser P(Lex, I->Diags, I->TheTelemetry);
+	I->Diags.Text.clear();
+	P.getNextToken();
+	if(P.CurTok == tok_def || P.CurTok == tok_extern || P.CurTok == tok_import ||
+	   P.CurTok == tok_eof)
+		return llvm::createStringError(llvm::inconvertibleErrorCode(), "expected an expression");
+
+	auto Result = I->HandleTopLevelExpression(P);
+	if(auto Err = TakeDiagnostics(I->Diags))
+		return Err;
+	while(P.CurTok == ';')
+		P.getNextToken();
+	if(P.CurTok != tok_eof)
+		return llvm::createStringError(llvm::inconvertibleErrorCode(),
+		                               "unexpected input after the expression");
+	return *Result;
+}
+
+void llvm::orc::KaleidoscopeEngine::runInteractive(llvm::function_ref<void()> OnPrompt)
+{
+	Lexer Lex;
+	Parser P(Lex, I->Diags, I->TheTelemetry);
+	// Errors were printed as they happened; only compile() needs them kept.
+	I->Mainloop(P, [&] {
+		I->Diags.Text.clear();
+		if(OnPrompt)
+			OnPrompt();
+	});
+}
+
+void llvm::orc::KaleidoscopeEngine::runPipelined()
+{
+	Lexer Lex;
+	I->PipelinedLoop(Lex);
+}
+
+/// getEntryPoint - Name's entry point, resolving its address on first use.
+llvm::Expected<EngineImpl::EntryPoint *> EngineImpl::getEntryPoint(llvm::StringRef Name)
+{
+	auto EI = EntryPoints.find(Name.str());
+	if(EI != EntryPoints.end())
+		return &EI->second;
+
+	auto PI = FunctionProtos.find(Name.str());
+	if(PI == FunctionProtos.end())
+		return llvm::createStringError(llvm::inconvertibleErrorCode(),
+		                               "no function named '%s'", Name.str().c_str());
+	auto Sym = TheJIT->lookup(*TheJD, getSymbolName(Name.str()));
+	if(!Sym)
+		return Sym.takeError();
+	EntryPoint &EP = EntryPoints[Name.str()];
+	EP.Arity = PI->second->getArgs().size();
+	EP.Address = Sym->getAddress();
+	return &EP;
+}
+
+/// EmitApplyTrampoline - Compile and resolve
+///   double Name.apply(const double *Args) { return Name(Args[0], ...); }
+/// so hosts can call Name without knowing its arity at compile time. The
+/// '.' keeps the name out of the language's reach.
+llvm::Error EngineImpl::EmitApplyTrampoline(const std::string &Name, EntryPoint &EP)
+{
+	BeginItem("trampoline");
+	llvm::Function *Callee = getFunction(Name);
+	llvm::Type *DoubleTy = llvm::Type::getDoubleTy(*TheContext);
+	llvm::FunctionType *FT = llvm::FunctionType::get(DoubleTy, {DoubleTy->getPointerTo()}, false);
+	llvm::Function *Apply = llvm::Function::Create(FT, llvm::Function::ExternalLinkage,
+	                                               getSymbolName(Name) + ".apply", TheModule.get());
+	Builder->SetInsertPoint(llvm::BasicBlock::Create(*TheContext, "entry", Apply));
+	std::vector<llvm::Value *> Args;
+	for(unsigned i = 0; i != EP.Arity; ++i)
+		Args.push_back(Builder->CreateLoad(
+				DoubleTy, Builder->CreateConstInBoundsGEP1_64(DoubleTy, Apply->getArg(0), i), "arg"));
+	Builder->CreateRet(Builder->CreateCall(Callee, Args, "calltmp"));
+	RecordIR(Apply);
+
+	if(auto Err = FinishModule())
+		return Err;
+	auto Sym = TheJIT->lookup(*TheJD, getSymbolName(Name) + ".apply");
+	if(!Sym)
+		return Sym.takeError();
+	EP.Apply = Sym->getAddress();
+	return llvm::Error::success();
+}
+
+llvm::Expected<llvm::JITTargetAddress>
+llvm::orc::KaleidoscopeEngine::lookupAddress(llvm::StringRef Name, unsigned Arity)
+{
+	auto EP = I->getEntryPoint(Name);
+	if(!EP)
+		return EP.takeError();
+	if((*EP)->Arity != Arity)
+		return llvm::createStringError(llvm::inconvertibleErrorCode(),
+		                               "'%s' takes %u argument(s), not %u", Name.str().c_str(),
+		                               (*EP)->Arity, Arity);
+	return (*EP)->Address;
+}
+
+llvm::Expected<llvm::orc::KaleidoscopeEngine::GenericFunction>
+llvm::orc::KaleidoscopeEngine::lookupGeneric(llvm::StringRef Name)
+{
+	auto EP = I->getEntryPoint(Name);
+	if(!EP)
+		return EP.takeError();
+	if(!(*EP)->Apply)
+		if(auto Err = I->EmitApplyTrampoline(Name.str(), **EP))
+			return Err;
+	return GenericFunction(
+			reinterpret_cast<GenericFunction::ApplyFn>(static_cast<uintptr_t>((*EP)->Apply)),
+			(*EP)->Arity);
+}
+
+llvm::Expected<double> llvm::orc::KaleidoscopeEngine::call(llvm::StringRef Name,
+                                                           llvm::ArrayRef<double> Args)
+{
+	auto F = lookupGeneric(Name);
+	if(!F)
+		return F.takeError();
+	if(Args.size() != F->getArity())
+		return llvm::createStringError(llvm::inconvertibleErrorCode(),
+		                               "'%s' takes %u argument(s), not %zu", Name.str().c_str(),
+		                               F->getArity(), Args.size());
+	return (*F)(Args);
+}
+
+llvm::orc::KaleidoscopeJIT &llvm::orc::KaleidoscopeEngine::getJIT()
+{
+	return *I->TheJIT;
+}
+
+/********************************************************* driver **************************************************************/
+#ifndef KALEIDOSCOPE_NO_MAIN
+static llvm::cl::opt<bool> PerfMap(
+		"perf-map",
+		llvm::cl::desc("Write JIT'd function names to /tmp/perf-<pid>.map for perf report"));
+
+static llvm::cl::opt<bool> PerfJitdump(
+		"perf-jitdump",
+		llvm::cl::desc("Write a jitdump file for 'perf record -k 1' + 'perf inject --jit'"));
+
+/// OptLevel - 1 runs the per-function cleanup passes as each function is
+/// built; 2 and 3 run LLVM's default module pipeline (inliner, loop and SLP
+/// vectorizers, ...) over every module before it is handed to the JIT.
+static llvm::cl::opt<unsigned> OptLevel(
+		"O",
+		llvm::cl::desc("Optimization level (0-3)"),
+		llvm::cl::Prefix,
+		llvm::cl::ZeroOrMore,
+#ifdef OPTIMIZATION
+		llvm::cl::init(1));
+#else
+		llvm::cl::init(0));
+#endif
+
+static llvm::cl::opt<bool> EmitDebugInfo(
+		"debug-info",
+		llvm::cl::desc("Emit DWARF line tables for JIT'd code and register them with debuggers and profilers"));
+
+static llvm::cl::opt<std::string> SourceName(
+		"source-name",
+		llvm::cl::desc("Source file name recorded in the debug info"),
+		llvm::cl::init("<stdin>"));
+
+static llvm::cl::opt<bool> ProfileExecution(
+		"profile-counters",
+		llvm::cl::desc("Count function calls, if arms and loop iterations; report at exit and on SIGUSR1"));
+
+static llvm::cl::opt<std::string> ProfileOut(
+		"profile-out",
+		llvm::cl::desc("Count executions like -profile-counters and save the counts to this file at exit"),
+		llvm::cl::value_desc("filename"));
+
+static llvm::cl::opt<std::string> ProfileIn(
+		"profile-in",
+		llvm::cl::desc("Annotate code with the counts a -profile-out run saved to this file"),
+		llvm::cl::value_desc("filename"));
+
+/// TheProfile - Counter registry; null unless -profile-counters or
+/// -profile-out, in which case codegen emits no instrumentation at all.
+static std::unique_ptr<llvm::orc::ProfileCounters> TheProfile;
+/// TheProfileData - Counts from an earlier run; null unless -profile-in.
+static std::unique_ptr<llvm::orc::ProfileData> TheProfileData;
+
+static llvm::cl::opt<bool> Specialize(
+		"specialize",
+		llvm::cl::desc("Specialize functions on arguments that keep the same value, guarded at call sites"));
+
+static llvm::cl::opt<unsigned> SpecializeThreshold(
+		"specialize-threshold",
+		llvm::cl::desc("Calls in a row with the same argument value before specializing on it"),
+		llvm::cl::init(100));
+
+static llvm::cl::opt<llvm::orc::HugePageKind> JITHugePages(
+		"jit-huge-pages",
+		llvm::cl::desc("Back the JIT code/data slabs with huge pages"),
+		llvm::cl::init(llvm::orc::HugePageKind::None),
+		llvm::cl::values(
+			clEnumValN(llvm::orc::HugePageKind::None, "none", "Ordinary pages"),
+			clEnumValN(llvm::orc::HugePageKind::Transparent, "thp", "Transparent huge pages (madvise)"),
+			clEnumValN(llvm::orc::HugePageKind::Explicit, "explicit", "MAP_HUGETLB, falling back to thp")));
+
+static llvm::cl::opt<bool> JITMemoryStats(
+		"jit-memory-stats",
+		llvm::cl::desc("Print JIT slab pool usage at exit"));
+
+static llvm::cl::opt<unsigned> CompileThreads(
+		"compile-threads",
+		llvm::cl::desc("Background compile threads (0: compile on the requesting thread)"),
+		llvm::cl::init(0));
+
+static llvm::cl::opt<bool> Speculate(
+		"speculate",
+		llvm::cl::desc("Compile likely callees of top-level expressions in the background"));
+
+static llvm::cl::opt<double> SpeculationThreshold(
+		"speculation-threshold",
+		llvm::cl::desc("Minimum expected-call score for a callee to be speculated"),
+		llvm::cl::init(0.5));
+
+// Declared before TheEngine so it outlives the JIT's final notifications.
+static std::unique_ptr<llvm::orc::PerfMapListener> ThePerfMapListener;
+
+static llvm::cl::opt<bool> PassStats(
+		"pass-stats",
+		llvm::cl::desc("Print per-pass time, run count and instruction delta for the session at exit"));
+
+static llvm::cl::opt<std::string> PassStatsJSON(
+		"pass-stats-json",
+		llvm::cl::desc("Write the -pass-stats table as JSON to this file"),
+		llvm::cl::value_desc("filename"));
+
+/// ThePassStats - Session-wide pass totals; null (and no instrumentation is
+/// registered at all) unless -pass-stats or -pass-stats-json is given.
+static std::unique_ptr<llvm::orc::PassStatistics> ThePassStats;
+static llvm::ExitOnError ExitOnErr;
+
+static llvm::cl::opt<std::string> RemarksFile(
+		"remarks-file",
+		llvm::cl::desc("Write optimization remarks (passed, missed, analysis) to this file; implies -debug-info"),
+		llvm::cl::value_desc("filename"));
+
+static llvm::cl::opt<std::string> RemarksFormat(
+		"remarks-format",
+		llvm::cl::desc("Remark format: yaml (one file for the session) or bitstream (<file>.<n> per module)"),
+		llvm::cl::init("yaml"));
+
+static llvm::cl::opt<std::string> RemarksFilter(
+		"remarks-filter",
+		llvm::cl::desc("Only keep remarks from passes matching this regex (e.g. 'inline|loop-vectorize')"),
+		llvm::cl::value_desc("regex"));
+
+static llvm::cl::opt<std::string> TelemetryJSON(
+		"telemetry-json",
+		llvm::cl::desc("Write per-item compile phase timings as JSON to this file"),
+		llvm::cl::value_desc("filename"));
+
+static llvm::cl::opt<std::string> TelemetryTrace(
+		"telemetry-trace",
+		llvm::cl::desc("Write compile phases as a Chrome trace-event file"),
+		llvm::cl::value_desc("filename"));
+
+static llvm::cl::opt<std::string> Serve(
+		"serve",
+		llvm::cl::desc("Serve evaluation requests on this Unix domain socket instead of reading stdin"),
+		llvm::cl::value_desc("path"));
+
+static llvm::cl::opt<unsigned> ServeThreads(
+		"serve-threads",
+		llvm::cl::desc("Worker threads for -serve (0 = one per hardware thread)"),
+		llvm::cl::init(0));
+
+static llvm::cl::opt<std::string> ServeMode(
+		"serve-mode",
+		llvm::cl::desc("Permissions of the -serve socket, in octal"),
+		llvm::cl::value_desc("mode"),
+		llvm::cl::init("0600"));
+
+static llvm::cl::list<std::string> ServeAllowLibrary(
+		"serve-allow-library",
+		llvm::cl::desc("Let -serve sessions use extern \"lib\" with this shared library"),
+		llvm::cl::value_desc("lib.so"));
+
+static llvm::cl::opt<std::string> Prelude(
+		"prelude",
+		llvm::cl::desc("With -serve, compile this file once and make its functions callable from every session"),
+		llvm::cl::value_desc("filename"));
+
+static llvm::cl::opt<bool> Quiet(
+		"quiet",
+		llvm::cl::desc("Don't print each item's IR; prompts, results and errors still are"),
+		llvm::cl::init(false));
+
+static llvm::cl::opt<bool> Pipeline(
+		"pipeline",
+		llvm::cl::desc("Overlap parsing, compiling and running of stdin's items, running compiles at background priority"),
+		llvm::cl::init(false));
+
+static llvm::cl::opt<bool> ParallelExprs(
+		"parallel-exprs",
+		llvm::cl::desc("With -pipeline, run side-effect-free top-level expressions concurrently"),
+		llvm::cl::init(false));
+
+static llvm::cl::opt<bool> ResultCache(
+		"result-cache",
+		llvm::cl::desc("Answer repeated pure top-level expressions from a cache instead of running them again"),
+		llvm::cl::init(false));
+
+static llvm::cl::opt<bool> Batch(
+		"batch",
+		llvm::cl::desc("Compile all of stdin first, then run its top-level expressions in parallel and print their values in input order"),
+		llvm::cl::init(false));
+
+static llvm::cl::opt<unsigned> BatchThreads(
+		"batch-threads",
+		llvm::cl::desc("Worker threads for -batch (0 = one per core)"),
+		llvm::cl::init(0));
+
+static llvm::cl::opt<bool> BatchPin(
+		"batch-pin",
+		llvm::cl::desc("Pin -batch workers to cores"),
+		llvm::cl::init(true));
+
+static llvm::cl::opt<std::string> EmitLibrary(
+		"emit-library",
+		llvm::cl::desc("Compile stdin's definitions into a library for import instead of running it"),
+		llvm::cl::value_desc("filename.klib"));
+
+static llvm::cl::opt<std::string> CodeCache(
+		"code-cache",
+		llvm::cl::desc("Share compiled code with other processes using this cache name, through POSIX shared memory"),
+		llvm::cl::value_desc("name"));
+
+static llvm::cl::opt<unsigned> CodeCacheSize(
+		"code-cache-size",
+		llvm::cl::desc("Most memory -code-cache entries may take, in MiB; the least recently used go first"),
+		llvm::cl::init(64));
+
+static llvm::cl::opt<bool> CodeCacheClear(
+		"code-cache-clear",
+		llvm::cl::desc("Remove every entry of -code-cache and exit"),
+		llvm::cl::init(false));
+
+static llvm::cl::opt<bool> CodeCacheStats(
+		"code-cache-stats",
+		llvm::cl::desc("Print -code-cache hits, misses and stores on exit"),
+		llvm::cl::init(false));
+
+static llvm::cl::opt<bool> InlineRuntime(
+		"inline-runtime",
+		llvm::cl::desc("Link the runtime's bitcode into modules that call it, so it can be inlined"),
+		llvm::cl::init(true));
+
+static llvm::cl::opt<bool> ProcessSymbols(
+		"process-symbols",
+		llvm::cl::desc("Resolve externs that are neither builtins nor from a named library by searching the whole process"),
+		llvm::cl::init(true));
+
+static llvm::cl::list<std::string> LibraryPath(
+		"library-path",
+		llvm::cl::desc("Also search this directory for the .klib files import loads"),
+		llvm::cl::value_desc("directory"));
+
+/// TheCodeCache - Objects shared with other processes; null without -code-cache.
+static std::unique_ptr<llvm::orc::SharedObjectCache> TheCodeCache;
+
+/// TheTelemetry - Per-item pipeline timings; null unless -telemetry-json or
+/// -telemetry-trace asked for them, in which case every Scope is a no-op.
+static std::unique_ptr<llvm::orc::CompileTelemetry> TheTelemetry;
+
+static std::unique_ptr<llvm::orc::KaleidoscopeEngine> TheEngine;
+
+/// TheServer - Set while -serve is running, for SIGINT/SIGTERM to stop it.
+static llvm::orc::EvaluationServer *TheServer = nullptr;
+
+static void StopServer(int)
+{
+	if(TheServer)
+		TheServer->stop();
+}
+
+/// RunBatch - Compile all of stdin into TheEngine, then shard its top-level
+/// expressions across the batch workers.
+static void RunBatch()
+{
+	auto Buf = llvm::MemoryBuffer::getSTDIN();
+	if(!Buf)
+		ExitOnErr(llvm::errorCodeToError(Buf.getError()));
+	std::vector<llvm::orc::KaleidoscopeEngine::ExpressionFn> Exprs;
+	if(auto Err = TheEngine->compileBatch((*Buf)->getBuffer(), Exprs))
+		llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "Error:");
+	llvm::orc::BatchEvaluator Evaluator(BatchThreads, BatchPin);
+	Evaluator.run(Exprs, llvm::outs());
+	llvm::outs().flush();
+}
+
+/// RunEmitLibrary - Compile all of stdin into the library -emit-library names.
+static int RunEmitLibrary()
+{
+	auto Buf = llvm::MemoryBuffer::getSTDIN();
+	if(!Buf)
+		ExitOnErr(llvm::errorCodeToError(Buf.getError()));
+	std::error_code EC;
+	llvm::raw_fd_ostream OS(EmitLibrary, EC);
+	if(EC)
+		ExitOnErr(llvm::createFileError(EmitLibrary, llvm::errorCodeToError(EC)));
+	if(auto Err = TheEngine->compileLibrary((*Buf)->getBuffer(), OS))
+	{
+		llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "Error:");
+		OS.close();
+		llvm::sys::fs::remove(EmitLibrary);
+		return 1;
+	}
 	return 0;
 }
+
+/// RunServer - Compile -prelude into TheEngine and serve sessions on top of
+/// it until interrupted.
+static void RunServer(llvm::orc::KaleidoscopeEngine::Options SessionOpts)
+{
+	if(!Prelude.empty())
+	{
+		auto Buf = llvm::MemoryBuffer::getFile(Prelude);
+		if(!Buf)
+			ExitOnErr(llvm::createFileError(Prelude, llvm::errorCodeToError(Buf.getError())));
+		ExitOnErr(TheEngine->compile((*Buf)->getBuffer()));
+	}
+
+	// Each session keeps its own prototypes and site numbering, so only what
+	// is safe to share between concurrently compiling engines carries over.
+	SessionOpts.Telemetry = nullptr;
+	SessionOpts.Profile = nullptr;
+	SessionOpts.ProfileIn = nullptr;
+	SessionOpts.RemarksFile.clear();
+	// Sessions run whatever clients send, in this process: they get the
+	// builtins, the prelude and the allowed libraries, not every symbol in
+	// the process. That narrows what a request can reach but does not isolate
+	// it; a crashing or endless request still affects every session.
+	SessionOpts.ProcessSymbols = false;
+	SessionOpts.RestrictLibraries = true;
+	SessionOpts.AllowedLibraries = ServeAllowLibrary;
+	unsigned Mode;
+	if(llvm::StringRef(ServeMode).getAsInteger(8, Mode) || Mode > 0777)
+		ExitOnErr(llvm::createStringError(llvm::inconvertibleErrorCode(),
+		                                  "invalid -serve-mode '%s'", ServeMode.c_str()));
+	llvm::orc::EvaluationServer Server(*TheEngine, std::move(SessionOpts), ServeThreads);
+	ExitOnErr(Server.listen(Serve, Mode));
+	TheServer = &Server;
+	signal(SIGINT, StopServer);
+	signal(SIGTERM, StopServer);
+	fprintf(stderr, "serving on %s\n", Serve.c_str());
+	Server.run();
+	TheServer = nullptr;
+}
+
+/// WriteTelemetry - Export everything recorded so far to the requested files.
+static void WriteTelemetry()
+{
+	if(!TheTelemetry)
+		return;
+
+	std::error_code EC;
+	if(!TelemetryJSON.empty())
+	{
+		llvm::raw_fd_ostream OS(TelemetryJSON, EC);
+		if(EC)
+			fprintf(stderr, "Error: %s: %s\n", TelemetryJSON.c_str(), EC.message().c_str());
+		else
+			TheTelemetry->writeSummary(OS);
+	}
+	if(!TelemetryTrace.empty())
+	{
+		llvm::raw_fd_ostream OS(TelemetryTrace, EC);
+		if(EC)
+			fprintf(stderr, "Error: %s: %s\n", TelemetryTrace.c_str(), EC.message().c_str());
+		else
+			TheTelemetry->writeChromeTrace(OS);
+	}
+}
+
+/// WritePassStats - Report the session's pass totals where requested.
+static void WritePassStats()
+{
+	if(!ThePassStats)
+		return;
+	if(PassStats)
+		ThePassStats->print(llvm::errs());
+	if(!PassStatsJSON.empty())
+	{
+		std::error_code EC;
+		llvm::raw_fd_ostream OS(PassStatsJSON, EC);
+		if(EC)
+			fprintf(stderr, "Error: %s: %s\n", PassStatsJSON.c_str(), EC.message().c_str());
+		else
+			ThePassStats->writeJSON(OS);
+	}
+}
+
+/// WriteProfile - Print the execution counters collected so far.
+static void WriteProfile()
+{
+	if(!TheProfile)
+		return;
+	if(ProfileExecution)
+		TheProfile->print(llvm::errs());
+	if(!ProfileOut.empty())
+	{
+		std::error_code EC;
+		llvm::raw_fd_ostream OS(ProfileOut, EC);
+		if(EC)
+			fprintf(stderr, "Error: %s: %s\n", ProfileOut.c_str(), EC.message().c_str());
+		else
+			TheProfile->write(OS);
+	}
+}
+
+/// ReportsMutex - Held while exporting on SIGUSR1, so exports never overlap.
+static std::mutex ReportsMutex;
+static bool ReportsStopped = false;
+
+/// StartReportThread - Export telemetry and the execution profile whenever
+/// the process gets SIGUSR1, from a thread of its own, so a report arrives
+/// even while JIT'd code runs. SIGUSR1 stays blocked in every other thread;
+/// call this before starting any.
+static void StartReportThread()
+{
+	sigset_t Set;
+	sigemptyset(&Set);
+	sigaddset(&Set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &Set, nullptr);
+	std::thread([Set] {
+		for(;;)
+		{
+			int Sig;
+			if(sigwait(&Set, &Sig) != 0)
+				continue;
+			std::lock_guard<std::mutex> Lock(ReportsMutex);
+			if(ReportsStopped)
+				return;
+			WriteTelemetry();
+			WriteProfile();
+		}
+	}).detach();
+}
+
+/// StopReportThread - Wait for any export in progress and ignore SIGUSR1 from
+/// now on, before the final reports are written.
+static void StopReportThread()
+{
+	std::lock_guard<std::mutex> Lock(ReportsMutex);
+	ReportsStopped = true;
+}
+
+/// PrintJITMemoryStats - Report how much of the shared slab pools is live.
+static void PrintJITMemoryStats()
+{
+	auto &Pool = TheEngine->getJIT().getMemoryPool();
+	fprintf(stderr, "jit memory: code %zu/%zu, rodata %zu/%zu, rwdata %zu/%zu bytes in use/mapped\n",
+			Pool.Code.getBytesInUse(), Pool.Code.getBytesMapped(),
+			Pool.ROData.getBytesInUse(), Pool.ROData.getBytesMapped(),
+			Pool.RWData.getBytesInUse(), Pool.RWData.getBytesMapped());
+}
+
+int main(int argc, char **argv)
+{
+	llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
+
+	if(!TelemetryJSON.empty() || !TelemetryTrace.empty())
+		TheTelemetry = std::make_unique<llvm::orc::CompileTelemetry>();
+	if(ProfileExecution || !ProfileOut.empty())
+		TheProfile = std::make_unique<llvm::orc::ProfileCounters>();
+	if(!ProfileIn.empty())
+		TheProfileData = ExitOnErr(llvm::orc::ProfileData::Create(ProfileIn));
+	if(PassStats || !PassStatsJSON.empty())
+		ThePassStats = std::make_unique<llvm::orc::PassStatistics>();
+
+	llvm::orc::KaleidoscopeEngine::Options Opts;
+	Opts.OptLevel = OptLevel;
+	Opts.DebugInfo = EmitDebugInfo;
+	Opts.SourceName = SourceName;
+	Opts.FramePointers = PerfMap || PerfJitdump;
+	Opts.Profile = TheProfile.get();
+	Opts.ProfileIn = TheProfileData.get();
+	Opts.Specialize = Specialize;
+	Opts.SpecializeThreshold = SpecializeThreshold;
+	Opts.Speculate = Speculate;
+	Opts.SpeculationThreshold = SpeculationThreshold;
+	Opts.HugePages = JITHugePages;
+	Opts.CompileThreads = CompileThreads;
+	// The pipeline's compile stage hands modules to a pool and moves on.
+	if(Pipeline && !Opts.CompileThreads)
+		Opts.CompileThreads = std::max(1u, std::thread::hardware_concurrency());
+	Opts.BackgroundCompiles = Pipeline;
+	Opts.ParallelExpressions = ParallelExprs;
+	Opts.CacheResults = ResultCache;
+	Opts.Telemetry = TheTelemetry.get();
+	Opts.PassStats = ThePassStats.get();
+	Opts.RemarksFile = RemarksFile;
+	Opts.RemarksFormat = RemarksFormat;
+	Opts.RemarksFilter = RemarksFilter;
+	Opts.LibraryPath = LibraryPath;
+	// The runtime is linked into us, so its addresses are known up front.
+	Opts.Builtins["putchard"] = llvm::pointerToJITTargetAddress(&putchard);
+	Opts.Builtins["printd"] = llvm::pointerToJITTargetAddress(&printd);
+	Opts.ProcessSymbols = ProcessSymbols;
+	if(!CodeCache.empty())
+		TheCodeCache = std::make_unique<llvm::orc::SharedObjectCache>(
+				CodeCache, uint64_t(CodeCacheSize) << 20);
+	if(CodeCacheClear)
+	{
+		if(TheCodeCache)
+			TheCodeCache->removeAll();
+		return 0;
+	}
+	Opts.CodeCache = TheCodeCache.get();
+	if(InlineRuntime)
+		Opts.RuntimeBitcode = llvm::StringRef(_binary_runtime_bc_start,
+		                                      _binary_runtime_bc_end - _binary_runtime_bc_start);
+	Opts.Echo = Serve.empty() && !Batch && EmitLibrary.empty();
+	Opts.EchoIR = !Quiet;
+	if(TheTelemetry || TheProfile)
+		StartReportThread();
+	TheEngine = ExitOnErr(llvm::orc::KaleidoscopeEngine::Create(Opts));
+
+	auto &JIT = TheEngine->getJIT();
+	if(PerfMap)
+	{
+		ThePerfMapListener = ExitOnErr(llvm::orc::PerfMapListener::Create());
+		JIT.registerJITEventListener(*ThePerfMapListener);
+	}
+	if(EmitDebugInfo || !RemarksFile.empty())
+		JIT.registerJITEventListener(*llvm::JITEventListener::createGDBRegistrationListener());
+	if(PerfJitdump)
+	{
+		if(auto *L = llvm::JITEventListener::createPerfJITEventListener())
+			JIT.registerJITEventListener(*L);
+		else
+			fprintf(stderr, "Warning: this LLVM was built without perf jitdump support\n");
+	}
+
+	if(!EmitLibrary.empty())
+		return RunEmitLibrary();
+	if(!Serve.empty())
+		RunServer(std::move(Opts));
+	else if(Batch && Specialize)
+	{
+		fprintf(stderr, "Error: -specialize does not apply to -batch, which runs expressions after compiling them all\n");
+		return 1;
+	}
+	else if(Batch)
+		RunBatch();
+	else if(Pipeline)
+		TheEngine->runPipelined();
+	else
+		TheEngine->runInteractive();
+
+	if(JITMemoryStats)
+		PrintJITMemoryStats();
+	if(CodeCacheStats && TheCodeCache)
+		fprintf(stderr, "code cache: %llu hits, %llu misses, %llu stores\n",
+				(unsigned long long)TheCodeCache->getHits(),
+				(unsigned long long)TheCodeCache->getMisses(),
+				(unsigned long long)TheCodeCache->getStores());
+	StopReportThread();
+	WriteTelemetry();
+	WritePassStats();
+	WriteProfile();
+
+	return 0;
+}
+#endif
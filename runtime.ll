@@ -0,0 +1,33 @@
+; runtime.ll - The Kaleidoscope runtime as LLVM IR.
+;
+; Assembled to bitcode and embedded in ast, which links the functions a module
+; calls into it before optimizing it, so they can be inlined. myfun.c is the
+; same runtime as a shared library, for code that calls it some other way;
+; keep the two in sync.
+
+%struct._IO_FILE = type opaque
+
+@stderr = external global %struct._IO_FILE*
+@.printd.fmt = private unnamed_addr constant [4 x i8] c"%f\0A\00"
+
+declare i32 @fputc(i32, %struct._IO_FILE*)
+declare i32 @fprintf(%struct._IO_FILE*, i8*, ...)
+
+; putchard - putchar that takes a double and returns 0.
+define double @putchard(double %X) {
+entry:
+  %c = fptosi double %X to i8
+  %ch = sext i8 %c to i32
+  %err = load %struct._IO_FILE*, %struct._IO_FILE** @stderr
+  %0 = call i32 @fputc(i32 %ch, %struct._IO_FILE* %err)
+  ret double 0.000000e+00
+}
+
+; printd - printf that takes a double prints it as "%f\n", returning 0.
+define double @printd(double %X) {
+entry:
+  %err = load %struct._IO_FILE*, %struct._IO_FILE** @stderr
+  %fmt = getelementptr inbounds [4 x i8], [4 x i8]* @.printd.fmt, i64 0, i64 0
+  %0 = call i32 (%struct._IO_FILE*, i8*, ...) @fprintf(%struct._IO_FILE* %err, i8* %fmt, double %X)
+  ret double 0.000000e+00
+}